@@ -1,6 +1,5 @@
 #include <stdio.h>
 #define MVM_IMPLEMENTATION
-#define MVM_DUMMY_IO_IMPLEMENTATION
 #include <mvm.h>
 #include "assembler.h"
 #define SV_IMPLEMENTATION
@@ -258,6 +257,8 @@ void raw_words(assembler *a) {
 void assembler_pass(assembler *a) {
     while(!sv_is_empty(a->s) && a->success) {
         a->s = sv_skipspace(a->s);
+        if(sv_is_empty(a->s))
+            break;
         sv tok = sv_tok(a->s);
         if(sv_eq(tok, sv_from_cstr(".org"))) {
             a->s = sv_chop_tok(a->s);
@@ -278,8 +279,14 @@ void assembler_pass(assembler *a) {
     }
 }
 
+static void write_symbols(assembler *a, FILE *f) {
+    for(size_t i = 0; i < a->label_counter; i++)
+        fprintf(f, "%08x %.*s\n", a->labels[i].addr,
+                (int)a->labels[i].name.len, a->labels[i].name.data);
+}
+
 ssize_t assemble(const char *file_name, const char *source, uint8_t *rom,
-                 size_t rom_capacity) {
+                 size_t rom_capacity, FILE *symbols) {
     assembler a = assembler_new(file_name, source, rom, rom_capacity);
 
     assembler_pass(&a);
@@ -292,6 +299,8 @@ ssize_t assemble(const char *file_name, const char *source, uint8_t *rom,
     assembler_pass(&a);
 
     printf("%lu labels\n", a.label_counter);
+    if(a.success && symbols)
+        write_symbols(&a, symbols);
 
     if(a.success)
         return a.pc_max;
@@ -1,6 +1,9 @@
 #include <stddef.h>
+#include <stdio.h>
 #include <sys/types.h>
 #include <stdint.h>
 
+// Writes the labels to symbols, if not NULL, one per line as their address in
+// hexadecimal followed by their name.
 ssize_t assemble(const char *file_name, const char *source, uint8_t *rom,
-                 size_t rom_capacity);
\ No newline at end of file
+                 size_t rom_capacity, FILE *symbols);
\ No newline at end of file
@@ -8,10 +8,11 @@ int main(int argc, char *argv[]) {
     char *source = NULL;
     uint8_t *rom = NULL;
     FILE *f = NULL;
+    FILE *symbols = NULL;
 
     int rc = 0;
-    if(argc != 3) {
-        FATAL("usage: %s source.asm output.rom", argv[0]);
+    if(argc != 3 && argc != 4) {
+        FATAL("usage: %s source.asm output.rom [output.sym]", argv[0]);
         rc = 1;
         goto cleanup;
     }
@@ -60,14 +61,29 @@ int main(int argc, char *argv[]) {
         goto cleanup;
     }
 
+    if(argc == 4) {
+        symbols = fopen(argv[3], "w");
+        if(!symbols) {
+            fclose(f);
+            FATAL("failed to open symbol file `%s`", argv[3]);
+            rc = 1;
+            goto cleanup;
+        }
+    }
+
     printf("assembling...\n");
-    size_t bytes_to_write = assemble(source_path, source, rom, MVM_RAM_SIZE);
+    size_t bytes_to_write =
+        assemble(source_path, source, rom, MVM_RAM_SIZE, symbols);
     if(bytes_to_write != -1)
         fwrite(rom, bytes_to_write, 1, f);
     else
         rc = 1;
 
     fclose(f);
+    if(symbols && fclose(symbols)) {
+        FATAL("failed to write the symbols");
+        rc = 1;
+    }
 
 cleanup:
     if(rom)
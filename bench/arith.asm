@@ -0,0 +1,12 @@
+.org $40
+
+push 0
+
+:loop
+    push 1 add
+    dup push 3 mul
+    push 12345 xor
+    push 7 sub
+    ovr add
+    pop
+    ,loop jmp
@@ -0,0 +1,208 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#define MVM_IMPLEMENTATION
+#include "mvm.h"
+#define MVM_GUARD_IMPLEMENTATION
+#include "mvm_guard.h"
+#include "util.h"
+
+// Runs every rom for the same number of instructions, from a fresh vm each
+// time, and prints the speed of the interpreter as JSON. The kernels loop
+// forever: one stopping before the count is an error.
+
+#define DEFAULT_INSTRUCTIONS 50000000
+#define DEFAULT_RUNS 5
+#define FRAMEBUFFER_ADDR 0x80000000
+#define FRAMEBUFFER_WIDTH 320
+#define FRAMEBUFFER_HEIGHT 240
+
+static uint16_t frame_buffer[FRAMEBUFFER_WIDTH * FRAMEBUFFER_HEIGHT];
+
+// the frame buffer goes through the host rather than vm->mmio, to time the
+// handlers
+static void bench_write16(mvm *vm, uint32_t addr, uint16_t value) {
+    const uint32_t pixel = (addr - FRAMEBUFFER_ADDR) / sizeof(uint16_t);
+    if(addr < FRAMEBUFFER_ADDR || pixel >= MVM_ARRAYSIZE(frame_buffer)) {
+        vm->status = MVM_SEGMENTATION_FAULT;
+        return;
+    }
+    frame_buffer[pixel] = value;
+}
+
+// compile time options changing the interpreter
+static const char *const options[] = {
+#ifdef MVM_TOS_CACHE
+    "MVM_TOS_CACHE",
+#endif
+#ifdef MVM_GUARD_STACKS
+    "MVM_GUARD_STACKS",
+#endif
+#ifdef MVM_GUARD_RAM
+    "MVM_GUARD_RAM",
+#endif
+#ifdef MVM_NO_COMPUTED_GOTO
+    "MVM_NO_COMPUTED_GOTO",
+#endif
+#ifdef MVM_NO_SUPERINSTRUCTIONS
+    "MVM_NO_SUPERINSTRUCTIONS",
+#endif
+#ifdef MVM_STATS
+    "MVM_STATS",
+#endif
+#ifdef MVM_TAIL_CALLS
+    "MVM_TAIL_CALLS",
+#endif
+    NULL,
+};
+
+typedef struct summary {
+    double mean, stddev;
+} summary;
+
+static summary summarize(const double *x, uint32_t n) {
+    summary s = {0, 0};
+    for(uint32_t i = 0; i < n; i++)
+        s.mean += x[i];
+    s.mean /= n;
+    for(uint32_t i = 0; i < n; i++)
+        s.stddev += (x[i] - s.mean) * (x[i] - s.mean);
+    s.stddev = n > 1 ? sqrt(s.stddev / (n - 1)) : 0;
+    return s;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Times one run of instructions from the rom, with the instruction cache if
+// icache is set, and the code verified first if verify is set too. Returns the
+// time in seconds, or a negative value if the vm can't be set up or stops
+// early.
+static double run(const uint8_t *rom, uint8_t *ram, mvm_icache *icache,
+                  int verify, uint32_t instructions, const mvm_host *host,
+                  const char *name) {
+    static mvm vm;
+    memcpy(ram, rom, MVM_RAM_SIZE);
+    mvm_init(&vm, ram);
+    vm.host = host;
+    if(!mvm_guard_init(&vm)) {
+        FATAL("failed to set up the guard pages");
+        return -1;
+    }
+    mvm_icache_attach(&vm, icache);
+    if(icache && verify)
+        mvm_verify(&vm);
+    const double start = now();
+    mvm_guard_run(&vm, instructions);
+    const double elapsed = now() - start;
+    const enum mvm_status status = vm.status;
+    mvm_guard_free(&vm);
+    if(status != MVM_RUNNING) {
+        FATAL("%s stopped early: %s", name, mvm_status_name[status]);
+        return -1;
+    }
+    return elapsed;
+}
+
+// fails on an empty rom, which would time zeroed ram
+static int load(const char *path, uint8_t *rom) {
+    FILE *f = fopen(path, "rb");
+    if(!f)
+        return 0;
+    memset(rom, 0, MVM_RAM_SIZE);
+    const size_t size = fread(rom, 1, MVM_RAM_SIZE, f);
+    const int ok = size && !ferror(f);
+    fclose(f);
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t instructions = DEFAULT_INSTRUCTIONS;
+    uint32_t runs = DEFAULT_RUNS;
+    int arg = 1;
+    for(; arg + 1 < argc && argv[arg][0] == '-'; arg += 2) {
+        if(strcmp(argv[arg], "-n") == 0)
+            instructions = (uint32_t)strtoul(argv[arg + 1], NULL, 10);
+        else if(strcmp(argv[arg], "-r") == 0)
+            runs = (uint32_t)strtoul(argv[arg + 1], NULL, 10);
+        else
+            break;
+    }
+    if(arg >= argc || argv[arg][0] == '-' || !instructions || !runs) {
+        FATAL("usage: %s [-n instructions] [-r runs] file.rom...", argv[0]);
+        return 1;
+    }
+
+    uint8_t *rom = (uint8_t *)malloc(MVM_RAM_SIZE);
+    uint8_t *ram = (uint8_t *)malloc(MVM_RAM_SIZE);
+    mvm_icache *icache = (mvm_icache *)malloc(sizeof(mvm_icache));
+    double *mips = (double *)malloc(runs * sizeof(double));
+    double *ns = (double *)malloc(runs * sizeof(double));
+    if(!rom || !ram || !icache || !mips || !ns) {
+        FATAL("failed to allocate memory");
+        return 1;
+    }
+    mvm_host host = mvm_default_host;
+    host.mmio_write16 = bench_write16;
+
+    printf("{\n  \"instructions\": %u,\n  \"runs\": %u,\n  \"options\": [",
+           instructions, runs);
+    for(uint32_t i = 0; options[i]; i++)
+        printf("%s\"%s\"", i ? ", " : "", options[i]);
+    printf("],\n  \"results\": [");
+    int ret = 0;
+    for(int i = 0; arg + i < argc && !ret; i++) {
+        const char *path = argv[arg + i];
+        if(!load(path, rom)) {
+            FATAL("failed to load %s", path);
+            ret = 1;
+            break;
+        }
+        // the raw interpreter, the cached one, then the cached one running
+        // verified code as the runner does
+        for(int mode = 0; mode < 3 && !ret; mode++) {
+            static const char *const names[] = {"raw", "cached", "verified"};
+            mvm_icache *cache = mode ? icache : NULL;
+            const int verify = mode == 2;
+            // warms up the caches of the host and its clock
+            if(run(rom, ram, cache, verify, instructions, &host, path) < 0) {
+                ret = 1;
+                break;
+            }
+            for(uint32_t r = 0; r < runs; r++) {
+                const double t =
+                    run(rom, ram, cache, verify, instructions, &host, path);
+                if(t < 0) {
+                    ret = 1;
+                    break;
+                }
+                mips[r] = instructions / t * 1e-6;
+                ns[r] = t * 1e9 / instructions;
+            }
+            if(ret)
+                break;
+            const summary m = summarize(mips, runs);
+            const summary n = summarize(ns, runs);
+            printf("%s\n    {\"rom\": \"%s\", \"interpreter\": \"%s\", "
+                   "\"mips\": %.2f, \"mips_stddev\": %.2f, "
+                   "\"ns_per_instruction\": %.3f, "
+                   "\"ns_per_instruction_stddev\": %.3f}",
+                   i || mode ? "," : "", path, names[mode],
+                   m.mean, m.stddev, n.mean, n.stddev);
+        }
+    }
+    printf("\n  ]\n}\n");
+
+    free(rom);
+    free(ram);
+    free(icache);
+    free(mips);
+    free(ns);
+    return ret;
+}
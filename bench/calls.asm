@@ -0,0 +1,16 @@
+.org $40
+
+:main
+    push 18 ,fib call
+    ,main jmp
+
+:fib
+    dup push 2 ltu ,fib/leaf cjmp
+    dup push 1 sub ,fib call
+    push 2 sub ,fib call
+    ret
+:fib/leaf
+    ,sum lw add ,sum sw
+    ret
+
+:sum .word 0
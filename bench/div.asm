@@ -0,0 +1,10 @@
+.org $40
+
+push 1
+
+:loop
+    push 1 add
+    push -1000003 ovr div
+    ovr rem
+    pop
+    ,loop jmp
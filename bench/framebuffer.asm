@@ -0,0 +1,11 @@
+.org $40
+
+:frame
+    push 0
+
+:pixel
+    dup dup dup add push $80000000 add sh
+    push 1 add
+    dup push 76800 ltu ,pixel cjmp
+    pop
+    ,frame jmp
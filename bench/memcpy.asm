@@ -0,0 +1,12 @@
+.org $40
+
+:main
+    push 0
+
+:copy
+    dup push $1000 add lw
+    ovr push $2000 add sw
+    push 4 add
+    dup push $1000 ltu ,copy cjmp
+    pop
+    ,main jmp
@@ -32,9 +32,62 @@ instructions = [
     "cjmp",
     "call",
     "ret",
-    "sys"
+    "sys",
+    "ei",
+    "di",
+    "reti",
+    "wfi"
 ]
 
+# size in bytes of the immediate operand following the opcode
+immediates = {
+    "push_u8": 1,
+    "push_u16": 2,
+    "push32": 4
+}
+
+# values popped from and pushed to the data stack, in that order
+stack_effects = {
+    "brk": (0, 0),
+    "push_u8": (0, 1),
+    "push_u16": (0, 1),
+    "push32": (0, 1),
+    "dup": (1, 2),
+    "ovr": (2, 3),
+    "pop": (1, 0),
+    "add": (2, 1),
+    "sub": (2, 1),
+    "mul": (2, 1),
+    "div": (2, 1),
+    "divu": (2, 1),
+    "rem": (2, 1),
+    "remu": (2, 1),
+    "xor": (2, 1),
+    "eq": (2, 1),
+    "neq": (2, 1),
+    "lt": (2, 1),
+    "gte": (2, 1),
+    "ltu": (2, 1),
+    "gteu": (2, 1),
+    "lb": (1, 1),
+    "lh": (1, 1),
+    "lw": (1, 1),
+    "lbu": (1, 1),
+    "lhu": (1, 1),
+    "sb": (2, 0),
+    "sh": (2, 0),
+    "sw": (2, 0),
+    "jmp": (1, 0),
+    "cjmp": (2, 0),
+    "call": (1, 0),
+    "ret": (0, 0),
+    "sys": (0, 0), # depends on the host
+    "ei": (1, 0),
+    "di": (1, 0),
+    "reti": (0, 0),
+    "wfi": (0, 0)
+}
+
 status = [
     "running",
     "halted",
@@ -44,7 +97,8 @@ status = [
     "return stack overflow",
     "return stack underflow",
     "invalid instruction",
-    "division by zero"
+    "division by zero",
+    "waiting"
 ]
 
 class Generator:
@@ -80,6 +134,7 @@ class EnumsGenerator(Generator):
         for s in status:
             enum_entry = s.replace(" ", "_").upper()
             self.emit(f"    MVM_{enum_entry},")
+        self.emit("    MVM_STATUS_COUNT,")
         self.emit("};")
 
 
@@ -105,6 +160,38 @@ class LoadStoreGenerator(Generator):
     def gen(self):
             types = [(sign, size) for sign in ["u", "i"] for size in [8, 16, 32]]
             type_map = {"i": "int", "u": "uint"}
+            # accesses outside of ram, through the mapped ranges of vm->mmio
+            for t in types:
+                sign, size = t
+                type_name = f"{type_map[sign]}{size}_t"
+                self.emit(f"static {type_map[sign]}32_t mvm_mmio_load_{sign}{size}(mvm *vm, uint32_t addr) {{")
+                self.emit(f"    const mvm_page *page = mvm_mmio_lookup(vm, addr, sizeof({type_name}));")
+                self.emit(f"    MVM_STAT(mmio_reads[{[8, 16, 32].index(size)}]);")
+                self.emit("    if(!page)")
+                self.emit(f"        return vm->host->mmio_read{size}(vm, addr);")
+                self.emit("    if(page->mem)")
+                self.emit(f"        return MVM_BITCAST({type_name}, page->mem[addr - page->base]);")
+                call = "    return page->device->read("
+                self.emit(f"{call}vm, page->device->data, addr - page->base,")
+                self.emit(f"{' ' * len(call)}sizeof({type_name}));")
+                self.emit("}")
+                self.emit("")
+
+            for s in [8, 16, 32]:
+                self.emit(f"static void mvm_mmio_store_{s}(mvm *vm, uint32_t addr, uint{s}_t value) {{")
+                self.emit(f"    const mvm_page *page = mvm_mmio_lookup(vm, addr, sizeof(uint{s}_t));")
+                self.emit(f"    MVM_STAT(mmio_writes[{[8, 16, 32].index(s)}]);")
+                self.emit("    if(!page)")
+                self.emit(f"        vm->host->mmio_write{s}(vm, addr, value);")
+                self.emit("    else if(page->mem)")
+                self.emit(f"        MVM_BITCAST(uint{s}_t, page->mem[addr - page->base]) = value;")
+                self.emit("    else")
+                call = "        page->device->write("
+                self.emit(f"{call}vm, page->device->data, addr - page->base,")
+                self.emit(f"{' ' * len(call)}sizeof(uint{s}_t), value);")
+                self.emit("}")
+                self.emit("")
+
             for t in types:
                 sign, size = t
                 type_name = f"{type_map[sign]}{size}_t"
@@ -112,19 +199,93 @@ class LoadStoreGenerator(Generator):
                 self.emit(f"    if(addr <= MVM_RAM_SIZE - sizeof({type_name}))")
                 self.emit(f"        return MVM_BITCAST({type_name}, vm->ram[addr]);")
                 self.emit("    else")
-                self.emit(f"        return mmio_read{size}(vm, addr);")
+                self.emit(f"        return mvm_mmio_load_{sign}{size}(vm, addr);")
                 self.emit("}")
                 self.emit("")
 
             for s in [8, 16, 32]:
                 self.emit(f"void mvm_store_{s}(mvm *vm, uint32_t addr, uint{s}_t value) {{")
-                self.emit(f"    if(addr <= MVM_RAM_SIZE - sizeof(uint{s}_t))")
+                self.emit(f"    if(addr <= MVM_RAM_SIZE - sizeof(uint{s}_t)) {{")
                 self.emit(f"        MVM_BITCAST(uint{s}_t, vm->ram[addr]) = value;")
-                self.emit("    else")
-                self.emit(f"        mmio_write{s}(vm, addr, value);")
+                self.emit(f"        if(vm->icache && MVM_BITCAST(uint{s}_t, vm->icache->code[addr]))")
+                self.emit(f"            mvm_icache_write(vm, addr, sizeof(uint{s}_t));")
+                self.emit("    } else")
+                self.emit(f"        mvm_mmio_store_{s}(vm, addr, value);")
+                self.emit("}")
+                self.emit("")
+
+            # without the bounds check, for the interpreter (see mvm_guard.h)
+            self.emit("#ifdef MVM_GUARD_RAM")
+            self.emit("")
+            for t in types:
+                sign, size = t
+                if t == ("i", 32): # no instruction loads it
+                    continue
+                type_name = f"{type_map[sign]}{size}_t"
+                self.emit(f"static {type_map[sign]}32_t mvm_load_{sign}{size}_guarded(mvm *vm, uint32_t addr) {{")
+                self.emit(f"    return MVM_BITCAST({type_name}, vm->ram[addr]);")
+                self.emit("}")
+                self.emit("")
+
+            for s in [8, 16, 32]:
+                self.emit(f"static void mvm_store_{s}_guarded(mvm *vm, uint32_t addr, uint{s}_t value) {{")
+                self.emit(f"    MVM_BITCAST(uint{s}_t, vm->ram[addr]) = value;")
+                self.emit(f"    if(vm->icache && MVM_BITCAST(uint{s}_t, vm->icache->code[addr]))")
+                self.emit(f"        mvm_icache_write(vm, addr, sizeof(uint{s}_t));")
                 self.emit("}")
                 self.emit("")
 
+            self.emit("#endif")
+
+class DispatchTableGenerator(Generator):
+    def __init__(self, f):
+        super().__init__(f, "// Generated dispatch table start", "// Generated dispatch table end")
+
+    def gen(self):
+        labels = [f"&&label##_OP_{i.upper()}" for i in instructions]
+        self.emit(f"{'#define MVM_DISPATCH_OPCODES(label)':<79}\\")
+        line = "   "
+        for l in labels:
+            if len(line) + len(l) + 2 > 78:
+                self.emit(f"{line:<79}\\")
+                line = "   "
+            line += f" {l},"
+        self.emit(line)
+
+class HandlerTableGenerator(Generator):
+    def __init__(self, f):
+        super().__init__(f, "// Generated handler table start", "// Generated handler table end")
+
+    def gen(self):
+        handlers = [f"prefix##_OP_{i.upper()}" for i in instructions]
+        self.emit(f"{'#define MVM_HANDLER_OPCODES(prefix)':<79}\\")
+        line = "   "
+        for h in handlers:
+            if len(line) + len(h) + 2 > 78:
+                self.emit(f"{line:<79}\\")
+                line = "   "
+            line += f" {h},"
+        self.emit(line)
+
+class OpcodeInfoGenerator(Generator):
+    def __init__(self, f):
+        super().__init__(f, "// Generated opcode info start", "// Generated opcode info end")
+
+    def gen(self):
+        self.emit("const uint8_t mvm_op_imm_size[] = {")
+        for i in instructions:
+            self.emit(f"    {immediates.get(i, 0)}, // {i}")
+        self.emit("};")
+        self.emit("")
+        self.emit("const uint8_t mvm_op_pops[] = {")
+        for i in instructions:
+            self.emit(f"    {stack_effects[i][0]}, // {i}")
+        self.emit("};")
+        self.emit("")
+        self.emit("const uint8_t mvm_op_pushes[] = {")
+        for i in instructions:
+            self.emit(f"    {stack_effects[i][1]}, // {i}")
+        self.emit("};")
 
 
 with open("src/mvm.h", "r") as f:
@@ -132,7 +293,9 @@ with open("src/mvm.h", "r") as f:
 
 f = open("src/mvm.h", "w")
 
-gens = [EnumsGenerator(f), StringsArraysGenerator(f), LoadStoreGenerator(f)]
+gens = [EnumsGenerator(f), StringsArraysGenerator(f), LoadStoreGenerator(f),
+        DispatchTableGenerator(f), HandlerTableGenerator(f),
+        OpcodeInfoGenerator(f)]
 
 inside_block = False
 
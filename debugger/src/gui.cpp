@@ -1,6 +1,11 @@
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 #include <imgui.h>
 #if defined(IMGUI_IMPL_OPENGL_ES2)
 #include <SDL_opengles2.h>
@@ -9,103 +14,189 @@
 #endif
 #define MVM_IMPLEMENTATION
 #include <mvm.h>
+#define MVM_GUARD_IMPLEMENTATION
+#include <mvm_guard.h>
+#define MVM_FORK_IMPLEMENTATION
+#include <mvm_fork.h>
+#define MVM_SNAPSHOT_IMPLEMENTATION
+#include <mvm_snapshot.h>
 #include "gui.h"
 
+#define FRAMEBUFFER_SIZE (FRAMEBUFFER_WIDTH * FRAMEBUFFER_HEIGHT * sizeof(uint16_t))
+// vector of the interrupt raised on every frame while running, which wakes a
+// vm waiting on wfi
+#define FRAME_INTERRUPT 0
+// time a frame gives the vm before the watchdog stops it
+#define RUN_BUDGET std::chrono::milliseconds(8)
+
 static mvm vm;
-static uint8_t *ram = nullptr;
+static mvm_icache *icache = nullptr;
+// conditions stopping the runs: breakpoints and the watched range set from the
+// window, and the depth of the function that step out leaves
+static mvm_until until;
+static uint32_t breakpoint = MVM_ENTRY_POINT;
+static mvm_mmio mmio;
+// the frame buffer when the vm comes from a snapshot
+static mvm_section snapshot_section = {FRAMEBUFFER_SECTION, FRAMEBUFFER_SIZE, nullptr};
+static bool from_snapshot = false;
+static const char *save_path = nullptr;
+static const char *save_result = "";
 static char load_error[1024] = {0};
 static bool gui_is_init = false;
 
+// Stops the vm once a run of gui() has used its budget, so that the window
+// keeps its frame rate whatever the instructions cost.
+static std::thread watchdog;
+static std::mutex watchdog_lock;
+static std::condition_variable watchdog_wake;
+static std::chrono::steady_clock::time_point watchdog_deadline;
+static bool watchdog_armed = false, watchdog_quit = false;
+
 bool run = false;
 
+struct screen {
+    uint16_t *frame_buffer;
+    bool dirty;
+};
+
+static mvm_host host;
+static screen display;
 GLuint fb_texture;
-uint16_t *frame_buffer = nullptr;
-bool dirty = false;
 
-void syscall(mvm *vm) {
+static void gui_syscall(mvm *vm) {
     uint32_t syscall_num = mvm_pop(vm);
     MVM_CHECK();
     switch(syscall_num) {
     case 0:
-        dirty = true;
+        ((screen *)vm->user)->dirty = true;
         break;
     }
 }
 
-uint32_t mmio_read8(mvm *vm, uint32_t addr) {
-    vm->status = MVM_SEGMENTATION_FAULT;
-    return 0;
-}
+static bool load_rom(const char *rom_path) {
+    mvm_image rom;
+    if(!mvm_image_load(&rom, rom_path)) {
+        snprintf(load_error, sizeof(load_error), "failed to load %s: %s", rom_path, strerror(errno));
+        return false;
+    }
+    const bool forked = mvm_fork(&rom, &vm);
+    mvm_image_free(&rom);
+    if(!forked) {
+        strncpy(load_error, "failed to map the ram", sizeof(load_error));
+        return false;
+    }
 
-uint32_t mmio_read16(mvm *vm, uint32_t addr) {
-    vm->status = MVM_SEGMENTATION_FAULT;
-    return 0;
+    display.frame_buffer = (uint16_t*)calloc(1, FRAMEBUFFER_SIZE);
+    if(!display.frame_buffer) {
+        mvm_fork_free(&vm);
+        strncpy(load_error, "failed to allocate memory for the frame buffer", sizeof(load_error));
+        return false;
+    }
+    return true;
 }
 
-uint32_t mmio_read32(mvm *vm, uint32_t addr) {
-    vm->status = MVM_SEGMENTATION_FAULT;
-    return 0;
+// a vm saved as it halted resumes past the brk
+static bool load_snapshot(const char *snapshot_path) {
+    if(!mvm_snapshot_load(snapshot_path, &vm, &snapshot_section, 1)) {
+        snprintf(load_error, sizeof(load_error), "failed to load the snapshot %s", snapshot_path);
+        return false;
+    }
+    from_snapshot = true;
+    display.frame_buffer = (uint16_t *)snapshot_section.mem;
+    display.dirty = true;
+    if(vm.status == MVM_HALTED)
+        vm.status = MVM_RUNNING;
+    return true;
 }
 
-void mmio_write8(mvm *vm, uint32_t addr, uint8_t value) {
-    vm->status = MVM_SEGMENTATION_FAULT;
+// frees the vm loaded by load_rom or load_snapshot
+static void free_vm() {
+    if(from_snapshot) {
+        mvm_snapshot_free(&vm, &snapshot_section, 1);
+    } else {
+        mvm_fork_free(&vm);
+        free(display.frame_buffer);
+    }
+    display.frame_buffer = nullptr;
 }
 
-void mmio_write16(mvm *vm, uint32_t addr, uint16_t value) {
-    const uint32_t base_fb_addr = 0x80000000;
-    if(addr >= base_fb_addr && addr < base_fb_addr + FRAMEBUFFER_WIDTH * FRAMEBUFFER_HEIGHT * sizeof(uint16_t)) {
-        frame_buffer[addr - base_fb_addr] = value;
-    } else {
-        vm->status = MVM_SEGMENTATION_FAULT;
+static void watchdog_loop() {
+    std::unique_lock<std::mutex> lock(watchdog_lock);
+    while(!watchdog_quit) {
+        if(!watchdog_armed) {
+            watchdog_wake.wait(lock);
+        } else if(std::chrono::steady_clock::now() >= watchdog_deadline) {
+            mvm_stop(&vm);
+            watchdog_armed = false;
+        } else {
+            watchdog_wake.wait_until(lock, watchdog_deadline);
+        }
     }
 }
 
-void mmio_write32(mvm *vm, uint32_t addr, uint32_t value) {
-    vm->status = MVM_SEGMENTATION_FAULT;
+// Runs the vm until it stops on its own, meets a condition of until, which
+// pauses it, or the watchdog ends the run.
+static void run_frame() {
+    {
+        std::lock_guard<std::mutex> lock(watchdog_lock);
+        watchdog_deadline = std::chrono::steady_clock::now() + RUN_BUDGET;
+        watchdog_armed = true;
+    }
+    watchdog_wake.notify_one();
+    mvm_guard_run_until(&vm, UINT32_MAX, &until);
+    {
+        std::lock_guard<std::mutex> lock(watchdog_lock);
+        watchdog_armed = false;
+    }
+    if(until.hit) {
+        run = false;
+        until.depth = 0;
+    }
 }
 
 void gui_init(int argc, char *argv[]) {
-    if(argc != 2) {
-        snprintf(load_error, sizeof(load_error), "usage: %s file.rom", argv[0]);
-        return;
+    const char *load_path = nullptr;
+    int arg = 1;
+    for(; arg + 1 < argc && strncmp(argv[arg], "--", 2) == 0; arg += 2) {
+        if(strcmp(argv[arg], "--load-snapshot") == 0)
+            load_path = argv[arg + 1];
+        else if(strcmp(argv[arg], "--save-snapshot") == 0)
+            save_path = argv[arg + 1];
+        else
+            break;
     }
-    const char *rom_path = argv[1];
-    FILE *f = fopen(rom_path, "rb");
-    ram = (uint8_t *)malloc(MVM_RAM_SIZE);
-    if(!ram) {
-        strncpy(load_error, "failed to allocate memory", sizeof(load_error));
+    if(arg != argc - (load_path ? 0 : 1) || (arg < argc && argv[arg][0] == '-')) {
+        snprintf(load_error, sizeof(load_error),
+                 "usage: %s [--save-snapshot file] (file.rom | --load-snapshot file)",
+                 argv[0]);
         return;
     }
-    if(!f) {
-        snprintf(load_error, sizeof(load_error), "failed to open %s", rom_path);
+    if(!(load_path ? load_snapshot(load_path) : load_rom(argv[arg])))
         return;
-    }
+    mvm_until_init(&until);
 
-    fseek(f, 0, SEEK_END);
-    const long rom_size = ftell(f);
-    if(rom_size > MVM_RAM_SIZE) {
-        fclose(f);
-        strncpy(load_error, "rom file is too big to fit in ram",
-                sizeof(load_error));
-        return;
-    }
-    fseek(f, 0, SEEK_SET);
-    size_t n = fread(ram, rom_size, 1, f);
-    fclose(f);
-    if(n != 1) {
-        strncpy(load_error, "failed to load the rom file", sizeof(load_error));
+    host = mvm_default_host;
+    host.syscall = gui_syscall;
+    vm.host = &host;
+    vm.user = &display;
+
+    icache = (mvm_icache *)malloc(sizeof(mvm_icache));
+    if(!icache) {
+        free_vm();
+        strncpy(load_error, "failed to allocate memory for the instruction cache", sizeof(load_error));
         return;
     }
+    mvm_icache_attach(&vm, icache);
 
-    mvm_init(&vm, ram);
-
-    frame_buffer = (uint16_t*)calloc(1, FRAMEBUFFER_WIDTH * FRAMEBUFFER_HEIGHT * sizeof(uint16_t));
-    if(!frame_buffer) {
-        free(ram);
-        ram = nullptr;
-        strncpy(load_error, "failed to allocate memory for the frame buffer", sizeof(load_error));
+    mvm_mmio_init(&mmio);
+    if(!mvm_mmio_map_memory(&mmio, FRAMEBUFFER_ADDR, FRAMEBUFFER_SIZE, display.frame_buffer)) {
+        free(icache);
+        icache = nullptr;
+        free_vm();
+        strncpy(load_error, "failed to map the frame buffer", sizeof(load_error));
         return;
     }
+    vm.mmio = &mmio;
 
     glGenTextures(1, &fb_texture);
     glBindTexture(GL_TEXTURE_2D, fb_texture);
@@ -113,13 +204,24 @@ void gui_init(int argc, char *argv[]) {
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, FRAMEBUFFER_WIDTH, FRAMEBUFFER_HEIGHT, 0, GL_RGB, GL_UNSIGNED_SHORT_5_6_5, nullptr);
 
-
+    watchdog = std::thread(watchdog_loop);
     gui_is_init = true;
 }
 
 void gui_deinit() {
-    if(ram)
-        free(vm.ram);
+    if(watchdog.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(watchdog_lock);
+            watchdog_quit = true;
+        }
+        watchdog_wake.notify_one();
+        watchdog.join();
+    }
+    mvm_mmio_free(&mmio);
+    if(gui_is_init)
+        free_vm();
+    if(icache)
+        free(icache);
     if(gui_is_init)
         glDeleteTextures(1, &fb_texture);
 }
@@ -153,11 +255,35 @@ static void vm_state() {
     if(run) 
         ImGui::BeginDisabled();
     if(ImGui::Button("step"))
-        mvm_run(&vm, 1);
+        mvm_guard_run(&vm, 1);
+    ImGui::SameLine();
+    // runs until the function returns, below the depth it runs at
+    if(ImGui::Button("step out") && vm.rsp) {
+        until.depth = vm.rsp;
+        run = true;
+    }
     if(run) 
         ImGui::EndDisabled();
     ImGui::SameLine();
-    ImGui::Checkbox("run", &run);
+    if(ImGui::Checkbox("run", &run))
+        until.depth = 0;
+    ImGui::InputScalar("##breakpoint", ImGuiDataType_U32, &breakpoint, nullptr,
+                       nullptr, "%08x", ImGuiInputTextFlags_CharsHexadecimal);
+    ImGui::SameLine();
+    if(ImGui::Button("toggle breakpoint"))
+        mvm_until_break(&until, breakpoint, !mvm_until_breaks(&until, breakpoint));
+    ImGui::InputScalar("watch address", ImGuiDataType_U32, &until.watch_addr,
+                       nullptr, nullptr, "%08x",
+                       ImGuiInputTextFlags_CharsHexadecimal);
+    ImGui::InputScalar("watch size", ImGuiDataType_U32, &until.watch_size);
+    if(save_path) {
+        if(ImGui::Button("save snapshot")) {
+            const mvm_section section = {FRAMEBUFFER_SECTION, FRAMEBUFFER_SIZE, display.frame_buffer};
+            save_result = mvm_snapshot_save(save_path, &vm, &section, 1) ? "saved" : "failed to save";
+        }
+        ImGui::SameLine();
+        ImGui::Text("%s", save_result);
+    }
     ImGui::End();
 }
 
@@ -199,6 +325,9 @@ static void ram_display() {
                 if(vm.pc == i)
                     ImGui::TextColored(ImVec4(1.0f, 0.0f, 1.0f, 1.0f), "0x%02x",
                                        vm.ram[i]);
+                else if(mvm_until_breaks(&until, i))
+                    ImGui::TextColored(ImVec4(1.0f, 0.0f, 0.0f, 1.0f), "0x%02x",
+                                       vm.ram[i]);
                 else
                     ImGui::Text("0x%02x", vm.ram[i]);
                 if((i + 1) % n_columns == 0)
@@ -222,9 +351,9 @@ static void vm_memory() {
 static void vm_screen() {
     if(*load_error)
         return;
-    if(dirty) {
+    if(display.dirty) {
         glBindTexture(GL_TEXTURE_2D, fb_texture);
-        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, FRAMEBUFFER_WIDTH, FRAMEBUFFER_HEIGHT, GL_RGB, GL_UNSIGNED_SHORT_5_6_5, frame_buffer);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, FRAMEBUFFER_WIDTH, FRAMEBUFFER_HEIGHT, GL_RGB, GL_UNSIGNED_SHORT_5_6_5, display.frame_buffer);
         glBindTexture(GL_TEXTURE_2D, 0);
     }
     ImGui::Begin("Screen");
@@ -233,8 +362,10 @@ static void vm_screen() {
 }
 
 void gui() {
-    if(!*load_error && run)
-        mvm_run(&vm, 1000000);
+    if(!*load_error && run) {
+        mvm_interrupt(&vm, FRAME_INTERRUPT);
+        run_frame();
+    }
     vm_state();
     vm_memory();
     vm_screen();
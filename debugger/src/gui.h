@@ -1,5 +1,8 @@
 #define FRAMEBUFFER_WIDTH 320
 #define FRAMEBUFFER_HEIGHT 240
+#define FRAMEBUFFER_ADDR 0x80000000
+// id of the frame buffer in snapshots
+#define FRAMEBUFFER_SECTION 1
 
 void gui_init(int argc, char **argv);
 void gui_deinit(void);
@@ -1,89 +1,473 @@
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <time.h>
 #define MVM_IMPLEMENTATION
 #include "mvm.h"
+#define MVM_JIT_IMPLEMENTATION
+#include "mvm_jit.h"
+#define MVM_GUARD_IMPLEMENTATION
+#include "mvm_guard.h"
+#define MVM_BATCH_IMPLEMENTATION
+#include "mvm_batch.h"
+#define MVM_FORK_IMPLEMENTATION
+#include "mvm_fork.h"
+#define MVM_SNAPSHOT_IMPLEMENTATION
+#include "mvm_snapshot.h"
+#define MVM_PROFILE_IMPLEMENTATION
+#include "mvm_profile.h"
 #include "util.h"
 
 #define FRAMEBUFFER_WIDTH 320
 #define FRAMEBUFFER_HEIGHT 240
+#define FRAMEBUFFER_ADDR 0x80000000
+#define FRAMEBUFFER_SIZE (FRAMEBUFFER_WIDTH * FRAMEBUFFER_HEIGHT * 2)
+// id of the frame buffer in snapshots
+#define FRAMEBUFFER_SECTION 1
+// instructions a vm runs before the batch mode moves to the next one
+#define BATCH_SLICE 100000
+// instructions between the samples of the profiler, prime so as not to follow
+// the period of a loop
+#define PROFILE_PERIOD 997
+// vector of the interrupt raised by --timer
+#define TIMER_INTERRUPT 0
 
-void syscall(mvm *vm) {
+// of the runner of a single vm, all optional
+typedef struct options {
+    int use_jit;
+    const char *load_path;    // of a snapshot to run instead of a rom
+    const char *save_path;    // of the snapshot saved once the vm stops
+    const char *stats_path;   // of the counters of an MVM_STATS build
+    const char *profile_path; // of the collapsed stacks sampled
+    const char *symbols_path; // written by the assembler, for the profile
+    uint32_t profile_period;
+    uint32_t timer_period; // in microseconds, 0 without a timer
+} options;
 
+// raises TIMER_INTERRUPT every period
+typedef struct timer {
+    uint64_t period, next; // in nanoseconds of CLOCK_MONOTONIC
+} timer;
+
+typedef struct machine {
+    mvm vm;
+    enum { MACHINE_ROM, MACHINE_SNAPSHOT } origin;
+    mvm_icache *icache;
+    mvm_mmio mmio;
+    mvm_section frame_buffer; // mapped from a snapshot, or allocated
+} machine;
+
+static int load_rom(mvm_image *rom, const char *rom_path) {
+    if(!mvm_image_load(rom, rom_path)) {
+        FATAL("failed to load %s: %s", rom_path, strerror(errno));
+        return 0;
+    }
+    return 1;
 }
 
-uint32_t mmio_read8(mvm *vm, uint32_t addr) {
-    vm->status = MVM_SEGMENTATION_FAULT;
-    return 0;
+// Gives the vm set up in m its instruction cache, with the code verified, and
+// maps its frame buffer, allocated unless it comes from a snapshot.
+static int machine_attach(machine *m) {
+    m->frame_buffer.id = FRAMEBUFFER_SECTION;
+    m->frame_buffer.size = FRAMEBUFFER_SIZE;
+    if(m->origin != MACHINE_SNAPSHOT)
+        m->frame_buffer.mem = calloc(1, FRAMEBUFFER_SIZE);
+    m->icache = (mvm_icache *)malloc(sizeof(mvm_icache));
+    if(!m->frame_buffer.mem || !m->icache) {
+        if(m->origin != MACHINE_SNAPSHOT)
+            free(m->frame_buffer.mem);
+        free(m->icache);
+        FATAL("failed to allocate memory");
+        return 0;
+    }
+    mvm_icache_attach(&m->vm, m->icache);
+    mvm_verify(&m->vm);
+    mvm_mmio_init(&m->mmio);
+    if(!mvm_mmio_map_memory(&m->mmio, FRAMEBUFFER_ADDR, FRAMEBUFFER_SIZE,
+                            m->frame_buffer.mem)) {
+        if(m->origin != MACHINE_SNAPSHOT)
+            free(m->frame_buffer.mem);
+        free(m->icache);
+        FATAL("failed to map the frame buffer");
+        return 0;
+    }
+    m->vm.mmio = &m->mmio;
+    return 1;
 }
 
-uint32_t mmio_read16(mvm *vm, uint32_t addr) {
-    vm->status = MVM_SEGMENTATION_FAULT;
-    return 0;
+// starts m from the image of a rom
+static int machine_init(machine *m, const mvm_image *rom) {
+    m->origin = MACHINE_ROM;
+    if(!mvm_fork(rom, &m->vm)) {
+        FATAL("failed to map the ram");
+        return 0;
+    }
+    if(!machine_attach(m)) {
+        mvm_fork_free(&m->vm);
+        return 0;
+    }
+    return 1;
 }
 
-uint32_t mmio_read32(mvm *vm, uint32_t addr) {
-    vm->status = MVM_SEGMENTATION_FAULT;
-    return 0;
+// A vm saved as it halted resumes past the brk, so a rom can stop once it is
+// set up to make a snapshot to start from.
+static int machine_load(machine *m, const char *snapshot_path) {
+    m->origin = MACHINE_SNAPSHOT;
+    m->frame_buffer.id = FRAMEBUFFER_SECTION;
+    m->frame_buffer.size = FRAMEBUFFER_SIZE;
+    if(!mvm_snapshot_load(snapshot_path, &m->vm, &m->frame_buffer, 1)) {
+        FATAL("failed to load the snapshot %s", snapshot_path);
+        return 0;
+    }
+    if(!machine_attach(m)) {
+        mvm_snapshot_free(&m->vm, &m->frame_buffer, 1);
+        return 0;
+    }
+    if(m->vm.status == MVM_HALTED)
+        m->vm.status = MVM_RUNNING;
+    return 1;
 }
 
-void mmio_write8(mvm *vm, uint32_t addr, uint8_t value) {
-    vm->status = MVM_SEGMENTATION_FAULT;
+static uint64_t timer_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
 }
 
-void mmio_write16(mvm *vm, uint32_t addr, uint16_t value) {
-    const uint32_t base_fb_addr = 0x80000000;
-    if(addr >= base_fb_addr && addr < base_fb_addr + FRAMEBUFFER_WIDTH * FRAMEBUFFER_HEIGHT * sizeof(uint16_t)) {
-        // put a pixel inside the frame buffer
+static void timer_start(timer *t, uint32_t period) {
+    t->period = (uint64_t)period * 1000;
+    t->next = timer_now() + t->period;
+}
+
+// Raises the interrupt if the period ended, after sleeping until it does if
+// wait is set. Periods missed while the vm ran are raised only once.
+static void timer_tick(timer *t, mvm *vm, int wait) {
+    if(wait) {
+        const struct timespec ts = {(time_t)(t->next / 1000000000),
+                                    (long)(t->next % 1000000000)};
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+              EINTR)
+            ;
+    }
+    const uint64_t now = timer_now();
+    if(now < t->next)
+        return;
+    t->next += ((now - t->next) / t->period + 1) * t->period;
+    mvm_interrupt(vm, TIMER_INTERRUPT);
+}
+
+static void machine_free(machine *m) {
+    mvm_mmio_free(&m->mmio);
+    free(m->icache);
+    if(m->origin == MACHINE_SNAPSHOT) {
+        mvm_snapshot_free(&m->vm, &m->frame_buffer, 1);
     } else {
-        vm->status = MVM_SEGMENTATION_FAULT;
+        mvm_fork_free(&m->vm);
+        free(m->frame_buffer.mem);
     }
 }
 
-void mmio_write32(mvm *vm, uint32_t addr, uint32_t value) {
-    vm->status = MVM_SEGMENTATION_FAULT;
+#ifdef MVM_STATS
+
+typedef struct stats_pair {
+    uint32_t first, second;
+    uint64_t count;
+} stats_pair;
+
+static int compare_pairs(const void *a, const void *b) {
+    const uint64_t x = ((const stats_pair *)a)->count;
+    const uint64_t y = ((const stats_pair *)b)->count;
+    return (x < y) - (x > y);
 }
 
-int main(int argc, char *argv[]) {
-    if(argc != 2) {
-        FATAL("usage: %s file.rom", argv[0]);
+// Writes the counters as JSON: every opcode, the pairs executed at least once
+// from the most frequent, the syscalls by number, and the hits of each
+// superinstruction of icache.
+static void write_stats(FILE *f, const mvm_stats *stats,
+                        const mvm_icache *icache) {
+    static stats_pair pairs[MVM_OPCODE_COUNT * MVM_OPCODE_COUNT];
+    uint32_t pair_count = 0;
+    uint64_t total = 0;
+    for(uint32_t i = 0; i < MVM_OPCODE_COUNT; i++) {
+        total += stats->ops[i];
+        for(uint32_t j = 0; j < MVM_OPCODE_COUNT; j++) {
+            if(!stats->pairs[i][j])
+                continue;
+            pairs[pair_count].first = i;
+            pairs[pair_count].second = j;
+            pairs[pair_count].count = stats->pairs[i][j];
+            pair_count++;
+        }
+    }
+    qsort(pairs, pair_count, sizeof(stats_pair), compare_pairs);
+
+    fprintf(f, "{\n  \"instructions\": %llu,\n  \"ops\": {",
+            (unsigned long long)total);
+    for(uint32_t i = 0; i < MVM_OPCODE_COUNT; i++) {
+        fprintf(f, "%s\n    \"%s\": %llu", i ? "," : "", mvm_op_name[i],
+                (unsigned long long)stats->ops[i]);
+    }
+    fprintf(f, "\n  },\n  \"pairs\": [");
+    for(uint32_t i = 0; i < pair_count; i++) {
+        fprintf(f, "%s\n    [\"%s\", \"%s\", %llu]", i ? "," : "",
+                mvm_op_name[pairs[i].first], mvm_op_name[pairs[i].second],
+                (unsigned long long)pairs[i].count);
+    }
+    fprintf(f, "\n  ],\n  \"syscalls\": {");
+    for(uint32_t i = 0; i < MVM_STATS_SYSCALLS; i++) {
+        fprintf(f, "%s\n    \"%u%s\": %llu", i ? "," : "", i,
+                i == MVM_STATS_SYSCALLS - 1 ? "+" : "",
+                (unsigned long long)stats->syscalls[i]);
+    }
+    fprintf(f, "\n  },\n  \"mmio\": {");
+    const char *sizes[] = {"8", "16", "32"};
+    for(uint32_t i = 0; i < 3; i++) {
+        fprintf(f, "%s\n    \"read%s\": %llu,\n    \"write%s\": %llu",
+                i ? "," : "", sizes[i],
+                (unsigned long long)stats->mmio_reads[i], sizes[i],
+                (unsigned long long)stats->mmio_writes[i]);
+    }
+    fprintf(f, "\n  },\n  \"superinstructions\": {");
+    for(uint32_t i = 0; i < MVM_SUPER_COUNT; i++) {
+        fprintf(f, "%s\n    \"%s\": %llu", i ? "," : "", mvm_super_name[i],
+                (unsigned long long)icache->super_hits[i]);
+    }
+    fprintf(f, "\n  }\n}\n");
+}
+
+// to stats_path, or stdout if it is "-"
+static int save_stats(const char *stats_path, const mvm_stats *stats,
+                      const mvm_icache *icache) {
+    if(strcmp(stats_path, "-") == 0) {
+        write_stats(stdout, stats, icache);
         return 1;
     }
-    const char *rom_path = argv[1];
-    FILE *f = fopen(rom_path, "rb");
-    uint8_t *ram = (uint8_t *)malloc(MVM_RAM_SIZE);
-    if(!ram) {
+    FILE *f = fopen(stats_path, "w");
+    if(!f)
+        return 0;
+    write_stats(f, stats, icache);
+    return !ferror(f) & !fclose(f);
+}
+
+#endif
+
+// Writes the samples of the profiler to profile_path, with the labels of
+// symbols_path if set.
+static int save_profile(const options *opts, const mvm_profile *profile) {
+    mvm_symbols symbols;
+    if(opts->symbols_path && !mvm_symbols_load(&symbols, opts->symbols_path)) {
+        FATAL("failed to load the symbols %s", opts->symbols_path);
+        return 0;
+    }
+    FILE *f = fopen(opts->profile_path, "w");
+    int ok = f != NULL;
+    if(ok) {
+        ok = mvm_profile_write(profile, opts->symbols_path ? &symbols : NULL,
+                               f);
+        ok = !fclose(f) && ok;
+    }
+    if(!ok)
+        FATAL("failed to write the profile to %s", opts->profile_path);
+    if(opts->symbols_path)
+        mvm_symbols_free(&symbols);
+    return ok;
+}
+
+// Runs the rom, or the snapshot of opts->load_path instead, and saves what
+// opts asks for once it stops.
+static int run_single(const char *rom_path, const options *opts) {
+    machine *m = (machine *)calloc(1, sizeof(machine));
+    if(!m) {
         FATAL("failed to allocate memory");
         return 1;
     }
-    if(!f) {
-        FATAL("failed to open %s", rom_path);
+    int ok;
+    if(opts->load_path) {
+        ok = machine_load(m, opts->load_path);
+    } else {
+        mvm_image rom;
+        ok = load_rom(&rom, rom_path);
+        if(ok) {
+            ok = machine_init(m, &rom);
+            mvm_image_free(&rom);
+        }
+    }
+    if(!ok) {
+        free(m);
         return 1;
     }
+    static mvm_jit jit;
+    int use_jit = opts->use_jit;
+    if(use_jit && opts->stats_path) {
+        fprintf(stderr, "the jit isn't counted, using the interpreter\n");
+        use_jit = 0;
+    }
+    if(use_jit && !mvm_jit_init(&jit, &m->vm)) {
+        fprintf(stderr, "jit unavailable, using the interpreter\n");
+        use_jit = 0;
+    }
+    // the profiler samples the vm between slices
+    mvm_profile profile;
+    mvm_profile_init(&profile);
+    const uint32_t slice = opts->profile_path ? opts->profile_period : 1000;
+    timer t = {0, 0};
+    if(opts->timer_period)
+        timer_start(&t, opts->timer_period);
+    int ret = 0;
+    // a waiting vm sleeps until the timer wakes it, without one it stops
+    while(m->vm.status == MVM_RUNNING ||
+          (m->vm.status == MVM_WAITING && opts->timer_period)) {
+        if(opts->timer_period) {
+            timer_tick(&t, &m->vm, m->vm.status == MVM_WAITING);
+            if(m->vm.status != MVM_RUNNING)
+                continue;
+        }
+        if(use_jit)
+            mvm_jit_run(&m->vm, slice);
+        else
+            mvm_guard_run(&m->vm, slice);
+        if(opts->profile_path && m->vm.status == MVM_RUNNING &&
+           !mvm_profile_sample(&profile, &m->vm)) {
+            FATAL("failed to allocate memory for the profile");
+            ret = 1;
+            break;
+        }
+    }
+    if(m->vm.status != MVM_HALTED)
+        printf("status: %s\n", mvm_status_name[m->vm.status]);
+    mvm_dump(&m->vm);
 
-    fseek(f, 0, SEEK_END);
-    const long rom_size = ftell(f);
-    if(rom_size > MVM_RAM_SIZE) {
-        fclose(f);
-        FATAL("rom file is too big to fit in ram");
-        return 1;
+    if(opts->save_path &&
+       !mvm_snapshot_save(opts->save_path, &m->vm, &m->frame_buffer, 1)) {
+        FATAL("failed to save the snapshot %s", opts->save_path);
+        ret = 1;
     }
-    fseek(f, 0, SEEK_SET);
-    size_t n = fread(ram, rom_size, 1, f);
-    fclose(f);
-    if(n != 1) {
-        FATAL("failed to load the rom file");
+#ifdef MVM_STATS
+    if(opts->stats_path &&
+       !save_stats(opts->stats_path, &m->vm.stats, m->icache)) {
+        FATAL("failed to write the stats to %s", opts->stats_path);
+        ret = 1;
+    }
+#endif
+    if(opts->profile_path && !save_profile(opts, &profile))
+        ret = 1;
+    mvm_profile_free(&profile);
+    if(use_jit)
+        mvm_jit_free(&jit);
+    machine_free(m);
+    free(m);
+    return ret;
+}
+
+// runs every rom in its own vm, printing the results in the order given
+static int run_batch(char **rom_paths, uint32_t count, uint32_t threads) {
+    machine *machines = (machine *)calloc(count, sizeof(machine));
+    mvm_batch_job *jobs = (mvm_batch_job *)calloc(count, sizeof(mvm_batch_job));
+    if(!machines || !jobs) {
+        free(machines);
+        free(jobs);
+        FATAL("failed to allocate memory");
         return 1;
     }
+    // consecutive copies of a rom share its image, none loaded yet
+    mvm_image rom;
+    rom.fd = -1;
+    uint32_t loaded = 0;
+    for(; loaded < count; loaded++) {
+        const char *rom_path = rom_paths[loaded];
+        if(!loaded || strcmp(rom_path, rom_paths[loaded - 1]) != 0) {
+            if(loaded)
+                mvm_image_free(&rom);
+            if(!load_rom(&rom, rom_path))
+                break;
+        }
+        if(!machine_init(&machines[loaded], &rom)) {
+            mvm_image_free(&rom);
+            break;
+        }
+        jobs[loaded].vm = &machines[loaded].vm;
+    }
+    if(loaded == count)
+        mvm_image_free(&rom);
+    int ret = 1;
+    if(loaded == count) {
+        if(mvm_batch_run(jobs, count, threads, BATCH_SLICE)) {
+            for(uint32_t i = 0; i < count; i++) {
+                printf("%s: %s, %llu instructions", rom_paths[i],
+                       mvm_status_name[machines[i].vm.status],
+                       (unsigned long long)jobs[i].instructions);
+                mvm_dump(&machines[i].vm);
+            }
+            ret = 0;
+        } else {
+            FATAL("failed to allocate memory");
+        }
+    }
 
-    mvm vm;
-    mvm_init(&vm, ram);
-    while(vm.status == MVM_RUNNING)
-        mvm_run(&vm, 1000);
-    if(vm.status != MVM_HALTED)
-        printf("status: %s\n", mvm_status_name[vm.status]);
-    mvm_dump(&vm);
-
-    free(ram);
-    return 0;
-}
\ No newline at end of file
+    for(uint32_t i = 0; i < loaded; i++)
+        machine_free(&machines[i]);
+    free(machines);
+    free(jobs);
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
+    options opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.profile_period = PROFILE_PERIOD;
+    int batch = 0;
+    uint32_t threads = 0;
+    int arg = 1;
+    if(arg < argc && strcmp(argv[arg], "--batch") == 0) {
+        batch = 1;
+        arg++;
+        if(arg + 1 < argc && strcmp(argv[arg], "-j") == 0) {
+            threads = (uint32_t)strtoul(argv[arg + 1], NULL, 10);
+            arg += 2;
+        }
+    }
+    for(; !batch && arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+        if(strcmp(argv[arg], "--jit") == 0)
+            opts.use_jit = 1;
+        else if(strcmp(argv[arg], "--load-snapshot") == 0 && arg + 1 < argc)
+            opts.load_path = argv[++arg];
+        else if(strcmp(argv[arg], "--save-snapshot") == 0 && arg + 1 < argc)
+            opts.save_path = argv[++arg];
+        else if(strcmp(argv[arg], "--stats") == 0 && arg + 1 < argc)
+            opts.stats_path = argv[++arg];
+        else if(strcmp(argv[arg], "--profile") == 0 && arg + 1 < argc)
+            opts.profile_path = argv[++arg];
+        else if(strcmp(argv[arg], "--profile-period") == 0 && arg + 1 < argc)
+            opts.profile_period = (uint32_t)strtoul(argv[++arg], NULL, 10);
+        else if(strcmp(argv[arg], "--symbols") == 0 && arg + 1 < argc)
+            opts.symbols_path = argv[++arg];
+        else if(strcmp(argv[arg], "--timer") == 0 && arg + 1 < argc)
+            opts.timer_period = (uint32_t)strtoul(argv[++arg], NULL, 10);
+        else
+            break;
+    }
+#ifndef MVM_STATS
+    if(opts.stats_path) {
+        FATAL("--stats needs a build with DEFINES=-DMVM_STATS");
+        return 1;
+    }
+#endif
+    const int valid = batch ? arg < argc
+                            : arg == argc - (opts.load_path ? 0 : 1) &&
+                                  (arg == argc || argv[arg][0] != '-') &&
+                                  opts.profile_period;
+    if(!valid) {
+        FATAL("usage: %s [--jit] [--save-snapshot file] [--stats file|-]\n"
+              "       [--profile file [--profile-period n] [--symbols file]]\n"
+              "       [--timer microseconds]\n"
+              "       (file.rom | --load-snapshot file)\n"
+              "       %s --batch [-j threads] file.rom...",
+              argv[0], argv[0]);
+        return 1;
+    }
+    if(batch)
+        return run_batch(&argv[arg], (uint32_t)(argc - arg), threads);
+    return run_single(opts.load_path ? NULL : argv[arg], &opts);
+}
@@ -4,6 +4,7 @@
 #include <stdint.h>
 
 #define MVM_RAM_SIZE 0x10000
+#define MVM_STACK_SIZE 256 // entries of the data and the return stacks
 #define MVM_INTERRUPT_TABLE_SIZE 0x10
 #define MVM_ENTRY_POINT                                                        \
     (MVM_INTERRUPT_TABLE_SIZE *                                                \
@@ -46,6 +47,10 @@ enum MVM_OPCODE {
     OP_CALL,
     OP_RET,
     OP_SYS,
+    OP_EI,
+    OP_DI,
+    OP_RETI,
+    OP_WFI,
     MVM_OPCODE_COUNT,
 };
 
@@ -59,34 +64,258 @@ enum mvm_status {
     MVM_RETURN_STACK_UNDERFLOW,
     MVM_INVALID_INSTRUCTION,
     MVM_DIVISION_BY_ZERO,
+    MVM_WAITING,
+    MVM_STATUS_COUNT,
 };
 
 // Generated enums end
 
+// Define MVM_STATS for an instrumentation build, in which the interpreter
+// counts the opcodes it executes, including those of superinstructions, the
+// pairs of consecutive ones, the syscalls and the mmio accesses in vm->stats.
+// Other builds don't have the counters, nor any code to update them. Code
+// compiled by mvm_jit.h isn't counted.
+#ifdef MVM_STATS
+#define MVM_STATS_SYSCALLS 16 // numbers counted apart, the last for the rest
+typedef struct mvm_stats {
+    uint64_t ops[MVM_OPCODE_COUNT];
+    uint64_t pairs[MVM_OPCODE_COUNT][MVM_OPCODE_COUNT]; // [first][second]
+    uint64_t syscalls[MVM_STATS_SYSCALLS];
+    uint64_t mmio_reads[3], mmio_writes[3]; // of 1, 2 and 4 bytes
+    uint32_t last; // opcode executed last plus one, 0 before the first
+} mvm_stats;
+#endif
+
+// Define MVM_GUARD_STACKS to have the stacks mapped by mvm_guard_init, between
+// guard pages that turn overflows and underflows into faults instead of being
+// compared against their bounds (see mvm_guard.h). Likewise MVM_GUARD_RAM maps
+// ram at the start of a reservation covering every 32-bit address, so that the
+// interpreter reaches mmio by faulting instead of comparing addresses.
 typedef struct mvm {
     uint32_t pc, sp, rsp;
-    uint32_t stk[256], rstk[256];
+#ifdef MVM_GUARD_STACKS
+    uint32_t *stk, *rstk;
+    // the limit left before the instructions run from count_pc, for the count
+    // of a run ending in a stack fault
+    uint32_t count_pc, count_left;
+#else
+    uint32_t stk[MVM_STACK_SIZE], rstk[MVM_STACK_SIZE];
+#endif
     uint8_t *ram;
+#ifdef MVM_GUARD_RAM
+    uint32_t resume_limit; // instructions left when the last access faults
+#endif
     enum mvm_status status;
+    // interrupts, bit n standing for vector n (see mvm_interrupt)
+    uint32_t pending, enabled;
+    uint32_t ready; // pending and enabled, 0 in a handler
+    uint32_t servicing; // in a handler, until reti
+    uint32_t stop;      // requested by mvm_stop, from any thread
+    struct mvm_icache *icache;
+    struct mvm_until *until; // conditions of the current mvm_run_until
+    struct mvm_mmio *mmio;
+    const struct mvm_host *host;
+    void *user; // context of the host, for its handlers
+#ifdef MVM_STATS
+    mvm_stats stats; // cleared by mvm_init
+#endif
 } mvm;
 
+// Pre-decoded instruction cache: instructions are decoded on first execution
+// into one record per ram address. A store overwriting decoded code drops all
+// the records of the page it hits.
+#define MVM_ICACHE_PAGE_SHIFT 6
+#define MVM_ICACHE_PAGE_SIZE (1 << MVM_ICACHE_PAGE_SHIFT)
+// largest decoded record: a push32 fused with the following instruction
+#define MVM_INSN_MAX_SIZE (2 + sizeof(uint32_t))
+
+// decoded operations that are not opcodes
+enum mvm_insn_op {
+    MVM_INSN_INVALID = MVM_OPCODE_COUNT,
+    MVM_INSN_DECODE,
+    // superinstructions, executing a common sequence in one dispatch
+    MVM_SUPER_PUSH_CALL,
+    MVM_SUPER_PUSH_CJMP,
+    MVM_SUPER_PUSH_ADD,
+    MVM_SUPER_DUP_EQZ,
+    MVM_SUPER_PUSH_LW,
+    MVM_INSN_OP_COUNT,
+};
+
+#define MVM_SUPER_FIRST MVM_SUPER_PUSH_CALL
+#define MVM_SUPER_COUNT (MVM_INSN_OP_COUNT - MVM_SUPER_FIRST)
+
+typedef struct mvm_insn mvm_insn;
+
+#ifdef MVM_TAIL_CALLS
+// a handler of the tail-call interpreter, see mvm_interp.h
+typedef uint32_t (*mvm_handler)(mvm *vm, mvm_insn *insn, uint32_t pc,
+                                uint32_t sp, uint32_t tos, uint32_t limit);
+#endif
+
+struct mvm_insn {
+    uint32_t imm;
+    uint32_t next; // address of the following instruction
+#ifdef MVM_TAIL_CALLS
+    mvm_handler handler; // of op
+#endif
+    uint8_t op;
+    uint8_t base; // first opcode of a superinstruction
+    // Stack effect of the block starting here, up to the next control
+    // transfer or the end of the page: the depth it needs, how much it grows
+    // the stack at most and its length in instructions (0 if not analyzed).
+    uint8_t need, growth, len;
+    // MVM_INSN_* flags set by mvm_verify, which then proved the block safe
+    // from depth low to high, and those to be the only ones its edges reach
+    uint8_t verified, low, high;
+};
+
+#define MVM_INSN_VERIFIED 1
+#define MVM_INSN_CHAINS 2 // leaves through edges that mvm_verify followed
+
+typedef struct mvm_icache {
+    mvm_insn insn[MVM_RAM_SIZE];
+    uint8_t code[MVM_RAM_SIZE]; // non zero for bytes of decoded instructions
+    uint64_t super_hits[MVM_SUPER_COUNT];
+#ifdef MVM_TAIL_CALLS
+    mvm_insn scratch; // the record of an instruction outside of ram
+#endif
+    // called when [start, end) is invalidated, to drop code derived from it
+    void (*invalidate_hook)(mvm *vm, uint32_t start, uint32_t end);
+    void *hook_data;
+    int verified; // set by mvm_verify, cleared by mvm_icache_flush
+} mvm_icache;
+
+// Mmio ranges: the pages of the address space past ram can be backed by host
+// memory, read and written in place, or by a device answering through
+// callbacks. Accesses that no range covers go to the mmio_* functions of the
+// host. A two level page table finds the range of an address, at the same cost
+// whatever the number of ranges.
+#define MVM_MMIO_PAGE_SHIFT 12
+#define MVM_MMIO_PAGE_SIZE (1 << MVM_MMIO_PAGE_SHIFT)
+#define MVM_MMIO_TABLE_SHIFT 10 // pages per second level table, as a shift
+#define MVM_MMIO_TABLE_SIZE (1 << MVM_MMIO_TABLE_SHIFT)
+#define MVM_MMIO_DIR_SIZE                                                      \
+    (1 << (32 - MVM_MMIO_PAGE_SHIFT - MVM_MMIO_TABLE_SHIFT))
+
+typedef struct mvm_device {
+    // addr is relative to the start of the range, size is 1, 2 or 4 bytes
+    uint32_t (*read)(mvm *vm, void *data, uint32_t addr, uint32_t size);
+    void (*write)(mvm *vm, void *data, uint32_t addr, uint32_t size,
+                  uint32_t value);
+    void *data;
+} mvm_device;
+
+// the range a page belongs to, copied into each of its pages
+typedef struct mvm_page {
+    uint32_t base, size; // size is 0 for unmapped pages
+    uint8_t *mem;        // memory backing the range, NULL for a device
+    mvm_device *device;
+} mvm_page;
+
+typedef struct mvm_mmio {
+    mvm_page *dir[MVM_MMIO_DIR_SIZE]; // second level tables, NULL if empty
+} mvm_mmio;
+
+// what ended a run of mvm_run_until
+enum mvm_until_hit {
+    MVM_UNTIL_NONE, // the limit, the vm stopping or a stop request
+    MVM_UNTIL_BREAKPOINT,
+    MVM_UNTIL_RETURN,
+    MVM_UNTIL_STORE,
+};
+
+// Conditions ending a run of mvm_run_until with the vm still running: the pc
+// reaching a breakpoint, the return stack dropping below depth, or a store
+// writing to the watched range. Only the conditions set are checked.
+typedef struct mvm_until {
+    uint8_t breakpoints[MVM_RAM_SIZE / 8]; // bit pc % 8 of byte pc / 8
+    uint32_t breakpoint_count;             // kept by mvm_until_break
+    uint32_t depth;                        // 0 for none
+    uint32_t watch_addr, watch_size;       // size 0 for none
+    enum mvm_until_hit hit;                // set by each run
+} mvm_until;
+
 void mvm_init(mvm *vm, uint8_t *ram);
-void mvm_run(mvm *vm, uint32_t limit);
+// Runs at most limit instructions and returns how many it ran, counting one
+// that faults, halts or waits. Blocks on the fast path of the cached
+// interpreter take their length from the limit on entry; one that doesn't fit
+// what is left runs an instruction at a time, so the run stops exactly there.
+// A superinstruction counts as the instructions it stands for.
+uint32_t mvm_run(mvm *vm, uint32_t limit);
+// Raises interrupt n, below MVM_INTERRUPT_TABLE_SIZE, from the thread running
+// the vm: between runs or from a handler of the host. It stays pending until
+// the guest enables it with ei, which pops a mask of vectors (di disables
+// them), and no handler is running. The interpreter takes it at the next
+// control transfer, or when a run starts: pc goes to the return stack and the
+// word n of the table at address 0 becomes pc. reti returns from the handler
+// and allows interrupts again; the lowest pending vector is taken first.
+// Without one ready, wfi stops the vm as MVM_WAITING: mvm_interrupt resumes it
+// once one is, so that the host can sleep until it raises the next.
+void mvm_interrupt(mvm *vm, uint32_t n);
+// Ends the current run of vm early, leaving it running: a host thread or timer
+// can preempt a run without it counting instructions. The interpreter checks
+// for the request on backward branches, calls and syscalls only, and a request
+// made between runs ends the next one at the first of them. Returning drops the
+// request, whatever ended the run. Code compiled by mvm_jit.h checks it between
+// blocks, and on each pass of the regions that loop without leaving.
+void mvm_stop(mvm *vm);
+// Runs vm as mvm_run does until one of the conditions of until is met, then
+// sets until->hit. A breakpoint stops the run before the instruction at its pc,
+// unless the run starts there, so that the next one can go on; a return or a
+// store stops it after the instruction. Without conditions, or with until NULL,
+// this is mvm_run. Without breakpoints the checks only cost the instructions
+// that may meet the others; breakpoints run the raw interpreter, checking the
+// pc of each instruction.
+uint32_t mvm_run_until(mvm *vm, uint32_t limit, mvm_until *until);
+// clears the conditions
+void mvm_until_init(mvm_until *until);
+// sets or clears the breakpoint at pc, ignored outside of ram
+void mvm_until_break(mvm_until *until, uint32_t pc, int set);
+int mvm_until_breaks(const mvm_until *until, uint32_t pc);
+void mvm_icache_attach(mvm *vm, mvm_icache *icache);
+void mvm_icache_flush(mvm *vm);
+// Verifies the code reachable from the entry point and the interrupt vectors,
+// once loaded in the ram of vm, whose icache it needs. The walk follows the
+// targets pushed right before jmp, cjmp and call, and proves that opcodes are
+// valid, that immediates and such targets stay in ram without overlapping
+// other instructions, and bounds the depth of the stack on every path. Blocks
+// proved enter each other without comparing the depth to their needs; code
+// reached otherwise, through computed targets, returns, syscalls or
+// interrupts, compares it as usual. Returns the instructions proved, 0 if
+// memory runs out. Flushing the cache or overwriting code drops the proofs.
+uint32_t mvm_verify(mvm *vm);
 int mvm_opcode_from_name(const char *name);
 const char *mvm_current_instruction_name(mvm *vm);
 void mvm_dump(mvm *vm);
+void mvm_mmio_init(mvm_mmio *mmio);
+// Map size bytes from base, which must start a page past ram. A range mapped
+// later replaces the pages it covers. They return 0 if the range is invalid or
+// a table can't be allocated.
+int mvm_mmio_map_memory(mvm_mmio *mmio, uint32_t base, uint32_t size,
+                        void *mem);
+int mvm_mmio_map_device(mvm_mmio *mmio, uint32_t base, uint32_t size,
+                        mvm_device *device);
+void mvm_mmio_free(mvm_mmio *mmio);
+
+// Handlers of the host running a vm, reaching its own state through vm->user.
+// The mmio ones are called for accesses past ram that vm->mmio doesn't map.
+typedef struct mvm_host {
+    void (*syscall)(mvm *vm);
+    uint32_t (*mmio_read8)(mvm *vm, uint32_t addr);
+    uint32_t (*mmio_read16)(mvm *vm, uint32_t addr);
+    uint32_t (*mmio_read32)(mvm *vm, uint32_t addr);
+    void (*mmio_write8)(mvm *vm, uint32_t addr, uint8_t value);
+    void (*mmio_write16)(mvm *vm, uint32_t addr, uint16_t value);
+    void (*mmio_write32)(mvm *vm, uint32_t addr, uint32_t value);
+} mvm_host;
 
-// user provided functions
-extern void syscall(mvm *vm);
-extern uint32_t mmio_read8(mvm *vm, uint32_t addr);
-extern uint32_t mmio_read16(mvm *vm, uint32_t addr);
-extern uint32_t mmio_read32(mvm *vm, uint32_t addr);
-extern void mmio_write8(mvm *vm, uint32_t addr, uint8_t value);
-extern void mmio_write16(mvm *vm, uint32_t addr, uint16_t value);
-extern void mmio_write32(mvm *vm, uint32_t addr, uint32_t value);
+// set by mvm_init: sys does nothing and mmio accesses are segmentation faults
+extern const mvm_host mvm_default_host;
 
 #ifdef MVM_IMPLEMENTATION
 
+#include <stdlib.h>
 #include <string.h>
 
 // Generated strings arrays start
@@ -126,6 +355,10 @@ const char *mvm_op_name[] = {
     "call",
     "ret",
     "sys",
+    "ei",
+    "di",
+    "reti",
+    "wfi",
 };
 
 const char *mvm_status_name[] = {
@@ -138,10 +371,142 @@ const char *mvm_status_name[] = {
     "return stack underflow",
     "invalid instruction",
     "division by zero",
+    "waiting",
 };
 
 // Generated strings arrays end
 
+const char *mvm_super_name[] = {
+    "push call", "push cjmp", "push add", "dup push 0 eq", "push lw",
+};
+
+// Generated opcode info start
+
+const uint8_t mvm_op_imm_size[] = {
+    0, // brk
+    1, // push_u8
+    2, // push_u16
+    4, // push32
+    0, // dup
+    0, // ovr
+    0, // pop
+    0, // add
+    0, // sub
+    0, // mul
+    0, // div
+    0, // divu
+    0, // rem
+    0, // remu
+    0, // xor
+    0, // eq
+    0, // neq
+    0, // lt
+    0, // gte
+    0, // ltu
+    0, // gteu
+    0, // lb
+    0, // lh
+    0, // lw
+    0, // lbu
+    0, // lhu
+    0, // sb
+    0, // sh
+    0, // sw
+    0, // jmp
+    0, // cjmp
+    0, // call
+    0, // ret
+    0, // sys
+    0, // ei
+    0, // di
+    0, // reti
+    0, // wfi
+};
+
+const uint8_t mvm_op_pops[] = {
+    0, // brk
+    0, // push_u8
+    0, // push_u16
+    0, // push32
+    1, // dup
+    2, // ovr
+    1, // pop
+    2, // add
+    2, // sub
+    2, // mul
+    2, // div
+    2, // divu
+    2, // rem
+    2, // remu
+    2, // xor
+    2, // eq
+    2, // neq
+    2, // lt
+    2, // gte
+    2, // ltu
+    2, // gteu
+    1, // lb
+    1, // lh
+    1, // lw
+    1, // lbu
+    1, // lhu
+    2, // sb
+    2, // sh
+    2, // sw
+    1, // jmp
+    2, // cjmp
+    1, // call
+    0, // ret
+    0, // sys
+    1, // ei
+    1, // di
+    0, // reti
+    0, // wfi
+};
+
+const uint8_t mvm_op_pushes[] = {
+    0, // brk
+    1, // push_u8
+    1, // push_u16
+    1, // push32
+    2, // dup
+    3, // ovr
+    0, // pop
+    1, // add
+    1, // sub
+    1, // mul
+    1, // div
+    1, // divu
+    1, // rem
+    1, // remu
+    1, // xor
+    1, // eq
+    1, // neq
+    1, // lt
+    1, // gte
+    1, // ltu
+    1, // gteu
+    1, // lb
+    1, // lh
+    1, // lw
+    1, // lbu
+    1, // lhu
+    0, // sb
+    0, // sh
+    0, // sw
+    0, // jmp
+    0, // cjmp
+    0, // call
+    0, // ret
+    0, // sys
+    0, // ei
+    0, // di
+    0, // reti
+    0, // wfi
+};
+
+// Generated opcode info end
+
 #define MVM_CHECK()                                                            \
     do {                                                                       \
         if(vm->status != MVM_RUNNING)                                          \
@@ -150,85 +515,393 @@ const char *mvm_status_name[] = {
 
 #define MVM_ARRAYSIZE(x) (sizeof(x) / sizeof((x)[0]))
 
+#ifdef MVM_STATS
+
+#define MVM_STAT(counter) vm->stats.counter++
+
+static void mvm_stats_op(mvm *vm, uint32_t op) {
+    vm->stats.ops[op]++;
+    if(vm->stats.last)
+        vm->stats.pairs[vm->stats.last - 1][op]++;
+    vm->stats.last = op + 1;
+}
+
+// before the host pops the number, which a fault takes as 0
+static void mvm_stats_syscall(mvm *vm) {
+    const uint32_t number = vm->sp ? vm->stk[vm->sp - 1] : 0;
+    vm->stats.syscalls[number < MVM_STATS_SYSCALLS ? number
+                                                   : MVM_STATS_SYSCALLS - 1]++;
+}
+
+#else
+
+#define MVM_STAT(counter)
+
+#endif
+
 void mvm_init(mvm *vm, uint8_t *ram) {
+#ifdef MVM_GUARD_STACKS
+    // the mapped stacks are kept, so that a vm can be reset
+    uint32_t *stk = vm->stk, *rstk = vm->rstk;
+    memset(vm, 0, sizeof(mvm));
+    vm->stk = stk;
+    vm->rstk = rstk;
+#else
     memset(vm, 0, sizeof(mvm));
+#endif
     vm->pc = MVM_ENTRY_POINT;
     vm->ram = ram;
     vm->status = MVM_RUNNING;
+    vm->host = &mvm_default_host;
 }
 
 #define MVM_BITCAST(t, x) (*(t *)(&(x)))
 
+#ifdef MVM_TAIL_CALLS
+static uint32_t mvm_tail_MVM_INSN_DECODE(mvm *vm, mvm_insn *insn, uint32_t pc,
+                                         uint32_t sp, uint32_t tos,
+                                         uint32_t limit);
+static mvm_handler mvm_tail_handler(uint8_t op);
+#endif
+
+static void mvm_icache_clear(mvm_icache *icache, uint32_t pc) {
+    icache->insn[pc].op = MVM_INSN_DECODE;
+#ifdef MVM_TAIL_CALLS
+    icache->insn[pc].handler = mvm_tail_MVM_INSN_DECODE;
+#endif
+    icache->insn[pc].next = pc;
+    icache->insn[pc].len = 0;
+}
+
+void mvm_icache_flush(mvm *vm) {
+    if(!vm->icache)
+        return;
+    for(uint32_t pc = 0; pc < MVM_RAM_SIZE; pc++)
+        mvm_icache_clear(vm->icache, pc);
+    memset(vm->icache->code, 0, sizeof(vm->icache->code));
+    vm->icache->verified = 0;
+    if(vm->icache->invalidate_hook)
+        vm->icache->invalidate_hook(vm, 0, MVM_RAM_SIZE);
+}
+
+void mvm_icache_attach(mvm *vm, mvm_icache *icache) {
+    vm->icache = icache;
+    if(icache) {
+        memset(icache->super_hits, 0, sizeof(icache->super_hits));
+        icache->invalidate_hook = NULL;
+        icache->hook_data = NULL;
+    }
+    mvm_icache_flush(vm);
+}
+
+// Drops every record overlapping the page. Code bytes outside of it may stay
+// marked, which only costs a spurious invalidation later.
+void mvm_icache_invalidate(mvm *vm, uint32_t page) {
+    mvm_icache *icache = vm->icache;
+    const uint32_t start = page << MVM_ICACHE_PAGE_SHIFT;
+    uint32_t pc = start < MVM_INSN_MAX_SIZE ? 0 : start - MVM_INSN_MAX_SIZE;
+    for(; pc < start + MVM_ICACHE_PAGE_SIZE; pc++) {
+        if(icache->insn[pc].next > start)
+            mvm_icache_clear(icache, pc);
+    }
+    memset(&icache->code[start], 0, MVM_ICACHE_PAGE_SIZE);
+    if(icache->invalidate_hook)
+        icache->invalidate_hook(vm, start, start + MVM_ICACHE_PAGE_SIZE);
+}
+
+// called by the store helpers when they overwrite decoded code
+void mvm_icache_write(mvm *vm, uint32_t addr, uint32_t size) {
+    const uint32_t first = addr >> MVM_ICACHE_PAGE_SHIFT;
+    const uint32_t last = (addr + size - 1) >> MVM_ICACHE_PAGE_SHIFT;
+    mvm_icache_invalidate(vm, first);
+    if(last != first)
+        mvm_icache_invalidate(vm, last);
+}
+
+void mvm_mmio_init(mvm_mmio *mmio) {
+    memset(mmio, 0, sizeof(mvm_mmio));
+}
+
+static int mvm_mmio_map(mvm_mmio *mmio, const mvm_page *range) {
+    const uint64_t end = (uint64_t)range->base + range->size;
+    if(range->base < MVM_RAM_SIZE || range->base % MVM_MMIO_PAGE_SIZE ||
+       !range->size || end > ((uint64_t)1 << 32))
+        return 0;
+    for(uint64_t addr = range->base; addr < end; addr += MVM_MMIO_PAGE_SIZE) {
+        const uint32_t page = (uint32_t)(addr >> MVM_MMIO_PAGE_SHIFT);
+        mvm_page **table = &mmio->dir[page >> MVM_MMIO_TABLE_SHIFT];
+        if(!*table) {
+            *table = (mvm_page *)calloc(MVM_MMIO_TABLE_SIZE, sizeof(mvm_page));
+            if(!*table)
+                return 0;
+        }
+        (*table)[page % MVM_MMIO_TABLE_SIZE] = *range;
+    }
+    return 1;
+}
+
+int mvm_mmio_map_memory(mvm_mmio *mmio, uint32_t base, uint32_t size,
+                        void *mem) {
+    mvm_page range;
+    range.base = base;
+    range.size = size;
+    range.mem = (uint8_t *)mem;
+    range.device = NULL;
+    return mvm_mmio_map(mmio, &range);
+}
+
+int mvm_mmio_map_device(mvm_mmio *mmio, uint32_t base, uint32_t size,
+                        mvm_device *device) {
+    mvm_page range;
+    range.base = base;
+    range.size = size;
+    range.mem = NULL;
+    range.device = device;
+    return mvm_mmio_map(mmio, &range);
+}
+
+void mvm_mmio_free(mvm_mmio *mmio) {
+    for(uint32_t i = 0; i < MVM_MMIO_DIR_SIZE; i++) {
+        free(mmio->dir[i]);
+        mmio->dir[i] = NULL;
+    }
+}
+
+// the range holding the whole access, NULL if there is none
+static const mvm_page *mvm_mmio_lookup(mvm *vm, uint32_t addr, uint32_t size) {
+    if(!vm->mmio)
+        return NULL;
+    const mvm_page *table =
+        vm->mmio->dir[addr >> (MVM_MMIO_PAGE_SHIFT + MVM_MMIO_TABLE_SHIFT)];
+    if(!table)
+        return NULL;
+    const mvm_page *page =
+        &table[(addr >> MVM_MMIO_PAGE_SHIFT) % MVM_MMIO_TABLE_SIZE];
+    const uint32_t offset = addr - page->base;
+    if(offset >= page->size || page->size - offset < size)
+        return NULL;
+    return page;
+}
+
 // Generated load/store start
 
+static uint32_t mvm_mmio_load_u8(mvm *vm, uint32_t addr) {
+    const mvm_page *page = mvm_mmio_lookup(vm, addr, sizeof(uint8_t));
+    MVM_STAT(mmio_reads[0]);
+    if(!page)
+        return vm->host->mmio_read8(vm, addr);
+    if(page->mem)
+        return MVM_BITCAST(uint8_t, page->mem[addr - page->base]);
+    return page->device->read(vm, page->device->data, addr - page->base,
+                              sizeof(uint8_t));
+}
+
+static uint32_t mvm_mmio_load_u16(mvm *vm, uint32_t addr) {
+    const mvm_page *page = mvm_mmio_lookup(vm, addr, sizeof(uint16_t));
+    MVM_STAT(mmio_reads[1]);
+    if(!page)
+        return vm->host->mmio_read16(vm, addr);
+    if(page->mem)
+        return MVM_BITCAST(uint16_t, page->mem[addr - page->base]);
+    return page->device->read(vm, page->device->data, addr - page->base,
+                              sizeof(uint16_t));
+}
+
+static uint32_t mvm_mmio_load_u32(mvm *vm, uint32_t addr) {
+    const mvm_page *page = mvm_mmio_lookup(vm, addr, sizeof(uint32_t));
+    MVM_STAT(mmio_reads[2]);
+    if(!page)
+        return vm->host->mmio_read32(vm, addr);
+    if(page->mem)
+        return MVM_BITCAST(uint32_t, page->mem[addr - page->base]);
+    return page->device->read(vm, page->device->data, addr - page->base,
+                              sizeof(uint32_t));
+}
+
+static int32_t mvm_mmio_load_i8(mvm *vm, uint32_t addr) {
+    const mvm_page *page = mvm_mmio_lookup(vm, addr, sizeof(int8_t));
+    MVM_STAT(mmio_reads[0]);
+    if(!page)
+        return vm->host->mmio_read8(vm, addr);
+    if(page->mem)
+        return MVM_BITCAST(int8_t, page->mem[addr - page->base]);
+    return page->device->read(vm, page->device->data, addr - page->base,
+                              sizeof(int8_t));
+}
+
+static int32_t mvm_mmio_load_i16(mvm *vm, uint32_t addr) {
+    const mvm_page *page = mvm_mmio_lookup(vm, addr, sizeof(int16_t));
+    MVM_STAT(mmio_reads[1]);
+    if(!page)
+        return vm->host->mmio_read16(vm, addr);
+    if(page->mem)
+        return MVM_BITCAST(int16_t, page->mem[addr - page->base]);
+    return page->device->read(vm, page->device->data, addr - page->base,
+                              sizeof(int16_t));
+}
+
+static int32_t mvm_mmio_load_i32(mvm *vm, uint32_t addr) {
+    const mvm_page *page = mvm_mmio_lookup(vm, addr, sizeof(int32_t));
+    MVM_STAT(mmio_reads[2]);
+    if(!page)
+        return vm->host->mmio_read32(vm, addr);
+    if(page->mem)
+        return MVM_BITCAST(int32_t, page->mem[addr - page->base]);
+    return page->device->read(vm, page->device->data, addr - page->base,
+                              sizeof(int32_t));
+}
+
+static void mvm_mmio_store_8(mvm *vm, uint32_t addr, uint8_t value) {
+    const mvm_page *page = mvm_mmio_lookup(vm, addr, sizeof(uint8_t));
+    MVM_STAT(mmio_writes[0]);
+    if(!page)
+        vm->host->mmio_write8(vm, addr, value);
+    else if(page->mem)
+        MVM_BITCAST(uint8_t, page->mem[addr - page->base]) = value;
+    else
+        page->device->write(vm, page->device->data, addr - page->base,
+                            sizeof(uint8_t), value);
+}
+
+static void mvm_mmio_store_16(mvm *vm, uint32_t addr, uint16_t value) {
+    const mvm_page *page = mvm_mmio_lookup(vm, addr, sizeof(uint16_t));
+    MVM_STAT(mmio_writes[1]);
+    if(!page)
+        vm->host->mmio_write16(vm, addr, value);
+    else if(page->mem)
+        MVM_BITCAST(uint16_t, page->mem[addr - page->base]) = value;
+    else
+        page->device->write(vm, page->device->data, addr - page->base,
+                            sizeof(uint16_t), value);
+}
+
+static void mvm_mmio_store_32(mvm *vm, uint32_t addr, uint32_t value) {
+    const mvm_page *page = mvm_mmio_lookup(vm, addr, sizeof(uint32_t));
+    MVM_STAT(mmio_writes[2]);
+    if(!page)
+        vm->host->mmio_write32(vm, addr, value);
+    else if(page->mem)
+        MVM_BITCAST(uint32_t, page->mem[addr - page->base]) = value;
+    else
+        page->device->write(vm, page->device->data, addr - page->base,
+                            sizeof(uint32_t), value);
+}
+
 uint32_t mvm_load_u8(mvm *vm, uint32_t addr) {
     if(addr <= MVM_RAM_SIZE - sizeof(uint8_t))
         return MVM_BITCAST(uint8_t, vm->ram[addr]);
     else
-        return mmio_read8(vm, addr);
+        return mvm_mmio_load_u8(vm, addr);
 }
 
 uint32_t mvm_load_u16(mvm *vm, uint32_t addr) {
     if(addr <= MVM_RAM_SIZE - sizeof(uint16_t))
         return MVM_BITCAST(uint16_t, vm->ram[addr]);
     else
-        return mmio_read16(vm, addr);
+        return mvm_mmio_load_u16(vm, addr);
 }
 
 uint32_t mvm_load_u32(mvm *vm, uint32_t addr) {
     if(addr <= MVM_RAM_SIZE - sizeof(uint32_t))
         return MVM_BITCAST(uint32_t, vm->ram[addr]);
     else
-        return mmio_read32(vm, addr);
+        return mvm_mmio_load_u32(vm, addr);
 }
 
 int32_t mvm_load_i8(mvm *vm, uint32_t addr) {
     if(addr <= MVM_RAM_SIZE - sizeof(int8_t))
         return MVM_BITCAST(int8_t, vm->ram[addr]);
     else
-        return mmio_read8(vm, addr);
+        return mvm_mmio_load_i8(vm, addr);
 }
 
 int32_t mvm_load_i16(mvm *vm, uint32_t addr) {
     if(addr <= MVM_RAM_SIZE - sizeof(int16_t))
         return MVM_BITCAST(int16_t, vm->ram[addr]);
     else
-        return mmio_read16(vm, addr);
+        return mvm_mmio_load_i16(vm, addr);
 }
 
 int32_t mvm_load_i32(mvm *vm, uint32_t addr) {
     if(addr <= MVM_RAM_SIZE - sizeof(int32_t))
         return MVM_BITCAST(int32_t, vm->ram[addr]);
     else
-        return mmio_read32(vm, addr);
+        return mvm_mmio_load_i32(vm, addr);
 }
 
 void mvm_store_8(mvm *vm, uint32_t addr, uint8_t value) {
-    if(addr <= MVM_RAM_SIZE - sizeof(uint8_t))
+    if(addr <= MVM_RAM_SIZE - sizeof(uint8_t)) {
         MVM_BITCAST(uint8_t, vm->ram[addr]) = value;
-    else
-        mmio_write8(vm, addr, value);
+        if(vm->icache && MVM_BITCAST(uint8_t, vm->icache->code[addr]))
+            mvm_icache_write(vm, addr, sizeof(uint8_t));
+    } else
+        mvm_mmio_store_8(vm, addr, value);
 }
 
 void mvm_store_16(mvm *vm, uint32_t addr, uint16_t value) {
-    if(addr <= MVM_RAM_SIZE - sizeof(uint16_t))
+    if(addr <= MVM_RAM_SIZE - sizeof(uint16_t)) {
         MVM_BITCAST(uint16_t, vm->ram[addr]) = value;
-    else
-        mmio_write16(vm, addr, value);
+        if(vm->icache && MVM_BITCAST(uint16_t, vm->icache->code[addr]))
+            mvm_icache_write(vm, addr, sizeof(uint16_t));
+    } else
+        mvm_mmio_store_16(vm, addr, value);
 }
 
 void mvm_store_32(mvm *vm, uint32_t addr, uint32_t value) {
-    if(addr <= MVM_RAM_SIZE - sizeof(uint32_t))
+    if(addr <= MVM_RAM_SIZE - sizeof(uint32_t)) {
         MVM_BITCAST(uint32_t, vm->ram[addr]) = value;
-    else
-        mmio_write32(vm, addr, value);
+        if(vm->icache && MVM_BITCAST(uint32_t, vm->icache->code[addr]))
+            mvm_icache_write(vm, addr, sizeof(uint32_t));
+    } else
+        mvm_mmio_store_32(vm, addr, value);
+}
+
+#ifdef MVM_GUARD_RAM
+
+static uint32_t mvm_load_u8_guarded(mvm *vm, uint32_t addr) {
+    return MVM_BITCAST(uint8_t, vm->ram[addr]);
+}
+
+static uint32_t mvm_load_u16_guarded(mvm *vm, uint32_t addr) {
+    return MVM_BITCAST(uint16_t, vm->ram[addr]);
+}
+
+static uint32_t mvm_load_u32_guarded(mvm *vm, uint32_t addr) {
+    return MVM_BITCAST(uint32_t, vm->ram[addr]);
+}
+
+static int32_t mvm_load_i8_guarded(mvm *vm, uint32_t addr) {
+    return MVM_BITCAST(int8_t, vm->ram[addr]);
 }
 
+static int32_t mvm_load_i16_guarded(mvm *vm, uint32_t addr) {
+    return MVM_BITCAST(int16_t, vm->ram[addr]);
+}
+
+static void mvm_store_8_guarded(mvm *vm, uint32_t addr, uint8_t value) {
+    MVM_BITCAST(uint8_t, vm->ram[addr]) = value;
+    if(vm->icache && MVM_BITCAST(uint8_t, vm->icache->code[addr]))
+        mvm_icache_write(vm, addr, sizeof(uint8_t));
+}
+
+static void mvm_store_16_guarded(mvm *vm, uint32_t addr, uint16_t value) {
+    MVM_BITCAST(uint16_t, vm->ram[addr]) = value;
+    if(vm->icache && MVM_BITCAST(uint16_t, vm->icache->code[addr]))
+        mvm_icache_write(vm, addr, sizeof(uint16_t));
+}
+
+static void mvm_store_32_guarded(mvm *vm, uint32_t addr, uint32_t value) {
+    MVM_BITCAST(uint32_t, vm->ram[addr]) = value;
+    if(vm->icache && MVM_BITCAST(uint32_t, vm->icache->code[addr]))
+        mvm_icache_write(vm, addr, sizeof(uint32_t));
+}
+
+#endif
 
 // Generated load/store end
 
 void mvm_push(mvm *vm, uint32_t x) {
-    if(vm->sp >= MVM_ARRAYSIZE(vm->stk)) {
+    if(vm->sp >= MVM_STACK_SIZE) {
         vm->status = MVM_STACK_OVERFLOW;
         return;
     }
@@ -244,7 +917,7 @@ uint32_t mvm_pop(mvm *vm) {
 }
 
 void mvm_rpush(mvm *vm, uint32_t x) {
-    if(vm->rsp >= MVM_ARRAYSIZE(vm->rstk)) {
+    if(vm->rsp >= MVM_STACK_SIZE) {
         vm->status = MVM_RETURN_STACK_OVERFLOW;
         return;
     }
@@ -259,222 +932,649 @@ uint32_t mvm_rpop(mvm *vm) {
     return vm->rstk[--vm->rsp];
 }
 
-#define MVM_BINOP_UNSIGNED(binop, block)                                       \
-    do {                                                                       \
-        ub = mvm_pop(vm);                                                      \
-        MVM_CHECK();                                                           \
-        ua = mvm_pop(vm);                                                      \
-        MVM_CHECK();                                                           \
-        block mvm_push(vm, ua binop ub);                                       \
-    } while(0)
+// The stop request is the only state shared between threads, and orders
+// nothing else.
+#ifdef __GNUC__
+#define MVM_ATOMIC_LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define MVM_ATOMIC_STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#else
+#define MVM_ATOMIC_LOAD(x) (*(volatile uint32_t *)&(x))
+#define MVM_ATOMIC_STORE(x, v) (*(volatile uint32_t *)&(x) = (v))
+#endif
 
-#define MVM_BINOP_SIGNED(binop, block)                                         \
-    do {                                                                       \
-        ub = mvm_pop(vm);                                                      \
-        MVM_CHECK();                                                           \
-        ua = mvm_pop(vm);                                                      \
-        MVM_CHECK();                                                           \
-        ia = MVM_BITCAST(int32_t, ua);                                         \
-        ib = MVM_BITCAST(int32_t, ub);                                         \
-        block ia = ia binop ib;                                                \
-        ua = MVM_BITCAST(uint32_t, ia);                                        \
-        mvm_push(vm, ua);                                                      \
-    } while(0)
+void mvm_stop(mvm *vm) {
+    MVM_ATOMIC_STORE(vm->stop, 1);
+}
 
-void mvm_run(mvm *vm, uint32_t limit) {
-    uint32_t ua, ub;
-    int32_t ia, ib;
-    while(limit-- && vm->status == MVM_RUNNING) {
-        uint8_t op = mvm_load_u8(vm, vm->pc++);
-        MVM_CHECK();
-        switch(op) {
-        case OP_BRK:
-            vm->status = MVM_HALTED;
-            break;
-        case OP_PUSH_U8:
-            ua = mvm_load_u8(vm, vm->pc);
-            MVM_CHECK();
-            vm->pc += sizeof(uint8_t);
-            mvm_push(vm, ua);
-            break;
-        case OP_PUSH_U16:
-            ua = mvm_load_u16(vm, vm->pc);
-            MVM_CHECK();
-            vm->pc += sizeof(uint16_t);
-            mvm_push(vm, ua);
-            break;
-        case OP_PUSH32:
-            ua = mvm_load_u32(vm, vm->pc);
-            MVM_CHECK();
-            vm->pc += sizeof(uint32_t);
-            mvm_push(vm, ua);
-            break;
-        case OP_DUP:
-            ua = mvm_pop(vm);
-            MVM_CHECK();
-            mvm_push(vm, ua);
-            MVM_CHECK();
-            mvm_push(vm, ua);
-            break;
-        case OP_OVR:
-            ua = mvm_pop(vm);
-            MVM_CHECK();
-            ub = mvm_pop(vm);
-            MVM_CHECK();
-            mvm_push(vm, ub);
-            mvm_push(vm, ua);
-            mvm_push(vm, ub);
+void mvm_until_init(mvm_until *until) {
+    memset(until, 0, sizeof(mvm_until));
+}
+
+void mvm_until_break(mvm_until *until, uint32_t pc, int set) {
+    if(pc >= MVM_RAM_SIZE || !mvm_until_breaks(until, pc) == !set)
+        return;
+    until->breakpoints[pc / 8] ^= 1 << pc % 8;
+    if(set)
+        until->breakpoint_count++;
+    else
+        until->breakpoint_count--;
+}
+
+int mvm_until_breaks(const mvm_until *until, uint32_t pc) {
+    return pc < MVM_RAM_SIZE && (until->breakpoints[pc / 8] >> pc % 8) & 1;
+}
+
+// whether size bytes stored at addr touch the watched range
+static int mvm_until_stores(const mvm_until *until, uint32_t addr,
+                            uint32_t size) {
+    return until->watch_size && (addr - until->watch_addr < until->watch_size ||
+                                 until->watch_addr - addr < size);
+}
+
+// to call whenever pending, enabled or servicing change
+static void mvm_interrupt_update(mvm *vm) {
+    vm->ready = vm->servicing ? 0 : vm->pending & vm->enabled;
+}
+
+void mvm_interrupt(mvm *vm, uint32_t n) {
+    if(n >= MVM_INTERRUPT_TABLE_SIZE)
+        return;
+    vm->pending |= (uint32_t)1 << n;
+    mvm_interrupt_update(vm);
+    if(vm->ready && vm->status == MVM_WAITING)
+        vm->status = MVM_RUNNING;
+}
+
+// Enters the handler of the lowest ready interrupt. The interpreters call it
+// with vm up to date when vm->ready is set, after a control transfer.
+static void mvm_interrupt_take(mvm *vm) {
+    uint32_t n = 0;
+    while(!(vm->ready >> n & 1))
+        n++;
+    mvm_rpush(vm, vm->pc);
+    if(vm->status != MVM_RUNNING)
+        return;
+    vm->pending &= ~((uint32_t)1 << n);
+    vm->servicing = 1;
+    vm->ready = 0;
+    vm->pc = MVM_BITCAST(uint32_t, vm->ram[n * sizeof(uint32_t)]);
+}
+
+#ifndef MVM_NO_SUPERINSTRUCTIONS
+
+// Turns a decoded instruction into a superinstruction when it starts one of
+// the sequences below.
+static void mvm_icache_fuse(const uint8_t *ram, mvm_insn *insn) {
+    const uint32_t next = insn->next;
+    if(next > MVM_RAM_SIZE - 3)
+        return;
+    insn->base = insn->op;
+    switch(insn->op) {
+    case OP_PUSH_U8:
+    case OP_PUSH_U16:
+    case OP_PUSH32:
+        switch(ram[next]) {
+        case OP_CALL:
+            insn->op = MVM_SUPER_PUSH_CALL;
             break;
-        case OP_POP:
-            mvm_pop(vm);
+        case OP_CJMP:
+            insn->op = MVM_SUPER_PUSH_CJMP;
             break;
         case OP_ADD:
-            MVM_BINOP_UNSIGNED(+, {});
-            break;
-        case OP_SUB:
-            MVM_BINOP_UNSIGNED(-, {});
-            break;
-        case OP_MUL:
-            MVM_BINOP_UNSIGNED(*, {});
-            break;
-        case OP_DIV:
-            MVM_BINOP_SIGNED(/, {
-                if(ib == 0) {
-                    vm->status = MVM_DIVISION_BY_ZERO;
-                    return;
-                }
-            });
-            break;
-        case OP_DIVU:
-            MVM_BINOP_UNSIGNED(/, {
-                if(ub == 0) {
-                    vm->status = MVM_DIVISION_BY_ZERO;
-                    return;
-                }
-            });
-            break;
-        case OP_REM:
-            MVM_BINOP_SIGNED(%, {
-                if(ib == 0) {
-                    vm->status = MVM_DIVISION_BY_ZERO;
-                    return;
-                }
-            });
-            break;
-        case OP_REMU:
-            MVM_BINOP_UNSIGNED(%, {
-                if(ub == 0) {
-                    vm->status = MVM_DIVISION_BY_ZERO;
-                    return;
-                }
-            });
-            break;
-        case OP_XOR:
-            MVM_BINOP_UNSIGNED(^, {});
-            break;
-        case OP_EQ:
-            MVM_BINOP_UNSIGNED(==, {});
-            break;
-        case OP_NEQ:
-            MVM_BINOP_UNSIGNED(!=, {});
-            break;
-        case OP_LT:
-            MVM_BINOP_SIGNED(<, {});
-            break;
-        case OP_GTE:
-            MVM_BINOP_SIGNED(>=, {});
-            break;
-        case OP_LTU:
-            MVM_BINOP_UNSIGNED(<, {});
-            break;
-        case OP_GTEU:
-            MVM_BINOP_UNSIGNED(>=, {});
-            break;
-        case OP_LB:
-            ua = mvm_pop(vm);
-            MVM_CHECK();
-            ia = mvm_load_i8(vm, ua);
-            MVM_CHECK();
-            mvm_push(vm, MVM_BITCAST(uint32_t, ia));
-            break;
-        case OP_LH:
-            ua = mvm_pop(vm);
-            MVM_CHECK();
-            ia = mvm_load_i16(vm, ua);
-            MVM_CHECK();
-            mvm_push(vm, MVM_BITCAST(uint32_t, ia));
+            insn->op = MVM_SUPER_PUSH_ADD;
             break;
         case OP_LW:
-            ua = mvm_pop(vm);
-            MVM_CHECK();
-            ua = mvm_load_u32(vm, ua);
-            MVM_CHECK();
-            mvm_push(vm, ua);
+            insn->op = MVM_SUPER_PUSH_LW;
             break;
-        case OP_LBU:
-            ua = mvm_pop(vm);
-            MVM_CHECK();
-            ua = mvm_load_u8(vm, ua);
-            MVM_CHECK();
-            mvm_push(vm, ua);
+        default:
+            return;
+        }
+        insn->next = next + 1;
+        break;
+    case OP_DUP:
+        if(ram[next] == OP_PUSH_U8 && ram[next + 1] == 0 &&
+           ram[next + 2] == OP_EQ) {
+            insn->op = MVM_SUPER_DUP_EQZ;
+            insn->next = next + 3;
+        }
+        break;
+    }
+}
+
+#endif
+
+// Computes the stack effect of the block starting at pc. The block stops at
+// the page boundary and all of its bytes are marked as code, so that any
+// store that could change its effect also drops the record.
+static void mvm_icache_analyze(mvm *vm, uint32_t pc, mvm_insn *insn) {
+    uint8_t *code = vm->icache->code;
+    int depth = 0, need = 0, growth = 0, len = 0;
+    uint32_t at = pc, next;
+    for(;;) {
+        const uint8_t op = vm->ram[at];
+        len++;
+        if(op >= MVM_OPCODE_COUNT) {
+            code[at] = 1;
             break;
-        case OP_LHU:
-            ua = mvm_pop(vm);
-            MVM_CHECK();
-            ua = mvm_load_u16(vm, ua);
-            MVM_CHECK();
-            mvm_push(vm, ua);
+        }
+        depth -= mvm_op_pops[op];
+        if(-depth > need)
+            need = -depth;
+        depth += mvm_op_pushes[op];
+        if(depth > growth)
+            growth = depth;
+        next = at + 1 + mvm_op_imm_size[op];
+        memset(&code[at], 1, (next < MVM_RAM_SIZE ? next : MVM_RAM_SIZE) - at);
+        // interrupts may be taken after the last ones
+        if(op == OP_BRK || op == OP_JMP || op == OP_CJMP || op == OP_CALL ||
+           op == OP_RET || op == OP_SYS || op == OP_EI || op == OP_RETI ||
+           op == OP_WFI)
             break;
-        case OP_SB:
-            ua = mvm_pop(vm);
-            MVM_CHECK();
-            ub = mvm_pop(vm);
-            mvm_store_8(vm, ua, ub);
+        if(next >= MVM_RAM_SIZE ||
+           next >> MVM_ICACHE_PAGE_SHIFT != pc >> MVM_ICACHE_PAGE_SHIFT)
             break;
-        case OP_SH:
-            ua = mvm_pop(vm);
-            MVM_CHECK();
-            ub = mvm_pop(vm);
-            mvm_store_16(vm, ua, ub);
+        at = next;
+    }
+    insn->need = need;
+    insn->growth = growth;
+    insn->len = len;
+}
+
+// Decodes the instruction at vm->pc. The record is cached unless it reaches
+// outside of ram, in which case it is written to scratch. Faults leave vm->pc
+// just after the opcode, like the raw interpreter does.
+mvm_insn *mvm_icache_decode(mvm *vm, mvm_insn *scratch) {
+    const uint32_t pc = vm->pc;
+    mvm_insn insn;
+    uint8_t op = mvm_load_u8(vm, pc);
+    if(vm->status != MVM_RUNNING) {
+        vm->pc = pc + 1;
+        return scratch;
+    }
+    insn.op = op < MVM_OPCODE_COUNT ? op : MVM_INSN_INVALID;
+    insn.imm = 0;
+    insn.next = pc + 1;
+    insn.len = 0;
+    insn.verified = 0;
+    if(insn.op != MVM_INSN_INVALID) {
+        switch(mvm_op_imm_size[op]) {
+        case sizeof(uint8_t):
+            insn.imm = mvm_load_u8(vm, insn.next);
             break;
-        case OP_SW:
-            ua = mvm_pop(vm);
-            MVM_CHECK();
-            ub = mvm_pop(vm);
-            mvm_store_16(vm, ua, ub);
+        case sizeof(uint16_t):
+            insn.imm = mvm_load_u16(vm, insn.next);
             break;
-        case OP_JMP:
-            ua = mvm_pop(vm);
-            MVM_CHECK();
-            vm->pc = ua;
+        case sizeof(uint32_t):
+            insn.imm = mvm_load_u32(vm, insn.next);
             break;
+        }
+        if(vm->status != MVM_RUNNING) {
+            vm->pc = pc + 1;
+            return scratch;
+        }
+        insn.next += mvm_op_imm_size[op];
+    }
+#ifdef MVM_TAIL_CALLS
+    insn.handler = mvm_tail_handler(insn.op);
+#endif
+    if(pc >= MVM_RAM_SIZE || insn.next > MVM_RAM_SIZE) {
+        *scratch = insn;
+        return scratch;
+    }
+#ifndef MVM_NO_SUPERINSTRUCTIONS
+    mvm_icache_fuse(vm->ram, &insn);
+#ifdef MVM_TAIL_CALLS
+    insn.handler = mvm_tail_handler(insn.op);
+#endif
+#endif
+    mvm_icache_analyze(vm, pc, &insn);
+    mvm_icache *icache = vm->icache;
+    icache->insn[pc] = insn;
+    memset(&icache->code[pc], 1, insn.next - pc);
+    return &icache->insn[pc];
+}
+
+// The verifier propagates intervals of depths over the code: walk is the
+// fixpoint from the roots, in absolute depths, and summary that of a function
+// alone, relative to its entry, for the change in depth its returns make.
+// Returns and syscalls are not edges of the proof, so the depths assumed past
+// them only need to be likely, not right: the interpreter compares them.
+#define MVM_VERIFY_PASSES 16
+
+typedef struct mvm_verify_walk {
+    int16_t low[MVM_RAM_SIZE], high[MVM_RAM_SIZE];
+    uint32_t stamp[MVM_RAM_SIZE]; // reached by the walk numbered id
+    uint32_t id;
+    uint8_t queued[MVM_RAM_SIZE];
+    uint32_t queue[MVM_RAM_SIZE], head, count;
+    int relative;
+    int ret_low, ret_high; // depths at the returns of a function, if relative
+} mvm_verify_walk;
+
+typedef struct mvm_verifier {
+    mvm_verify_walk walk, summary;
+    uint8_t bad[MVM_RAM_SIZE]; // may fault, or overlaps another instruction
+    // static call targets, 2 once summarized by their effect on the depth
+    uint8_t function[MVM_RAM_SIZE];
+    int16_t effect_low[MVM_RAM_SIZE], effect_high[MVM_RAM_SIZE];
+    uint32_t functions[MVM_RAM_SIZE], function_count;
+    int taken_low, taken_high; // depths at which interrupts may be taken
+} mvm_verifier;
+
+static void mvm_verify_start(mvm_verify_walk *w, int relative) {
+    w->id++;
+    w->relative = relative;
+    w->ret_low = MVM_STACK_SIZE + 1;
+    w->ret_high = -MVM_STACK_SIZE - 1;
+}
+
+// Widens the depths at pc by [low, high], returning 1 if they grew.
+static int mvm_verify_join(mvm_verify_walk *w, uint32_t pc, int low,
+                           int high) {
+    if(w->stamp[pc] == w->id) {
+        if(low >= w->low[pc] && high <= w->high[pc])
+            return 0;
+        if(low > w->low[pc])
+            low = w->low[pc];
+        if(high < w->high[pc])
+            high = w->high[pc];
+    }
+    w->stamp[pc] = w->id;
+    w->low[pc] = (int16_t)low;
+    w->high[pc] = (int16_t)high;
+    return 1;
+}
+
+// joins the depths at pc, to walk from there again if they grew
+static void mvm_verify_reach(mvm_verify_walk *w, uint32_t pc, int low,
+                             int high) {
+    const int floor = w->relative ? -MVM_STACK_SIZE : 0;
+    if(low < floor)
+        low = floor;
+    if(high > MVM_STACK_SIZE)
+        high = MVM_STACK_SIZE;
+    if(pc >= MVM_RAM_SIZE || low > high || !mvm_verify_join(w, pc, low, high) ||
+       w->queued[pc])
+        return;
+    w->queued[pc] = 1;
+    w->queue[(w->head + w->count++) % MVM_RAM_SIZE] = pc;
+}
+
+// Applies the stack effect of op to [*low, *high]. Returns 0 if it may fault
+// on the stack, or for a relative walk leave the depths tracked.
+static int mvm_verify_effect(const mvm_verify_walk *w, uint8_t op, int *low,
+                             int *high) {
+    const int pops = mvm_op_pops[op], pushes = mvm_op_pushes[op];
+    const int floor = w->relative ? -MVM_STACK_SIZE : 0;
+    if(*low - pops < floor || *high - pops + pushes > MVM_STACK_SIZE)
+        return 0;
+    *low += pushes - pops;
+    *high += pushes - pops;
+    return 1;
+}
+
+static void mvm_verify_taken(mvm_verifier *v, const mvm_verify_walk *w,
+                             int low, int high) {
+    if(w->relative)
+        return;
+    if(low < v->taken_low)
+        v->taken_low = low;
+    if(high > v->taken_high)
+        v->taken_high = high;
+}
+
+// A static call walks into the function, but in a summary only steps over it.
+// Either way the walk goes on past the call once the function is summarized.
+static void mvm_verify_call(mvm_verifier *v, mvm_verify_walk *w,
+                            uint32_t target, uint32_t next, int low,
+                            int high) {
+    if(target >= MVM_RAM_SIZE)
+        return;
+    if(!w->relative)
+        mvm_verify_reach(w, target, low, high);
+    if(!v->function[target]) {
+        v->function[target] = 1;
+        v->functions[v->function_count++] = target;
+    }
+    if(v->function[target] == 2)
+        mvm_verify_reach(w, next, low + v->effect_low[target],
+                         high + v->effect_high[target]);
+}
+
+// Walks the edges of the instruction at pc. A push followed in the same block
+// by jmp, cjmp or call gives the target, and is followed as a whole.
+static void mvm_verify_step(mvm_verifier *v, mvm_verify_walk *w, uint8_t *ram,
+                            uint32_t pc) {
+    int low = w->low[pc], high = w->high[pc];
+    const uint8_t op = ram[pc];
+    const uint32_t next =
+        op < MVM_OPCODE_COUNT ? pc + 1 + mvm_op_imm_size[op] : pc + 1;
+    if(op >= MVM_OPCODE_COUNT || next > MVM_RAM_SIZE ||
+       !mvm_verify_effect(w, op, &low, &high)) {
+        v->bad[pc] |= !w->relative;
+        return;
+    }
+    const uint8_t transfer = next < MVM_RAM_SIZE ? ram[next] : OP_BRK;
+    if(mvm_op_imm_size[op] &&
+       (transfer == OP_JMP || transfer == OP_CJMP || transfer == OP_CALL) &&
+       next >> MVM_ICACHE_PAGE_SHIFT == pc >> MVM_ICACHE_PAGE_SHIFT) {
+        uint32_t target = ram[pc + 1];
+        if(op == OP_PUSH_U16)
+            target = MVM_BITCAST(uint16_t, ram[pc + 1]);
+        else if(op == OP_PUSH32)
+            target = MVM_BITCAST(uint32_t, ram[pc + 1]);
+        mvm_verify_join(w, next, low, high);
+        if(!mvm_verify_effect(w, transfer, &low, &high)) {
+            v->bad[next] |= !w->relative;
+            return;
+        }
+        mvm_verify_taken(v, w, low, high);
+        if(transfer == OP_CALL) {
+            mvm_verify_call(v, w, target, next + 1, low, high);
+            return;
+        }
+        mvm_verify_reach(w, target, low, high);
+        if(transfer == OP_CJMP)
+            mvm_verify_reach(w, next + 1, low, high);
+        return;
+    }
+    switch(op) {
+    case OP_BRK:
+        return;
+    case OP_RET:
+        if(low < w->ret_low)
+            w->ret_low = low;
+        if(high > w->ret_high)
+            w->ret_high = high;
+        mvm_verify_taken(v, w, low, high);
+        return;
+    case OP_JMP:
+    case OP_CALL:
+    case OP_RETI:
+        mvm_verify_taken(v, w, low, high);
+        return;
+    case OP_CJMP:
+    case OP_SYS:
+    case OP_EI:
+    case OP_WFI:
+        mvm_verify_taken(v, w, low, high);
+        break;
+    }
+    mvm_verify_reach(w, next, low, high);
+}
+
+static void mvm_verify_run(mvm_verifier *v, mvm_verify_walk *w,
+                           uint8_t *ram) {
+    while(w->count) {
+        const uint32_t pc = w->queue[w->head];
+        w->head = (w->head + 1) % MVM_RAM_SIZE;
+        w->count--;
+        w->queued[pc] = 0;
+        mvm_verify_step(v, w, ram, pc);
+    }
+}
+
+// Summarizes the functions found so far, and those they call in turn.
+// Returns 1 if a summary changed.
+static int mvm_verify_summarize(mvm_verifier *v, uint8_t *ram) {
+    mvm_verify_walk *w = &v->summary;
+    int changed = 0;
+    for(uint32_t i = 0; i < v->function_count; i++) {
+        const uint32_t f = v->functions[i];
+        mvm_verify_start(w, 1);
+        mvm_verify_reach(w, f, 0, 0);
+        mvm_verify_run(v, w, ram);
+        if(w->ret_low > w->ret_high ||
+           (v->function[f] == 2 && v->effect_low[f] == w->ret_low &&
+            v->effect_high[f] == w->ret_high))
+            continue;
+        v->function[f] = 2;
+        v->effect_low[f] = (int16_t)w->ret_low;
+        v->effect_high[f] = (int16_t)w->ret_high;
+        changed = 1;
+    }
+    return changed;
+}
+
+// Flags of the record at pc, if each instruction of its block was proved. The
+// block chains unless it leaves through a computed target, a return, a
+// syscall or past ram.
+static uint8_t mvm_verify_block(const mvm_verifier *v, const uint8_t *ram,
+                                uint32_t pc) {
+    const mvm_verify_walk *w = &v->walk;
+    uint32_t at = pc, prev = pc;
+    for(;;) {
+        if(w->stamp[at] != w->id || v->bad[at])
+            return 0;
+        const uint8_t op = ram[at];
+        const uint32_t next = at + 1 + mvm_op_imm_size[op];
+        switch(op) {
+        case OP_JMP:
         case OP_CJMP:
-            ub = mvm_pop(vm);
-            MVM_CHECK();
-            ua = mvm_pop(vm);
-            MVM_CHECK();
-            if(ua)
-                vm->pc = ub;
-            break;
         case OP_CALL:
-            ua = mvm_pop(vm);
-            MVM_CHECK();
-            mvm_rpush(vm, vm->pc);
-            vm->pc = ua;
-            break;
+            return at != pc && mvm_op_imm_size[ram[prev]]
+                       ? MVM_INSN_VERIFIED | MVM_INSN_CHAINS
+                       : MVM_INSN_VERIFIED;
+        case OP_BRK:
         case OP_RET:
-            ua = mvm_rpop(vm);
-            MVM_CHECK();
-            vm->pc = ua;
-            break;
         case OP_SYS:
-            syscall(vm);
+        case OP_RETI:
+            return MVM_INSN_VERIFIED;
+        }
+        if(next >= MVM_RAM_SIZE)
+            return MVM_INSN_VERIFIED;
+        if(op == OP_EI || op == OP_WFI ||
+           next >> MVM_ICACHE_PAGE_SHIFT != pc >> MVM_ICACHE_PAGE_SHIFT)
+            return MVM_INSN_VERIFIED | MVM_INSN_CHAINS;
+        prev = at;
+        at = next;
+    }
+}
+
+uint32_t mvm_verify(mvm *vm) {
+    if(!vm->icache || vm->status != MVM_RUNNING)
+        return 0;
+    mvm_verifier *v = (mvm_verifier *)calloc(1, sizeof(mvm_verifier));
+    if(!v)
+        return 0;
+    uint8_t *ram = vm->ram;
+    mvm_verify_walk *w = &v->walk;
+    // walks again until the summaries of the functions settle
+    for(int pass = 0; pass < MVM_VERIFY_PASSES; pass++) {
+        memset(v->bad, 0, sizeof(v->bad));
+        v->taken_low = v->taken_high = 0;
+        mvm_verify_start(w, 0);
+        mvm_verify_reach(w, MVM_ENTRY_POINT, 0, 0);
+        mvm_verify_run(v, w, ram);
+        for(uint32_t n = 0; n < MVM_INTERRUPT_TABLE_SIZE; n++) {
+            const uint32_t handler =
+                MVM_BITCAST(uint32_t, ram[n * sizeof(uint32_t)]);
+            if(handler >= MVM_ENTRY_POINT)
+                mvm_verify_reach(w, handler, v->taken_low, v->taken_high);
+        }
+        mvm_verify_run(v, w, ram);
+        if(!mvm_verify_summarize(v, ram))
             break;
-        default:
-            vm->status = MVM_INVALID_INSTRUCTION;
-            return;
+    }
+    // a byte can't be both an opcode and an immediate
+    for(uint32_t pc = 0; pc < MVM_RAM_SIZE; pc++) {
+        if(w->stamp[pc] != w->id || ram[pc] >= MVM_OPCODE_COUNT)
+            continue;
+        for(uint32_t i = 1; i <= mvm_op_imm_size[ram[pc]]; i++) {
+            if(pc + i < MVM_RAM_SIZE && w->stamp[pc + i] == w->id)
+                v->bad[pc] = v->bad[pc + i] = 1;
         }
     }
+    const uint32_t pc = vm->pc;
+    uint32_t verified = 0;
+    for(uint32_t at = 0; at < MVM_RAM_SIZE; at++) {
+        if(w->stamp[at] != w->id || w->high[at] > UINT8_MAX)
+            continue;
+        const uint8_t flags = mvm_verify_block(v, ram, at);
+        if(!flags)
+            continue;
+        mvm_insn scratch;
+        vm->pc = at;
+        mvm_insn *insn = mvm_icache_decode(vm, &scratch);
+        if(insn == &scratch)
+            continue;
+        insn->verified = flags;
+        insn->low = (uint8_t)w->low[at];
+        insn->high = (uint8_t)w->high[at];
+        verified++;
+    }
+    vm->pc = pc;
+    vm->icache->verified = verified != 0;
+    free(v);
+    return verified;
+}
+
+// Threaded dispatch: with GCC/Clang every handler jumps straight to the next
+// one through a table of label addresses, so each opcode gets its own
+// (better predicted) indirect branch. Strict C99 compilers use the switch.
+#if defined(__GNUC__) && !defined(MVM_NO_COMPUTED_GOTO)
+#define MVM_COMPUTED_GOTO
+#endif
+
+// Define MVM_TOS_CACHE to keep the stack pointer and the top of the stack in
+// locals of the interpreter loop, saving a memory round trip per operand.
+
+// Define MVM_TAIL_CALLS to run cached code with mvm_run_tail instead of
+// mvm_run_cached: each handler is a function, which calls the next one through
+// the handler of its record, with pc, sp and the top of the stack as
+// arguments. Needs GCC or Clang, and neither of MVM_GUARD_STACKS and
+// MVM_GUARD_RAM.
+
+#ifdef MVM_COMPUTED_GOTO
+
+// Generated dispatch table start
+
+#define MVM_DISPATCH_OPCODES(label)                                            \
+    &&label##_OP_BRK, &&label##_OP_PUSH_U8, &&label##_OP_PUSH_U16,             \
+    &&label##_OP_PUSH32, &&label##_OP_DUP, &&label##_OP_OVR, &&label##_OP_POP, \
+    &&label##_OP_ADD, &&label##_OP_SUB, &&label##_OP_MUL, &&label##_OP_DIV,    \
+    &&label##_OP_DIVU, &&label##_OP_REM, &&label##_OP_REMU, &&label##_OP_XOR,  \
+    &&label##_OP_EQ, &&label##_OP_NEQ, &&label##_OP_LT, &&label##_OP_GTE,      \
+    &&label##_OP_LTU, &&label##_OP_GTEU, &&label##_OP_LB, &&label##_OP_LH,     \
+    &&label##_OP_LW, &&label##_OP_LBU, &&label##_OP_LHU, &&label##_OP_SB,      \
+    &&label##_OP_SH, &&label##_OP_SW, &&label##_OP_JMP, &&label##_OP_CJMP,     \
+    &&label##_OP_CALL, &&label##_OP_RET, &&label##_OP_SYS, &&label##_OP_EI,    \
+    &&label##_OP_DI, &&label##_OP_RETI, &&label##_OP_WFI,
+
+// Generated dispatch table end
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+#define MVM_INTERP_NAME mvm_run_raw
+#include "mvm_interp.h"
+
+#define MVM_INTERP_NAME mvm_run_cached
+#define MVM_INTERP_CACHED
+#include "mvm_interp.h"
+
+// Code proved by mvm_verify runs in a copy of the cached interpreter that
+// chains its blocks, only where the fast path exists and compares the depth.
+#if defined(MVM_COMPUTED_GOTO) && !defined(MVM_TAIL_CALLS) &&                  \
+    !defined(MVM_GUARD_STACKS)
+#define MVM_RUN_VERIFIED
+#define MVM_INTERP_NAME mvm_run_verified
+#define MVM_INTERP_CACHED
+#define MVM_INTERP_VERIFIED
+#include "mvm_interp.h"
+#endif
+
+// mvm_run_until checks breakpoints on the raw interpreter, where each
+// instruction starts on its own, and its other conditions on either.
+#define MVM_INTERP_NAME mvm_run_until_raw
+#define MVM_INTERP_UNTIL
+#define MVM_INTERP_BREAKPOINTS
+#include "mvm_interp.h"
+
+#define MVM_INTERP_NAME mvm_run_until_cached
+#define MVM_INTERP_CACHED
+#define MVM_INTERP_UNTIL
+#include "mvm_interp.h"
+
+#ifdef MVM_TAIL_CALLS
+
+// Generated handler table start
+
+#define MVM_HANDLER_OPCODES(prefix)                                            \
+    prefix##_OP_BRK, prefix##_OP_PUSH_U8, prefix##_OP_PUSH_U16,                \
+    prefix##_OP_PUSH32, prefix##_OP_DUP, prefix##_OP_OVR, prefix##_OP_POP,     \
+    prefix##_OP_ADD, prefix##_OP_SUB, prefix##_OP_MUL, prefix##_OP_DIV,        \
+    prefix##_OP_DIVU, prefix##_OP_REM, prefix##_OP_REMU, prefix##_OP_XOR,      \
+    prefix##_OP_EQ, prefix##_OP_NEQ, prefix##_OP_LT, prefix##_OP_GTE,          \
+    prefix##_OP_LTU, prefix##_OP_GTEU, prefix##_OP_LB, prefix##_OP_LH,         \
+    prefix##_OP_LW, prefix##_OP_LBU, prefix##_OP_LHU, prefix##_OP_SB,          \
+    prefix##_OP_SH, prefix##_OP_SW, prefix##_OP_JMP, prefix##_OP_CJMP,         \
+    prefix##_OP_CALL, prefix##_OP_RET, prefix##_OP_SYS, prefix##_OP_EI,        \
+    prefix##_OP_DI, prefix##_OP_RETI, prefix##_OP_WFI,
+
+// Generated handler table end
+
+#define MVM_INTERP_NAME mvm_run_tail
+#define MVM_INTERP_CACHED
+#define MVM_INTERP_TAIL
+#include "mvm_interp.h"
+
+#endif
+
+#ifdef MVM_COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
+
+// mvm_run leaving any stop request set, for mvm_jit_run
+static uint32_t mvm_run_interpreter(mvm *vm, uint32_t limit) {
+    if(vm->ready && vm->status == MVM_RUNNING)
+        mvm_interrupt_take(vm);
+#ifdef MVM_TAIL_CALLS
+    if(vm->icache)
+        return mvm_run_tail(vm, limit);
+#else
+#ifdef MVM_RUN_VERIFIED
+    if(vm->icache && vm->icache->verified)
+        return mvm_run_verified(vm, limit);
+#endif
+    if(vm->icache)
+        return mvm_run_cached(vm, limit);
+#endif
+    return mvm_run_raw(vm, limit);
+}
+
+uint32_t mvm_run(mvm *vm, uint32_t limit) {
+    const uint32_t executed = mvm_run_interpreter(vm, limit);
+    if(MVM_ATOMIC_LOAD(vm->stop))
+        MVM_ATOMIC_STORE(vm->stop, 0);
+    return executed;
+}
+
+uint32_t mvm_run_until(mvm *vm, uint32_t limit, mvm_until *until) {
+    if(!until)
+        return mvm_run(vm, limit);
+    until->hit = MVM_UNTIL_NONE;
+    if(!until->breakpoint_count && !until->depth && !until->watch_size)
+        return mvm_run(vm, limit);
+    uint32_t executed = 0;
+    const uint32_t from = vm->pc;
+    if(vm->ready && vm->status == MVM_RUNNING)
+        mvm_interrupt_take(vm);
+    // a handler taken first did not start the run, and stops on a breakpoint
+    if(vm->pc != from && mvm_until_breaks(until, vm->pc)) {
+        until->hit = MVM_UNTIL_BREAKPOINT;
+    } else {
+        vm->until = until;
+        if(until->breakpoint_count || !vm->icache)
+            executed = mvm_run_until_raw(vm, limit);
+        else
+            executed = mvm_run_until_cached(vm, limit);
+        vm->until = NULL;
+    }
+    if(MVM_ATOMIC_LOAD(vm->stop))
+        MVM_ATOMIC_STORE(vm->stop, 0);
+    return executed;
 }
 
 static int str_eq(const char *s1, const char *s2) {
@@ -516,36 +1616,44 @@ void mvm_dump(mvm *vm) {
     printf("\n");
 }
 
-#ifdef MVM_DUMMY_IO_IMPLEMENTATION
+static void mvm_default_syscall(mvm *vm) {}
 
-uint32_t mmio_read8(mvm *vm, uint32_t addr) {
+static uint32_t mvm_default_read8(mvm *vm, uint32_t addr) {
     vm->status = MVM_SEGMENTATION_FAULT;
     return 0;
 }
 
-uint32_t mmio_read16(mvm *vm, uint32_t addr) {
+static uint32_t mvm_default_read16(mvm *vm, uint32_t addr) {
     vm->status = MVM_SEGMENTATION_FAULT;
     return 0;
 }
 
-uint32_t mmio_read32(mvm *vm, uint32_t addr) {
+static uint32_t mvm_default_read32(mvm *vm, uint32_t addr) {
     vm->status = MVM_SEGMENTATION_FAULT;
     return 0;
 }
 
-void mmio_write8(mvm *vm, uint32_t addr, uint8_t value) {
+static void mvm_default_write8(mvm *vm, uint32_t addr, uint8_t value) {
     vm->status = MVM_SEGMENTATION_FAULT;
 }
 
-void mmio_write16(mvm *vm, uint32_t addr, uint16_t value) {
+static void mvm_default_write16(mvm *vm, uint32_t addr, uint16_t value) {
     vm->status = MVM_SEGMENTATION_FAULT;
 }
 
-void mmio_write32(mvm *vm, uint32_t addr, uint32_t value) {
+static void mvm_default_write32(mvm *vm, uint32_t addr, uint32_t value) {
     vm->status = MVM_SEGMENTATION_FAULT;
 }
 
-#endif
+const mvm_host mvm_default_host = {
+    mvm_default_syscall,
+    mvm_default_read8,
+    mvm_default_read16,
+    mvm_default_read32,
+    mvm_default_write8,
+    mvm_default_write16,
+    mvm_default_write32,
+};
 
 #endif
 #endif
@@ -0,0 +1,194 @@
+#ifndef MVM_BATCH_H
+#define MVM_BATCH_H
+
+// Runs many vms to completion on a pool of threads. Each worker owns a deque
+// of vms which it time-slices: it takes the one at the front, runs it for a
+// slice and puts it back at the end if it is still running. A worker with an
+// empty deque steals from the end of the others, so the load evens out however
+// long the vms run.
+//
+// Vms are run with mvm_guard_run, and set up as for it. Their host handlers
+// are called from any of the workers, concurrently for different vms, so
+// hosts shared between vms must be thread-safe. MVM_BATCH_IMPLEMENTATION must
+// be defined in the same file as MVM_IMPLEMENTATION and
+// MVM_GUARD_IMPLEMENTATION.
+
+#include <stdint.h>
+#include "mvm.h"
+
+typedef struct mvm_batch_job {
+    mvm *vm;
+    uint64_t instructions; // executed
+} mvm_batch_job;
+
+// Runs the vms of the jobs until they all stop, on threads workers, or one per
+// online core if 0, slice instructions at a time. Returns 0 if the deques
+// can't be allocated, before running anything.
+int mvm_batch_run(mvm_batch_job *jobs, uint32_t count, uint32_t threads,
+                  uint32_t slice);
+
+#ifdef MVM_BATCH_IMPLEMENTATION
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "mvm_guard.h"
+
+// a ring of job indices, each deque large enough for all the jobs
+typedef struct mvm_batch_deque {
+    pthread_mutex_t lock;
+    uint32_t *jobs;
+    uint32_t head, size;
+    uint8_t pad[64]; // keeps the locks of two deques off a cache line
+} mvm_batch_deque;
+
+typedef struct mvm_batch {
+    mvm_batch_job *jobs;
+    uint32_t count, threads, slice;
+    uint32_t running; // jobs that haven't stopped, updated atomically
+    mvm_batch_deque *deques;
+} mvm_batch;
+
+typedef struct mvm_batch_worker {
+    mvm_batch *batch;
+    uint32_t id;
+} mvm_batch_worker;
+
+static int mvm_batch_pop_front(mvm_batch *batch, mvm_batch_deque *deque,
+                               uint32_t *job) {
+    int found = 0;
+    pthread_mutex_lock(&deque->lock);
+    if(deque->size) {
+        *job = deque->jobs[deque->head];
+        deque->head = (deque->head + 1) % batch->count;
+        deque->size--;
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static int mvm_batch_pop_back(mvm_batch *batch, mvm_batch_deque *deque,
+                              uint32_t *job) {
+    int found = 0;
+    pthread_mutex_lock(&deque->lock);
+    if(deque->size) {
+        deque->size--;
+        *job = deque->jobs[(deque->head + deque->size) % batch->count];
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static void mvm_batch_push_back(mvm_batch *batch, mvm_batch_deque *deque,
+                                uint32_t job) {
+    pthread_mutex_lock(&deque->lock);
+    deque->jobs[(deque->head + deque->size) % batch->count] = job;
+    deque->size++;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+// tries the other deques once, starting after the worker's own
+static int mvm_batch_steal(mvm_batch *batch, uint32_t id, uint32_t *job) {
+    for(uint32_t i = 1; i < batch->threads; i++) {
+        mvm_batch_deque *victim = &batch->deques[(id + i) % batch->threads];
+        if(mvm_batch_pop_back(batch, victim, job))
+            return 1;
+    }
+    return 0;
+}
+
+static void *mvm_batch_work(void *arg) {
+    const mvm_batch_worker *worker = (const mvm_batch_worker *)arg;
+    mvm_batch *batch = worker->batch;
+    mvm_batch_deque *own = &batch->deques[worker->id];
+    for(;;) {
+        uint32_t job;
+        if(!mvm_batch_pop_front(batch, own, &job) &&
+           !mvm_batch_steal(batch, worker->id, &job)) {
+            // the last running vms may be in the hands of other workers
+            if(!__atomic_load_n(&batch->running, __ATOMIC_ACQUIRE))
+                break;
+            sched_yield();
+            continue;
+        }
+        mvm *vm = batch->jobs[job].vm;
+        batch->jobs[job].instructions += mvm_guard_run(vm, batch->slice);
+        if(vm->status == MVM_RUNNING)
+            mvm_batch_push_back(batch, own, job);
+        else
+            __atomic_sub_fetch(&batch->running, 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+int mvm_batch_run(mvm_batch_job *jobs, uint32_t count, uint32_t threads,
+                  uint32_t slice) {
+    if(!count)
+        return 1;
+    if(!threads) {
+        const long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cores > 0 ? (uint32_t)cores : 1;
+    }
+    if(threads > count)
+        threads = count;
+
+    mvm_batch batch;
+    batch.jobs = jobs;
+    batch.count = count;
+    batch.threads = threads;
+    batch.slice = slice ? slice : 1;
+    batch.running = 0;
+    batch.deques = (mvm_batch_deque *)calloc(threads, sizeof(mvm_batch_deque));
+    mvm_batch_worker *workers =
+        (mvm_batch_worker *)malloc(threads * sizeof(mvm_batch_worker));
+    pthread_t *ids = (pthread_t *)malloc(threads * sizeof(pthread_t));
+    uint32_t *rings = (uint32_t *)malloc((size_t)threads * count *
+                                         sizeof(uint32_t));
+    if(!batch.deques || !workers || !ids || !rings) {
+        free(batch.deques);
+        free(workers);
+        free(ids);
+        free(rings);
+        return 0;
+    }
+    for(uint32_t i = 0; i < threads; i++) {
+        pthread_mutex_init(&batch.deques[i].lock, NULL);
+        batch.deques[i].jobs = rings + (size_t)i * count;
+        workers[i].batch = &batch;
+        workers[i].id = i;
+    }
+    for(uint32_t i = 0; i < count; i++) {
+        jobs[i].instructions = 0;
+        if(jobs[i].vm->status != MVM_RUNNING)
+            continue;
+        mvm_batch_deque *deque = &batch.deques[i % threads];
+        deque->jobs[deque->size++] = i;
+        batch.running++;
+    }
+
+    // the calling thread is worker 0; the deques of workers that fail to
+    // start are emptied by the others
+    uint32_t started = 1;
+    for(uint32_t i = 1; i < threads; i++) {
+        if(!pthread_create(&ids[started], NULL, mvm_batch_work, &workers[i]))
+            started++;
+    }
+    mvm_batch_work(&workers[0]);
+    for(uint32_t i = 1; i < started; i++)
+        pthread_join(ids[i], NULL);
+
+    for(uint32_t i = 0; i < threads; i++)
+        pthread_mutex_destroy(&batch.deques[i].lock);
+    free(batch.deques);
+    free(workers);
+    free(ids);
+    free(rings);
+    return 1;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,170 @@
+#ifndef MVM_FORK_H
+#define MVM_FORK_H
+
+// Copy-on-write clones of a vm for Linux. mvm_image_capture saves a vm, its
+// ram in a memfd, and mvm_fork starts any number of children from it, their
+// ram a private mapping of the memfd: the kernel shares the pages until a
+// child writes one, so a child costs a few system calls up front and a page
+// fault per page it writes.
+//
+// mvm_image_load makes an image of a rom file instead, mapped as the start of
+// ram, so that the pages of a rom stay shared in the page cache by all the
+// vms running it. The file must not shrink while they do.
+//
+// Children start with the registers, stacks, host, user and mmio of the
+// image but without an instruction cache, which each must attach its own
+// of. With MVM_GUARD_STACKS or MVM_GUARD_RAM the children get the same
+// layout as from mvm_guard_init. MVM_FORK_IMPLEMENTATION must be defined in
+// the same file as MVM_IMPLEMENTATION and MVM_GUARD_IMPLEMENTATION.
+
+#include <stdint.h>
+#include "mvm.h"
+
+typedef struct mvm_image {
+    mvm vm;
+#ifdef MVM_GUARD_STACKS
+    uint32_t stk[MVM_STACK_SIZE], rstk[MVM_STACK_SIZE];
+#endif
+    int fd;          // file holding the ram, a memfd when captured
+    uint64_t offset; // of the ram in fd, a multiple of the page size
+    uint32_t size;   // bytes of ram in fd, the rest is zero
+} mvm_image;
+
+// The vm may keep running afterwards, its children don't see it. They return
+// 0 if the memfd or the memory of the child can't be set up.
+int mvm_image_capture(mvm_image *image, const mvm *vm);
+// a vm as after mvm_init, with the rom loaded at address 0; returns 0 with
+// errno set if the rom can't be opened, isn't a file or is larger than ram
+int mvm_image_load(mvm_image *image, const char *rom_path);
+int mvm_fork(const mvm_image *image, mvm *child);
+// only after a successful mvm_fork, the image may be freed before its children
+void mvm_fork_free(mvm *child);
+void mvm_image_free(mvm_image *image);
+
+#ifdef MVM_FORK_IMPLEMENTATION
+
+#ifndef __linux__
+#error "mvm_fork.h is only supported on Linux"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "mvm_guard.h"
+
+#ifndef MFD_CLOEXEC
+// declared by sys/mman.h only with _GNU_SOURCE
+#define MFD_CLOEXEC 1U
+int memfd_create(const char *name, unsigned int flags);
+#endif
+
+int mvm_image_capture(mvm_image *image, const mvm *vm) {
+    image->fd = memfd_create("mvm", MFD_CLOEXEC);
+    if(image->fd < 0)
+        return 0;
+    if(ftruncate(image->fd, MVM_RAM_SIZE) ||
+       pwrite(image->fd, vm->ram, MVM_RAM_SIZE, 0) != MVM_RAM_SIZE) {
+        close(image->fd);
+        return 0;
+    }
+    image->offset = 0;
+    image->size = MVM_RAM_SIZE;
+    image->vm = *vm;
+#ifdef MVM_GUARD_STACKS
+    memcpy(image->stk, vm->stk, sizeof(image->stk));
+    memcpy(image->rstk, vm->rstk, sizeof(image->rstk));
+#endif
+    return 1;
+}
+
+int mvm_image_load(mvm_image *image, const char *rom_path) {
+    memset(image, 0, sizeof(mvm_image));
+    image->fd = open(rom_path, O_RDONLY | O_CLOEXEC);
+    if(image->fd < 0)
+        return 0;
+    struct stat st;
+    if(fstat(image->fd, &st)) {
+        close(image->fd);
+        return 0;
+    }
+    if(!S_ISREG(st.st_mode) || st.st_size > MVM_RAM_SIZE) {
+        close(image->fd);
+        errno = S_ISDIR(st.st_mode) ? EISDIR
+                : S_ISREG(st.st_mode) ? EFBIG
+                                      : EINVAL;
+        return 0;
+    }
+    image->size = (uint32_t)st.st_size;
+    mvm_init(&image->vm, NULL);
+    return 1;
+}
+
+// The ram of a child, zero pages under the ones of the file, at the start of
+// a reservation as in mvm_guard_init. The file ends in the middle of its last
+// page, the rest of which reads as zero.
+static uint8_t *mvm_fork_map(const mvm_image *image) {
+#ifdef MVM_GUARD_RAM
+    uint8_t *ram = mvm_guard_reserve(MVM_GUARD_RAM_SPAN, MVM_RAM_SIZE);
+    const uint64_t size = MVM_GUARD_RAM_SPAN;
+#else
+    uint8_t *ram = (uint8_t *)mmap(NULL, MVM_RAM_SIZE, PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    const uint64_t size = MVM_RAM_SIZE;
+    if(ram == MAP_FAILED)
+        ram = NULL;
+#endif
+    if(ram && image->size &&
+       mmap(ram, image->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+            image->fd, (off_t)image->offset) == MAP_FAILED) {
+        munmap(ram, size);
+        ram = NULL;
+    }
+    return ram;
+}
+
+int mvm_fork(const mvm_image *image, mvm *child) {
+#if defined(MVM_GUARD_STACKS) || defined(MVM_GUARD_RAM)
+    if(!mvm_guard_install())
+        return 0;
+#endif
+    uint8_t *ram = mvm_fork_map(image);
+    if(!ram)
+        return 0;
+    *child = image->vm;
+    child->ram = ram;
+    child->icache = NULL;
+#ifdef MVM_GUARD_STACKS
+    child->stk = mvm_guard_map();
+    child->rstk = mvm_guard_map();
+    if(!child->stk || !child->rstk) {
+        // unmaps ram along with the stacks when it has guards too
+        mvm_guard_free(child);
+#ifndef MVM_GUARD_RAM
+        munmap(ram, MVM_RAM_SIZE);
+#endif
+        return 0;
+    }
+    memcpy(child->stk, image->stk, sizeof(image->stk));
+    memcpy(child->rstk, image->rstk, sizeof(image->rstk));
+#endif
+    return 1;
+}
+
+void mvm_fork_free(mvm *child) {
+#ifndef MVM_GUARD_RAM
+    munmap(child->ram, MVM_RAM_SIZE);
+    child->ram = NULL;
+#endif
+    mvm_guard_free(child);
+}
+
+void mvm_image_free(mvm_image *image) {
+    close(image->fd);
+}
+
+#endif
+
+#endif
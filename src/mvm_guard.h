@@ -0,0 +1,339 @@
+#ifndef MVM_GUARD_H
+#define MVM_GUARD_H
+
+// Guard pages for Linux, replacing bounds checks of the interpreter with
+// faults that mvm_guard_run catches.
+//
+// With MVM_GUARD_STACKS defined, vm->stk and vm->rstk each fill the end of a
+// page followed by a 16 GiB PROT_NONE reservation, which every out of range
+// index lands in: the one past the top of a full stack as well as the wrapped
+// around sp - 1 of an empty one. The SIGSEGV becomes the status of the vm that
+// the faulting thread is running.
+//
+// With MVM_GUARD_RAM defined, vm->ram moves to the start of a reservation
+// covering every 32-bit address, of which only ram is mapped. A load or store
+// past it faults and is replayed through the mmio callbacks before the run
+// goes on, which is slow: this suits programs that seldom touch mmio.
+//
+// Call mvm_guard_init once after mvm_init, with the ram loaded, and run the vm
+// with mvm_guard_run. Without either option these fall back to mvm_run and the
+// memory given to mvm_init, so hosts may use them unconditionally.
+// MVM_GUARD_IMPLEMENTATION must be defined in the same file as
+// MVM_IMPLEMENTATION.
+
+#include <stdint.h>
+#include "mvm.h"
+
+// returns 0 if the memory or the signal handler can't be set up
+int mvm_guard_init(mvm *vm);
+// only after a successful mvm_guard_init
+void mvm_guard_free(mvm *vm);
+// returns the instructions executed, as mvm_run does
+uint32_t mvm_guard_run(mvm *vm, uint32_t limit);
+// mvm_run_until under the guard, until NULL running as mvm_guard_run
+uint32_t mvm_guard_run_until(mvm *vm, uint32_t limit, mvm_until *until);
+
+#ifdef MVM_GUARD_IMPLEMENTATION
+
+#if defined(MVM_GUARD_STACKS) || defined(MVM_GUARD_RAM)
+
+#ifndef __linux__
+#error "MVM_GUARD_STACKS and MVM_GUARD_RAM are only supported on Linux"
+#endif
+
+#include <setjmp.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define MVM_GUARD_PAGE ((size_t)sysconf(_SC_PAGESIZE))
+// bytes reachable from the start of a stack with a 32-bit index
+#define MVM_GUARD_SPAN ((uint64_t)sizeof(uint32_t) << 32)
+// every 32-bit address, and the bytes a 32-bit access at the last one reaches
+#define MVM_GUARD_RAM_SPAN (((uint64_t)1 << 32) + MVM_GUARD_PAGE)
+// frame status of an access past ram
+#define MVM_GUARD_MMIO (-1)
+
+typedef struct mvm_guard_frame {
+    mvm *vm;
+    sigjmp_buf env;
+    volatile int status; // set by the handler before jumping to env
+    struct mvm_guard_frame *prev;
+} mvm_guard_frame;
+
+// innermost mvm_guard_run of the thread
+static __thread mvm_guard_frame *mvm_guard_current;
+static struct sigaction mvm_guard_chained;
+static int mvm_guard_installed;
+
+// reserves size bytes, of which the first mapped are readable and writable
+static uint8_t *mvm_guard_reserve(uint64_t size, size_t mapped) {
+    uint8_t *base = (uint8_t *)mmap(NULL, size, PROT_NONE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                                    -1, 0);
+    if(base == MAP_FAILED)
+        return NULL;
+    if(mprotect(base, mapped, PROT_READ | PROT_WRITE)) {
+        munmap(base, size);
+        return NULL;
+    }
+    return base;
+}
+
+#ifdef MVM_GUARD_STACKS
+
+static uint32_t *mvm_guard_map(void) {
+    const size_t page = MVM_GUARD_PAGE;
+    uint8_t *base = mvm_guard_reserve(page + MVM_GUARD_SPAN, page);
+    if(!base)
+        return NULL;
+    return (uint32_t *)(base + page) - MVM_STACK_SIZE;
+}
+
+static void mvm_guard_unmap(uint32_t *stk) {
+    const size_t page = MVM_GUARD_PAGE;
+    if(stk)
+        munmap((uint8_t *)(stk + MVM_STACK_SIZE) - page, page + MVM_GUARD_SPAN);
+}
+
+// status for a fault at addr in the guard of stk, 0 if it is not there
+static int mvm_guard_status(const uint32_t *stk, uintptr_t addr,
+                            int overflow, int underflow) {
+    const uintptr_t offset = addr - (uintptr_t)stk;
+    if(offset < sizeof(uint32_t) * MVM_STACK_SIZE || offset >= MVM_GUARD_SPAN)
+        return 0;
+    return offset < MVM_GUARD_SPAN / 2 ? overflow : underflow;
+}
+
+// Instructions started from vm->count_pc until the one whose stack fault ended
+// the run, which has moved the pc past its opcode, or is the call ending the
+// block when it overflowed the return stack. Blocks lie in ram one instruction
+// after the other; one fetched past ram was run on its own.
+static uint32_t mvm_guard_started(const mvm *vm) {
+    uint32_t at = vm->count_pc, started = 1;
+    while(at < MVM_RAM_SIZE && vm->ram[at] < MVM_OPCODE_COUNT) {
+        const uint8_t op = vm->ram[at];
+        const uint32_t next = at + 1 + mvm_op_imm_size[op];
+        if(vm->status == MVM_RETURN_STACK_OVERFLOW ? op == OP_CALL
+                                                   : next >= vm->pc)
+            break;
+        at = next;
+        started++;
+    }
+    return started;
+}
+
+#endif
+
+#ifdef MVM_GUARD_RAM
+
+// Replays the load or store that faulted with the checked helpers. The
+// interpreter saved its state from before the access, the pc past the opcode.
+// A store then checks the watched range of until, if any.
+static void mvm_guard_mmio(mvm *vm, mvm_until *until) {
+    uint32_t *const tos = &vm->stk[vm->sp - 1];
+    const uint8_t op = vm->ram[vm->pc - 1];
+    uint32_t value = 0;
+    switch(op) {
+    case OP_LB:
+        value = (uint32_t)mvm_load_i8(vm, *tos);
+        break;
+    case OP_LH:
+        value = (uint32_t)mvm_load_i16(vm, *tos);
+        break;
+    case OP_LW:
+        value = mvm_load_u32(vm, *tos);
+        break;
+    case OP_LBU:
+        value = mvm_load_u8(vm, *tos);
+        break;
+    case OP_LHU:
+        value = mvm_load_u16(vm, *tos);
+        break;
+    default:
+        // a store pops the address, then the value
+        vm->sp -= 2;
+        if(op == OP_SB)
+            mvm_store_8(vm, tos[0], tos[-1]);
+        else if(op == OP_SH)
+            mvm_store_16(vm, tos[0], tos[-1]);
+        else
+            mvm_store_32(vm, tos[0], tos[-1]);
+        if(until && vm->status == MVM_RUNNING &&
+           mvm_until_stores(until, tos[0], 1 << (op - OP_SB)))
+            until->hit = MVM_UNTIL_STORE;
+        return;
+    }
+    if(vm->status != MVM_RUNNING)
+        vm->sp--;
+    else
+        *tos = value;
+}
+
+#endif
+
+static void mvm_guard_handler(int sig, siginfo_t *info, void *context) {
+    mvm_guard_frame *frame = mvm_guard_current;
+    if(frame) {
+        const uintptr_t addr = (uintptr_t)info->si_addr;
+        int status = 0;
+#ifdef MVM_GUARD_STACKS
+        status = mvm_guard_status(frame->vm->stk, addr, MVM_STACK_OVERFLOW,
+                                  MVM_STACK_UNDERFLOW);
+        if(!status)
+            status = mvm_guard_status(frame->vm->rstk, addr,
+                                      MVM_RETURN_STACK_OVERFLOW,
+                                      MVM_RETURN_STACK_UNDERFLOW);
+#endif
+#ifdef MVM_GUARD_RAM
+        const uintptr_t offset = addr - (uintptr_t)frame->vm->ram;
+        if(offset >= MVM_RAM_SIZE && offset < MVM_GUARD_RAM_SPAN)
+            status = MVM_GUARD_MMIO;
+#endif
+        if(status) {
+            frame->status = status;
+            siglongjmp(frame->env, 1);
+        }
+    }
+    // not a guard fault: hand it over to the previous handler, or restore the
+    // default action, which the faulting access triggers again on return
+    if(mvm_guard_chained.sa_flags & SA_SIGINFO)
+        mvm_guard_chained.sa_sigaction(sig, info, context);
+    else if(mvm_guard_chained.sa_handler != SIG_DFL &&
+            mvm_guard_chained.sa_handler != SIG_IGN)
+        mvm_guard_chained.sa_handler(sig);
+    else
+        sigaction(SIGSEGV, &mvm_guard_chained, NULL);
+}
+
+// installs the handler on first use
+static int mvm_guard_install(void) {
+    if(!mvm_guard_installed) {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = mvm_guard_handler;
+        // SIGSEGV must not stay blocked once the handler jumps out
+        action.sa_flags = SA_SIGINFO | SA_NODEFER;
+        sigemptyset(&action.sa_mask);
+        if(sigaction(SIGSEGV, &action, &mvm_guard_chained))
+            return 0;
+        mvm_guard_installed = 1;
+    }
+    return 1;
+}
+
+int mvm_guard_init(mvm *vm) {
+    if(!mvm_guard_install())
+        return 0;
+#ifdef MVM_GUARD_RAM
+    uint8_t *ram = NULL;
+    // the first address past ram must start a page to fault
+    if(MVM_RAM_SIZE % MVM_GUARD_PAGE == 0)
+        ram = mvm_guard_reserve(MVM_GUARD_RAM_SPAN, MVM_RAM_SIZE);
+    if(!ram)
+        return 0;
+#endif
+#ifdef MVM_GUARD_STACKS
+    vm->stk = mvm_guard_map();
+    vm->rstk = mvm_guard_map();
+    if(!vm->stk || !vm->rstk) {
+        mvm_guard_unmap(vm->stk);
+        mvm_guard_unmap(vm->rstk);
+#ifdef MVM_GUARD_RAM
+        munmap(ram, MVM_GUARD_RAM_SPAN);
+#endif
+        return 0;
+    }
+#endif
+#ifdef MVM_GUARD_RAM
+    memcpy(ram, vm->ram, MVM_RAM_SIZE);
+    vm->ram = ram;
+#endif
+    return 1;
+}
+
+void mvm_guard_free(mvm *vm) {
+#ifdef MVM_GUARD_STACKS
+    mvm_guard_unmap(vm->stk);
+    mvm_guard_unmap(vm->rstk);
+    vm->stk = NULL;
+    vm->rstk = NULL;
+#endif
+#ifdef MVM_GUARD_RAM
+    munmap(vm->ram, MVM_GUARD_RAM_SPAN);
+    vm->ram = NULL;
+#endif
+}
+
+// A stack fault leaves the vm as the checks of the interpreter would: the
+// faulting instruction has only moved the pc past itself, or, for a call
+// overflowing the return stack, popped its target and jumped to it. An access
+// past ram resumes the run with the limit the interpreter had left.
+uint32_t mvm_guard_run_until(mvm *vm, uint32_t limit, mvm_until *until) {
+    mvm_guard_frame frame;
+    // volatile since it changes between sigsetjmp and the jumps back
+    volatile uint32_t left = limit;
+    frame.vm = vm;
+    frame.prev = mvm_guard_current;
+    mvm_guard_current = &frame;
+    for(;;) {
+        if(!sigsetjmp(frame.env, 0)) {
+            left -= mvm_run_until(vm, left, until);
+            break;
+        }
+#ifdef MVM_GUARD_RAM
+        if(frame.status == MVM_GUARD_MMIO) {
+            mvm_guard_mmio(vm, until);
+            left = vm->resume_limit;
+            if(vm->status != MVM_RUNNING || !left)
+                break;
+            // resuming would not stop on a breakpoint it starts from
+            if(until && !until->hit && mvm_until_breaks(until, vm->pc))
+                until->hit = MVM_UNTIL_BREAKPOINT;
+            if(until && until->hit)
+                break;
+            continue;
+        }
+#endif
+        vm->status = (enum mvm_status)frame.status;
+        // the interpreter keeps sp in a register, but both stack faults
+        // imply its value
+        if(vm->status == MVM_STACK_UNDERFLOW)
+            vm->sp = 0;
+        else if(vm->status == MVM_STACK_OVERFLOW)
+            vm->sp = MVM_STACK_SIZE;
+#ifdef MVM_GUARD_STACKS
+        left = vm->count_left - mvm_guard_started(vm);
+#endif
+        break;
+    }
+    mvm_guard_current = frame.prev;
+    return limit - left;
+}
+
+uint32_t mvm_guard_run(mvm *vm, uint32_t limit) {
+    return mvm_guard_run_until(vm, limit, NULL);
+}
+
+#else
+
+int mvm_guard_init(mvm *vm) {
+    return 1;
+}
+
+void mvm_guard_free(mvm *vm) {}
+
+uint32_t mvm_guard_run(mvm *vm, uint32_t limit) {
+    return mvm_run(vm, limit);
+}
+
+uint32_t mvm_guard_run_until(mvm *vm, uint32_t limit, mvm_until *until) {
+    return mvm_run_until(vm, limit, until);
+}
+
+#endif
+
+#endif
+
+#endif
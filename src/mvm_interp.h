@@ -0,0 +1,784 @@
+// Interpreter loop template, included by mvm.h once per interpreter variant.
+// Define MVM_INTERP_NAME to the name of the function to generate, and
+// MVM_INTERP_CACHED to run from the pre-decoded instruction cache
+// (vm->icache) instead of decoding raw bytes on every step. MVM_INTERP_TAIL
+// then makes the handlers functions calling each other, see below, and
+// MVM_INTERP_VERIFIED chains the blocks proved by mvm_verify. MVM_INTERP_UNTIL
+// checks the conditions of mvm_run_until, and MVM_INTERP_BREAKPOINTS its
+// breakpoints too.
+
+// The tail-call interpreter has pc in an argument, the others in vm->pc.
+#ifdef MVM_INTERP_TAIL
+#define MVM_PC pc
+#define MVM_SAVE_PC() vm->pc = pc
+#define MVM_RESTORE_PC() pc = vm->pc
+#else
+#define MVM_PC vm->pc
+#define MVM_SAVE_PC()
+#define MVM_RESTORE_PC()
+#endif
+
+#if defined(MVM_TOS_CACHE) || defined(MVM_INTERP_TAIL)
+
+// The stack pointer and the top of the stack live in locals; vm->sp and
+// vm->stk[vm->sp - 1] are written back whenever the loop returns or calls
+// syscall. Slots are indexed modulo the stack size so that an empty stack
+// needs no branch: the slot written or read then is above sp and unused.
+#define MVM_SP sp
+#define MVM_STK vm->stk
+#define MVM_TOS tos
+#define MVM_SLOT(i) vm->stk[(i) % MVM_STACK_SIZE]
+#define MVM_SAVE()                                                             \
+    do {                                                                       \
+        MVM_SLOT(sp - 1) = tos;                                                \
+        vm->sp = sp;                                                           \
+        MVM_SAVE_PC();                                                         \
+    } while(0)
+#define MVM_RESTORE()                                                          \
+    do {                                                                       \
+        sp = vm->sp;                                                           \
+        tos = MVM_SLOT(sp - 1);                                                \
+        MVM_RESTORE_PC();                                                      \
+    } while(0)
+#define MVM_DROP(n)                                                            \
+    do {                                                                       \
+        sp -= (n);                                                             \
+        tos = MVM_SLOT(sp - 1);                                                \
+    } while(0)
+#define MVM_PUSH(x)                                                            \
+    do {                                                                       \
+        MVM_SLOT(sp - 1) = tos;                                                \
+        tos = (x);                                                             \
+        sp++;                                                                  \
+    } while(0)
+
+#elif defined(MVM_GUARD_STACKS)
+
+// Nothing compares the stack pointer to the bounds, so it lives in a local
+// along with the base of the stack. After a stack fault mvm_guard_run knows
+// vm->sp from the kind of fault alone, except on the return stack, which
+// writes it back first.
+#define MVM_SP sp
+#define MVM_STK stk
+#define MVM_TOS stk[sp - 1]
+#define MVM_SAVE() vm->sp = sp
+#define MVM_RESTORE() sp = vm->sp
+#define MVM_DROP(n) sp -= (n)
+#define MVM_PUSH(x)                                                            \
+    do {                                                                       \
+        stk[sp] = (x);                                                         \
+        sp++;                                                                  \
+    } while(0)
+
+#else
+
+#define MVM_SP vm->sp
+#define MVM_STK vm->stk
+#define MVM_TOS vm->stk[vm->sp - 1]
+#define MVM_SAVE()
+#define MVM_RESTORE()
+#define MVM_DROP(n) vm->sp -= (n)
+#define MVM_PUSH(x)                                                            \
+    do {                                                                       \
+        vm->stk[vm->sp] = (x);                                                 \
+        vm->sp++;                                                              \
+    } while(0)
+
+#endif
+
+// second element of the stack, always in memory
+#define MVM_NOS MVM_STK[MVM_SP - 2]
+
+// The instructions of the limit not yet started. The loop returns how many it
+// started, counting one that faults, halts or waits; the tail-call handlers
+// return what is left of their chunk instead.
+#define MVM_LEFT limit
+#ifdef MVM_INTERP_TAIL
+#define MVM_RETURN return MVM_LEFT
+#else
+#define MVM_RETURN return start - MVM_LEFT
+#endif
+
+#define MVM_LEAVE()                                                            \
+    do {                                                                       \
+        MVM_SAVE();                                                            \
+        MVM_RETURN;                                                            \
+    } while(0)
+
+#define MVM_LEAVE_ON_FAULT()                                                   \
+    if(vm->status != MVM_RUNNING)                                              \
+    MVM_LEAVE()
+
+// Stop requests are checked by the instructions that may run code again:
+// branches going back from their pc, calls and syscalls.
+#define MVM_PREEMPT()                                                          \
+    if(MVM_ATOMIC_LOAD(vm->stop))                                              \
+    MVM_LEAVE()
+#define MVM_PREEMPT_BACKWARD(from)                                             \
+    if(MVM_PC < (from))                                                        \
+    MVM_PREEMPT()
+
+// After a block entered at a depth that mvm_verify proved for it, chain is set
+// if the block leaves through edges that the proof followed, to enter the
+// next block without comparing the depth when it is proved too. Taking an
+// interrupt, or decoding code overwritten by the block, breaks the chain.
+#ifdef MVM_INTERP_VERIFIED
+#define MVM_UNCHAIN() chain = 0
+#else
+#define MVM_UNCHAIN()
+#endif
+
+// Interrupts are only checked by the instructions ending blocks, once they
+// have set the pc.
+#define MVM_INTERRUPTS()                                                       \
+    if(vm->ready) {                                                            \
+        MVM_UNCHAIN();                                                         \
+        MVM_SAVE();                                                            \
+        mvm_interrupt_take(vm);                                                \
+        MVM_RESTORE();                                                         \
+        MVM_LEAVE_ON_FAULT();                                                  \
+    }
+
+// The conditions of mvm_run_until, in vm->until, end the run once the
+// instruction meeting them is done, or before the one at a breakpoint, so a
+// run never stops on the breakpoint it starts from.
+#ifdef MVM_INTERP_UNTIL
+#define MVM_UNTIL(cond, why)                                                   \
+    if(cond) {                                                                 \
+        until->hit = (why);                                                    \
+        MVM_LEAVE();                                                           \
+    }
+#define MVM_UNTIL_RETURNED() MVM_UNTIL(vm->rsp < until->depth, MVM_UNTIL_RETURN)
+#define MVM_UNTIL_STORED(addr, size)                                           \
+    MVM_UNTIL(mvm_until_stores(until, addr, size), MVM_UNTIL_STORE)
+#else
+#define MVM_UNTIL_RETURNED()
+#define MVM_UNTIL_STORED(addr, size)
+#endif
+#ifdef MVM_INTERP_BREAKPOINTS
+#define MVM_BREAKPOINT()                                                       \
+    MVM_UNTIL(mvm_until_breaks(until, MVM_PC) && MVM_LEFT != start,            \
+              MVM_UNTIL_BREAKPOINT)
+#else
+#define MVM_BREAKPOINT()
+#endif
+
+#if defined(MVM_INTERP_TAIL) &&                                                \
+    (defined(MVM_GUARD_STACKS) || defined(MVM_GUARD_RAM))
+#error "MVM_TAIL_CALLS can't be used with MVM_GUARD_STACKS or MVM_GUARD_RAM"
+#endif
+
+#ifdef MVM_GUARD_STACKS
+
+#ifdef MVM_TOS_CACHE
+#error "MVM_GUARD_STACKS needs the stacks in memory, without MVM_TOS_CACHE"
+#endif
+
+// Stack faults trap in mvm_guard_run: reading the deepest operand faults when
+// it is missing, and pushes fault on their own by writing past the stack,
+// both before the instruction changes anything but the pc. Stores keep their
+// compare, since one missing its value still writes 0. Blocks then need no
+// stack checks to enter the fast path, which keeps these probes.
+#define MVM_UNDERFLOW(n) (void)*(volatile uint32_t *)&stk[sp - (n)]
+#define MVM_OVERFLOW()
+#define MVM_RPUSH(x)                                                           \
+    do {                                                                       \
+        MVM_SAVE();                                                            \
+        vm->rstk[vm->rsp] = (x);                                               \
+        vm->rsp++;                                                             \
+    } while(0)
+#define MVM_RPOP(x)                                                            \
+    do {                                                                       \
+        MVM_SAVE();                                                            \
+        x = vm->rstk[vm->rsp - 1];                                             \
+        vm->rsp--;                                                             \
+    } while(0)
+
+// A stack fault leaves the loop without returning its count, so each step
+// taking from the limit writes where it stands, for mvm_guard_run to count on
+// from there. Blocks on the fast path are marked once, by the step entering.
+#define MVM_MARK()                                                             \
+    do {                                                                       \
+        vm->count_pc = MVM_PC;                                                 \
+        vm->count_left = limit;                                                \
+    } while(0)
+
+#else
+
+// Each instruction checks the stack once for all of its operands. Like
+// popping them one at a time would, a failed check empties the stack.
+#define MVM_UNDERFLOW(n)                                                       \
+    if(MVM_SP < (n)) {                                                         \
+        vm->status = MVM_STACK_UNDERFLOW;                                      \
+        MVM_SP = 0;                                                            \
+        MVM_LEAVE();                                                           \
+    }
+
+#define MVM_OVERFLOW()                                                         \
+    if(MVM_SP >= MVM_STACK_SIZE) {                                             \
+        vm->status = MVM_STACK_OVERFLOW;                                       \
+        MVM_LEAVE();                                                           \
+    }
+
+#define MVM_RPUSH(x) mvm_rpush(vm, x)
+#define MVM_RPOP(x) x = mvm_rpop(vm)
+#define MVM_MARK()
+
+#endif
+
+#define MVM_BINOP_UNSIGNED(binop, block)                                       \
+    do {                                                                       \
+        MVM_UNDERFLOW(2);                                                      \
+        ub = MVM_TOS;                                                          \
+        ua = MVM_NOS;                                                          \
+        block MVM_DROP(1);                                                     \
+        MVM_TOS = ua binop ub;                                                 \
+    } while(0)
+
+#define MVM_BINOP_SIGNED(binop, block)                                         \
+    do {                                                                       \
+        MVM_UNDERFLOW(2);                                                      \
+        ib = MVM_BITCAST(int32_t, MVM_TOS);                                    \
+        ia = MVM_BITCAST(int32_t, MVM_NOS);                                    \
+        block ia = ia binop ib;                                                \
+        MVM_DROP(1);                                                           \
+        MVM_TOS = MVM_BITCAST(uint32_t, ia);                                   \
+    } while(0)
+
+// the operands are consumed even though the division faults
+#define MVM_DIVISION_CHECK(x)                                                  \
+    {                                                                          \
+        if(x == 0) {                                                           \
+            MVM_DROP(2);                                                       \
+            vm->status = MVM_DIVISION_BY_ZERO;                                 \
+            MVM_LEAVE();                                                       \
+        }                                                                      \
+    }
+
+// INT32_MIN / -1 overflows, which traps on most hosts: it wraps around to
+// INT32_MIN instead, with a remainder of 0, as dividing by 1 gives
+#define MVM_SIGNED_DIVISION_CHECK()                                            \
+    {                                                                          \
+        MVM_DIVISION_CHECK(ib);                                                \
+        if(ib == -1 && ia == INT32_MIN)                                        \
+            ib = 1;                                                            \
+    }
+
+#ifdef MVM_GUARD_RAM
+
+// Loads and stores touch vm->ram without comparing the address. One outside of
+// ram faults into mvm_guard_run, which replays the instruction through the
+// mmio callbacks from the state saved here, then resumes with the limit left.
+// The barrier keeps the compiler from moving the state past the access, which
+// as a narrower type may not alias it.
+#define MVM_RESUME_POINT()                                                     \
+    do {                                                                       \
+        MVM_SAVE();                                                            \
+        vm->resume_limit = MVM_LEFT;                                           \
+        __asm__ __volatile__("" ::: "memory");                                 \
+    } while(0)
+
+#define MVM_LOAD(x, load)                                                      \
+    do {                                                                       \
+        MVM_UNDERFLOW(1);                                                      \
+        MVM_RESUME_POINT();                                                    \
+        x = load##_guarded(vm, MVM_TOS);                                       \
+        MVM_TOS = MVM_BITCAST(uint32_t, x);                                    \
+    } while(0)
+
+// the operands are dropped after the store, so that it can be replayed
+#define MVM_STORE(store, size)                                                 \
+    do {                                                                       \
+        MVM_STORE_UNDERFLOW(store);                                            \
+        ua = MVM_TOS;                                                          \
+        ub = MVM_NOS;                                                          \
+        MVM_RESUME_POINT();                                                    \
+        store##_guarded(vm, ua, ub);                                           \
+        MVM_DROP(2);                                                           \
+        MVM_UNTIL_STORED(ua, size);                                            \
+    } while(0)
+
+#else
+
+// replaces the address on top of the stack by the value loaded from it
+#define MVM_LOAD(x, load)                                                      \
+    do {                                                                       \
+        MVM_UNDERFLOW(1);                                                      \
+        x = load(vm, MVM_TOS);                                                 \
+        if(vm->status != MVM_RUNNING) {                                        \
+            MVM_DROP(1);                                                       \
+            MVM_LEAVE();                                                       \
+        }                                                                      \
+        MVM_TOS = MVM_BITCAST(uint32_t, x);                                    \
+    } while(0)
+
+// Pops the address, then the value, of size bytes.
+#define MVM_STORE(store, size)                                                 \
+    do {                                                                       \
+        MVM_STORE_UNDERFLOW(store);                                            \
+        ua = MVM_TOS;                                                          \
+        ub = MVM_NOS;                                                          \
+        MVM_DROP(2);                                                           \
+        store(vm, ua, ub);                                                     \
+        MVM_LEAVE_ON_FAULT();                                                  \
+        MVM_UNTIL_STORED(ua, size);                                            \
+    } while(0)
+
+#endif
+
+// As with mvm_pop, a missing value reads as 0 and is still stored.
+#define MVM_STORE_UNDERFLOW(store)                                             \
+    if(MVM_SP < 2) {                                                           \
+        MVM_UNDERFLOW(1);                                                      \
+        ua = MVM_TOS;                                                          \
+        MVM_DROP(1);                                                           \
+        vm->status = MVM_STACK_UNDERFLOW;                                      \
+        store(vm, ua, 0);                                                      \
+        MVM_LEAVE();                                                           \
+    }
+
+// Every handler counts its opcode on entry, so that instructions are counted
+// once whichever path runs them. Superinstructions count the ones they stand
+// for, once they know not to fall back to the first alone.
+#ifdef MVM_STATS
+#define MVM_COUNT(op) mvm_stats_op(vm, op)
+#define MVM_COUNT_SYSCALL() mvm_stats_syscall(vm)
+#else
+#define MVM_COUNT(op)
+#define MVM_COUNT_SYSCALL()
+#endif
+
+#ifdef MVM_INTERP_CACHED
+
+#ifdef MVM_INTERP_TAIL
+#define MVM_SCRATCH (&vm->icache->scratch)
+#else
+#define MVM_SCRATCH (&scratch)
+#endif
+
+// like the raw interpreter, the pc points just after the opcode once fetched
+#define MVM_FETCH()                                                            \
+    if(MVM_PC < MVM_RAM_SIZE) {                                                \
+        insn = &code[MVM_PC];                                                  \
+        op = insn->op;                                                         \
+    } else {                                                                   \
+        insn = MVM_SCRATCH;                                                    \
+        op = MVM_INSN_DECODE;                                                  \
+    }                                                                          \
+    MVM_PC++
+
+#define MVM_IMM(x, bits)                                                       \
+    x = insn->imm;                                                             \
+    MVM_PC += sizeof(uint##bits##_t)
+
+// decodes the instruction fetched as MVM_INSN_DECODE, which may fault
+#define MVM_DECODE()                                                           \
+    MVM_UNCHAIN();                                                             \
+    MVM_PC--;                                                                  \
+    MVM_SAVE_PC();                                                             \
+    insn = mvm_icache_decode(vm, MVM_SCRATCH);                                 \
+    MVM_RESTORE_PC();                                                          \
+    MVM_LEAVE_ON_FAULT();                                                      \
+    op = insn->op;                                                             \
+    MVM_PC++
+
+// A superinstruction standing for n instructions runs only when the whole
+// sequence fits in the limit and cannot fault on the stacks; otherwise its
+// first instruction is executed alone, with the usual checks.
+#define MVM_FUSE(n, cond)                                                      \
+    if(MVM_BUDGET < (n)-1 || !(cond)) {                                        \
+        op = insn->base;                                                       \
+        MVM_DISPATCH();                                                        \
+    }                                                                          \
+    MVM_BUDGET -= (n)-1;                                                       \
+    vm->icache->super_hits[op - MVM_SUPER_FIRST]++
+
+#define MVM_BUDGET limit
+
+#else
+
+#define MVM_FETCH()                                                            \
+    op = mvm_load_u8(vm, vm->pc++);                                            \
+    MVM_LEAVE_ON_FAULT()
+
+#define MVM_IMM(x, bits)                                                       \
+    x = mvm_load_u##bits(vm, vm->pc);                                          \
+    MVM_LEAVE_ON_FAULT();                                                      \
+    vm->pc += sizeof(uint##bits##_t)
+
+#endif
+
+#if defined(MVM_COMPUTED_GOTO) && defined(MVM_INTERP_CACHED) &&                \
+    !defined(MVM_INTERP_TAIL)
+
+// Blocks whose stack effect fits the current depth, and which end within the
+// limit, run on the fast path: the handlers without stack checks, dispatched
+// through fast_table. There `block` counts the instructions left in the block,
+// which were already taken from the limit. When the loop keeps the stack
+// pointer in memory, the fast path still moves it to a local, loaded on entry
+// and written back when the block ends.
+#define MVM_FAST_PATH
+#if defined(MVM_TOS_CACHE) || defined(MVM_GUARD_STACKS)
+#define MVM_FAST_LOAD()
+#define MVM_FAST_STORE()
+#else
+#define MVM_FAST_LOAD() sp = vm->sp
+#define MVM_FAST_STORE() vm->sp = sp
+#endif
+#ifdef MVM_GUARD_STACKS
+#define MVM_FITS() 1
+#else
+#define MVM_FITS()                                                             \
+    (MVM_SP >= insn->need && MVM_SP + insn->growth <= MVM_STACK_SIZE)
+#endif
+#ifdef MVM_INTERP_VERIFIED
+#define MVM_PROVEN() (MVM_SP >= insn->low && MVM_SP <= insn->high)
+#define MVM_ENTER()                                                            \
+    if((uint32_t)(insn->len - 1) <= limit &&                                   \
+       (insn->verified ? chain || MVM_PROVEN() : MVM_FITS())) {                \
+        chain = insn->verified & MVM_INSN_CHAINS;                              \
+        block = insn->len - 1;                                                 \
+        limit -= block;                                                        \
+        MVM_FAST_LOAD();                                                       \
+        goto *fast_table[op];                                                  \
+    }                                                                          \
+    chain = 0
+#else
+#define MVM_ENTER()                                                            \
+    if((uint32_t)(insn->len - 1) <= limit && MVM_FITS()) {                     \
+        block = insn->len - 1;                                                 \
+        limit -= block;                                                        \
+        MVM_FAST_LOAD();                                                       \
+        goto *fast_table[op];                                                  \
+    }
+#endif
+
+#else
+
+#define MVM_ENTER()
+
+#endif
+
+#ifdef MVM_INTERP_TAIL
+
+// Each handler is a function taking the state of the loop as arguments, which
+// ends by calling the next handler, through the record of the instruction, or
+// returning. Those calls are tail calls, guaranteed with musttail; otherwise
+// the compiler may keep the frames, so runs are cut in chunks of
+// MVM_TAIL_CHUNK instructions to bound the depth of the stack.
+#if defined(__has_attribute)
+#if __has_attribute(musttail)
+#define MVM_MUSTTAIL __attribute__((musttail))
+#endif
+#endif
+#ifdef MVM_MUSTTAIL
+#define MVM_TAIL_CHUNK UINT32_MAX
+#else
+#define MVM_MUSTTAIL
+#define MVM_TAIL_CHUNK 256
+#endif
+
+#define MVM_TAIL_CALL(handler)                                                 \
+    MVM_MUSTTAIL return (handler)(vm, insn, pc, sp, tos, limit)
+
+// MVM_CASE closes the function of the previous handler and opens the next,
+// whose label only ends it where the colon following MVM_CASE goes.
+#define MVM_HANDLER(name, value)                                               \
+    }                                                                          \
+    static uint32_t mvm_tail_##name(mvm *vm, mvm_insn *insn, uint32_t pc,      \
+                                    uint32_t sp, uint32_t tos,                 \
+                                    uint32_t limit) {                          \
+        __attribute__((unused)) uint32_t ua, ub;                               \
+        __attribute__((unused)) int32_t ia, ib;                                \
+        __attribute__((unused)) uint8_t op = (value);                          \
+        goto mvm_tail_##name##_start;                                          \
+    mvm_tail_##name##_start
+#define MVM_CASE(op) MVM_HANDLER(op, op)
+#define MVM_DEFAULT MVM_HANDLER(invalid, MVM_INSN_INVALID)
+#define MVM_DISPATCH() MVM_TAIL_CALL(mvm_tail_handler(op))
+#define MVM_NEXT()                                                             \
+    {                                                                          \
+        if(!limit)                                                             \
+            MVM_LEAVE();                                                       \
+        limit--;                                                               \
+        if(pc < MVM_RAM_SIZE) {                                                \
+            insn = &vm->icache->insn[pc++];                                    \
+            MVM_TAIL_CALL(insn->handler);                                      \
+        }                                                                      \
+        pc++;                                                                  \
+        MVM_TAIL_CALL(mvm_tail_MVM_INSN_DECODE);                               \
+    }
+
+#elif defined(MVM_COMPUTED_GOTO)
+
+#define MVM_CASE(op) mvm_label_##op
+#define MVM_DEFAULT mvm_label_invalid
+#ifdef MVM_INTERP_CACHED
+#define MVM_DISPATCH() goto *dispatch_table[op]
+#else
+#define MVM_DISPATCH()                                                         \
+    if(op >= MVM_OPCODE_COUNT)                                                 \
+        goto mvm_label_invalid;                                                \
+    goto *dispatch_table[op]
+#endif
+#define MVM_NEXT()                                                             \
+    {                                                                          \
+        if(!limit)                                                             \
+            MVM_LEAVE();                                                       \
+        MVM_BREAKPOINT();                                                      \
+        MVM_MARK();                                                            \
+        limit--;                                                               \
+        MVM_FETCH();                                                           \
+        MVM_ENTER();                                                           \
+        MVM_DISPATCH();                                                        \
+    }
+
+#else
+
+#define MVM_CASE(op) case op
+#define MVM_DEFAULT default
+#define MVM_DISPATCH() goto mvm_label_dispatch
+#define MVM_NEXT() break
+
+#endif
+
+#define MVM_DISPATCH_INSNS(label)                                              \
+    MVM_DISPATCH_OPCODES(label) &&label##_invalid, &&label##_MVM_INSN_DECODE,  \
+        &&label##_MVM_SUPER_PUSH_CALL, &&label##_MVM_SUPER_PUSH_CJMP,          \
+        &&label##_MVM_SUPER_PUSH_ADD, &&label##_MVM_SUPER_DUP_EQZ,             \
+        &&label##_MVM_SUPER_PUSH_LW,
+
+#ifdef MVM_INTERP_TAIL
+
+// the first handler closes it
+static uint32_t mvm_tail_start(mvm *vm, mvm_insn *insn, uint32_t pc,
+                               uint32_t sp, uint32_t tos, uint32_t limit) {
+    MVM_NEXT();
+#include "mvm_interp_ops.h"
+}
+
+static mvm_handler mvm_tail_handler(uint8_t op) {
+    static const mvm_handler table[] = {
+        MVM_HANDLER_OPCODES(mvm_tail) mvm_tail_invalid,
+        mvm_tail_MVM_INSN_DECODE,
+        mvm_tail_MVM_SUPER_PUSH_CALL,
+        mvm_tail_MVM_SUPER_PUSH_CJMP,
+        mvm_tail_MVM_SUPER_PUSH_ADD,
+        mvm_tail_MVM_SUPER_DUP_EQZ,
+        mvm_tail_MVM_SUPER_PUSH_LW,
+    };
+    return table[op];
+}
+
+// A chunk left unfinished while the vm runs was ended by a stop request.
+uint32_t MVM_INTERP_NAME(mvm *vm, uint32_t limit) {
+    uint32_t executed = 0;
+    while(vm->status == MVM_RUNNING && executed < limit) {
+        const uint32_t left = limit - executed;
+        const uint32_t chunk = left < MVM_TAIL_CHUNK ? left : MVM_TAIL_CHUNK;
+        const uint32_t unused = mvm_tail_start(
+            vm, NULL, vm->pc, vm->sp, MVM_SLOT(vm->sp - 1), chunk);
+        executed += chunk - unused;
+        if(unused && vm->status == MVM_RUNNING)
+            break;
+    }
+    return executed;
+}
+
+#else
+
+uint32_t MVM_INTERP_NAME(mvm *vm, uint32_t limit) {
+    const uint32_t start = limit;
+    uint32_t ua, ub;
+    int32_t ia, ib;
+    uint8_t op;
+#ifdef MVM_TOS_CACHE
+    uint32_t sp, tos;
+    MVM_RESTORE();
+#elif defined(MVM_GUARD_STACKS)
+    uint32_t sp, *const stk = vm->stk;
+    MVM_RESTORE();
+#endif
+#ifdef MVM_INTERP_UNTIL
+    mvm_until *const until = vm->until;
+#endif
+#ifdef MVM_INTERP_CACHED
+    mvm_insn *const code = vm->icache->insn;
+    mvm_insn scratch, *insn = &scratch;
+    scratch.len = 0;
+#endif
+#ifdef MVM_COMPUTED_GOTO
+#ifdef MVM_INTERP_CACHED
+    static const void *const dispatch_table[] = {MVM_DISPATCH_INSNS(mvm_label)};
+#else
+    static const void *const dispatch_table[] = {
+        MVM_DISPATCH_OPCODES(mvm_label)};
+#endif
+#ifdef MVM_FAST_PATH
+    static const void *const fast_table[] = {MVM_DISPATCH_INSNS(mvm_fast)};
+    uint32_t block = 0;
+#ifdef MVM_INTERP_VERIFIED
+    uint8_t chain = 0;
+#endif
+#if !defined(MVM_TOS_CACHE) && !defined(MVM_GUARD_STACKS)
+    uint32_t sp = 0;
+#endif
+#endif
+    MVM_LEAVE_ON_FAULT();
+#ifdef MVM_FAST_PATH
+mvm_label_next:
+#endif
+    MVM_NEXT();
+#include "mvm_interp_ops.h"
+#ifdef MVM_FAST_PATH
+#ifndef MVM_GUARD_STACKS
+#undef MVM_UNDERFLOW
+#undef MVM_OVERFLOW
+#undef MVM_STORE_UNDERFLOW
+#define MVM_UNDERFLOW(n)
+#define MVM_OVERFLOW()
+#define MVM_STORE_UNDERFLOW(store)
+#endif
+#undef MVM_BUDGET
+#undef MVM_ENTER
+#undef MVM_CASE
+#undef MVM_DEFAULT
+#undef MVM_DISPATCH
+#undef MVM_NEXT
+#if !defined(MVM_TOS_CACHE) && !defined(MVM_GUARD_STACKS)
+#undef MVM_SP
+#undef MVM_TOS
+#undef MVM_SAVE
+#undef MVM_RESTORE
+#undef MVM_DROP
+#undef MVM_PUSH
+#define MVM_SP sp
+#define MVM_TOS vm->stk[sp - 1]
+#define MVM_SAVE() vm->sp = sp
+#define MVM_RESTORE() sp = vm->sp
+#define MVM_DROP(n) sp -= (n)
+#define MVM_PUSH(x)                                                            \
+    do {                                                                       \
+        vm->stk[sp] = (x);                                                     \
+        sp++;                                                                  \
+    } while(0)
+#endif
+#define MVM_BUDGET block
+#undef MVM_LEFT
+#define MVM_LEFT (limit + block)
+#define MVM_ENTER()
+#define MVM_CASE(op) mvm_fast_##op
+#define MVM_DEFAULT mvm_fast_invalid
+#define MVM_DISPATCH() goto *fast_table[op]
+// the rest of the block starts in the same page, so it is in ram
+#define MVM_NEXT()                                                             \
+    {                                                                          \
+        if(!block--) {                                                         \
+            MVM_FAST_STORE();                                                  \
+            goto mvm_label_next;                                               \
+        }                                                                      \
+        insn = &code[vm->pc++];                                                \
+        op = insn->op;                                                         \
+        MVM_DISPATCH();                                                        \
+    }
+// A store in the block overwrote code of its page, dropping the records of
+// the rest of the block, whose stack effect is no longer known: the block ends
+// there, giving back the instructions it has not run, and the checked path
+// decodes them again. Nor does the proof of mvm_verify hold for them.
+#undef MVM_DECODE
+#define MVM_DECODE()                                                           \
+    {                                                                          \
+        MVM_UNCHAIN();                                                         \
+        MVM_PC--;                                                              \
+        limit += block + 1;                                                    \
+        block = 0;                                                             \
+        MVM_FAST_STORE();                                                      \
+        goto mvm_label_next;                                                   \
+    }
+#include "mvm_interp_ops.h"
+#endif
+#else
+    while(limit && vm->status == MVM_RUNNING) {
+        MVM_BREAKPOINT();
+        MVM_MARK();
+        limit--;
+        MVM_FETCH();
+#ifdef MVM_INTERP_CACHED
+    mvm_label_dispatch:
+#endif
+        switch(op) {
+#include "mvm_interp_ops.h"
+        }
+    }
+    MVM_LEAVE();
+#endif
+}
+
+#endif
+
+#undef MVM_PC
+#undef MVM_SAVE_PC
+#undef MVM_RESTORE_PC
+#undef MVM_SP
+#undef MVM_STK
+#undef MVM_TOS
+#undef MVM_SLOT
+#undef MVM_SAVE
+#undef MVM_RESTORE
+#undef MVM_DROP
+#undef MVM_PUSH
+#undef MVM_NOS
+#undef MVM_RETURN
+#undef MVM_LEAVE
+#undef MVM_LEAVE_ON_FAULT
+#undef MVM_PREEMPT
+#undef MVM_PREEMPT_BACKWARD
+#undef MVM_UNCHAIN
+#undef MVM_INTERRUPTS
+#undef MVM_UNTIL
+#undef MVM_UNTIL_RETURNED
+#undef MVM_UNTIL_STORED
+#undef MVM_BREAKPOINT
+#undef MVM_UNDERFLOW
+#undef MVM_OVERFLOW
+#undef MVM_RPUSH
+#undef MVM_RPOP
+#undef MVM_MARK
+#undef MVM_BINOP_UNSIGNED
+#undef MVM_BINOP_SIGNED
+#undef MVM_DIVISION_CHECK
+#undef MVM_SIGNED_DIVISION_CHECK
+#undef MVM_LEFT
+#undef MVM_RESUME_POINT
+#undef MVM_LOAD
+#undef MVM_STORE
+#undef MVM_STORE_UNDERFLOW
+#undef MVM_COUNT
+#undef MVM_COUNT_SYSCALL
+#undef MVM_SCRATCH
+#undef MVM_FETCH
+#undef MVM_IMM
+#undef MVM_DECODE
+#undef MVM_FUSE
+#undef MVM_BUDGET
+#undef MVM_FAST_PATH
+#undef MVM_FAST_LOAD
+#undef MVM_FAST_STORE
+#undef MVM_FITS
+#undef MVM_PROVEN
+#undef MVM_ENTER
+#undef MVM_CASE
+#undef MVM_DEFAULT
+#undef MVM_DISPATCH
+#undef MVM_NEXT
+#undef MVM_DISPATCH_INSNS
+#undef MVM_MUSTTAIL
+#undef MVM_TAIL_CHUNK
+#undef MVM_TAIL_CALL
+#undef MVM_HANDLER
+#undef MVM_INTERP_NAME
+#undef MVM_INTERP_CACHED
+#undef MVM_INTERP_TAIL
+#undef MVM_INTERP_VERIFIED
+#undef MVM_INTERP_UNTIL
+#undef MVM_INTERP_BREAKPOINTS
@@ -0,0 +1,267 @@
+// Instruction handlers of the interpreter loop, included by mvm_interp.h. The
+// cached interpreter includes them a second time with the stack checks
+// compiled out, for blocks whose stack effect was checked on entry. Every
+// handler that may fault leaves the loop itself. The tail-call interpreter
+// makes a function of each handler instead.
+
+#ifdef MVM_INTERP_CACHED
+MVM_CASE(MVM_INSN_DECODE):
+    MVM_DECODE();
+    MVM_ENTER();
+    MVM_DISPATCH();
+MVM_CASE(MVM_SUPER_PUSH_CALL):
+    MVM_FUSE(2, MVM_SP < MVM_STACK_SIZE && vm->rsp < MVM_STACK_SIZE);
+    MVM_COUNT(insn->base);
+    MVM_COUNT(OP_CALL);
+    vm->rstk[vm->rsp++] = insn->next;
+    MVM_PC = insn->imm;
+    MVM_PREEMPT();
+    MVM_INTERRUPTS();
+    MVM_NEXT();
+MVM_CASE(MVM_SUPER_PUSH_CJMP):
+    MVM_FUSE(2, MVM_SP > 0 && MVM_SP < MVM_STACK_SIZE);
+    MVM_COUNT(insn->base);
+    MVM_COUNT(OP_CJMP);
+    ua = MVM_PC;
+    MVM_PC = MVM_TOS ? insn->imm : insn->next;
+    MVM_DROP(1);
+    MVM_PREEMPT_BACKWARD(ua);
+    MVM_INTERRUPTS();
+    MVM_NEXT();
+MVM_CASE(MVM_SUPER_PUSH_ADD):
+    MVM_FUSE(2, MVM_SP > 0 && MVM_SP < MVM_STACK_SIZE);
+    MVM_COUNT(insn->base);
+    MVM_COUNT(OP_ADD);
+    MVM_TOS += insn->imm;
+    MVM_PC = insn->next;
+    MVM_NEXT();
+MVM_CASE(MVM_SUPER_DUP_EQZ):
+    MVM_FUSE(3, MVM_SP > 0 && MVM_SP < MVM_STACK_SIZE - 1);
+    MVM_COUNT(OP_DUP);
+    MVM_COUNT(OP_PUSH_U8);
+    MVM_COUNT(OP_EQ);
+    MVM_PUSH(MVM_TOS == 0);
+    MVM_PC = insn->next;
+    MVM_NEXT();
+MVM_CASE(MVM_SUPER_PUSH_LW):
+    MVM_FUSE(2, MVM_SP < MVM_STACK_SIZE);
+    MVM_COUNT(insn->base);
+    MVM_COUNT(OP_LW);
+    MVM_PC = insn->next;
+    ua = mvm_load_u32(vm, insn->imm);
+    MVM_LEAVE_ON_FAULT();
+    MVM_PUSH(ua);
+    MVM_NEXT();
+#endif
+MVM_CASE(OP_BRK):
+    MVM_COUNT(OP_BRK);
+    vm->status = MVM_HALTED;
+    MVM_LEAVE();
+MVM_CASE(OP_PUSH_U8):
+    MVM_COUNT(OP_PUSH_U8);
+    MVM_IMM(ua, 8);
+    MVM_OVERFLOW();
+    MVM_PUSH(ua);
+    MVM_NEXT();
+MVM_CASE(OP_PUSH_U16):
+    MVM_COUNT(OP_PUSH_U16);
+    MVM_IMM(ua, 16);
+    MVM_OVERFLOW();
+    MVM_PUSH(ua);
+    MVM_NEXT();
+MVM_CASE(OP_PUSH32):
+    MVM_COUNT(OP_PUSH32);
+    MVM_IMM(ua, 32);
+    MVM_OVERFLOW();
+    MVM_PUSH(ua);
+    MVM_NEXT();
+MVM_CASE(OP_DUP):
+    MVM_COUNT(OP_DUP);
+    MVM_UNDERFLOW(1);
+    MVM_OVERFLOW();
+    MVM_PUSH(MVM_TOS);
+    MVM_NEXT();
+MVM_CASE(OP_OVR):
+    MVM_COUNT(OP_OVR);
+    MVM_UNDERFLOW(2);
+    MVM_OVERFLOW();
+    MVM_PUSH(MVM_NOS);
+    MVM_NEXT();
+MVM_CASE(OP_POP):
+    MVM_COUNT(OP_POP);
+    MVM_UNDERFLOW(1);
+    MVM_DROP(1);
+    MVM_NEXT();
+MVM_CASE(OP_ADD):
+    MVM_COUNT(OP_ADD);
+    MVM_BINOP_UNSIGNED(+, {});
+    MVM_NEXT();
+MVM_CASE(OP_SUB):
+    MVM_COUNT(OP_SUB);
+    MVM_BINOP_UNSIGNED(-, {});
+    MVM_NEXT();
+MVM_CASE(OP_MUL):
+    MVM_COUNT(OP_MUL);
+    MVM_BINOP_UNSIGNED(*, {});
+    MVM_NEXT();
+MVM_CASE(OP_DIV):
+    MVM_COUNT(OP_DIV);
+    MVM_BINOP_SIGNED(/, MVM_SIGNED_DIVISION_CHECK());
+    MVM_NEXT();
+MVM_CASE(OP_DIVU):
+    MVM_COUNT(OP_DIVU);
+    MVM_BINOP_UNSIGNED(/, MVM_DIVISION_CHECK(ub));
+    MVM_NEXT();
+MVM_CASE(OP_REM):
+    MVM_COUNT(OP_REM);
+    MVM_BINOP_SIGNED(%, MVM_SIGNED_DIVISION_CHECK());
+    MVM_NEXT();
+MVM_CASE(OP_REMU):
+    MVM_COUNT(OP_REMU);
+    MVM_BINOP_UNSIGNED(%, MVM_DIVISION_CHECK(ub));
+    MVM_NEXT();
+MVM_CASE(OP_XOR):
+    MVM_COUNT(OP_XOR);
+    MVM_BINOP_UNSIGNED(^, {});
+    MVM_NEXT();
+MVM_CASE(OP_EQ):
+    MVM_COUNT(OP_EQ);
+    MVM_BINOP_UNSIGNED(==, {});
+    MVM_NEXT();
+MVM_CASE(OP_NEQ):
+    MVM_COUNT(OP_NEQ);
+    MVM_BINOP_UNSIGNED(!=, {});
+    MVM_NEXT();
+MVM_CASE(OP_LT):
+    MVM_COUNT(OP_LT);
+    MVM_BINOP_SIGNED(<, {});
+    MVM_NEXT();
+MVM_CASE(OP_GTE):
+    MVM_COUNT(OP_GTE);
+    MVM_BINOP_SIGNED(>=, {});
+    MVM_NEXT();
+MVM_CASE(OP_LTU):
+    MVM_COUNT(OP_LTU);
+    MVM_BINOP_UNSIGNED(<, {});
+    MVM_NEXT();
+MVM_CASE(OP_GTEU):
+    MVM_COUNT(OP_GTEU);
+    MVM_BINOP_UNSIGNED(>=, {});
+    MVM_NEXT();
+MVM_CASE(OP_LB):
+    MVM_COUNT(OP_LB);
+    MVM_LOAD(ia, mvm_load_i8);
+    MVM_NEXT();
+MVM_CASE(OP_LH):
+    MVM_COUNT(OP_LH);
+    MVM_LOAD(ia, mvm_load_i16);
+    MVM_NEXT();
+MVM_CASE(OP_LW):
+    MVM_COUNT(OP_LW);
+    MVM_LOAD(ua, mvm_load_u32);
+    MVM_NEXT();
+MVM_CASE(OP_LBU):
+    MVM_COUNT(OP_LBU);
+    MVM_LOAD(ua, mvm_load_u8);
+    MVM_NEXT();
+MVM_CASE(OP_LHU):
+    MVM_COUNT(OP_LHU);
+    MVM_LOAD(ua, mvm_load_u16);
+    MVM_NEXT();
+MVM_CASE(OP_SB):
+    MVM_COUNT(OP_SB);
+    MVM_STORE(mvm_store_8, sizeof(uint8_t));
+    MVM_NEXT();
+MVM_CASE(OP_SH):
+    MVM_COUNT(OP_SH);
+    MVM_STORE(mvm_store_16, sizeof(uint16_t));
+    MVM_NEXT();
+MVM_CASE(OP_SW):
+    MVM_COUNT(OP_SW);
+    MVM_STORE(mvm_store_32, sizeof(uint32_t));
+    MVM_NEXT();
+MVM_CASE(OP_JMP):
+    MVM_COUNT(OP_JMP);
+    MVM_UNDERFLOW(1);
+    ua = MVM_PC;
+    MVM_PC = MVM_TOS;
+    MVM_DROP(1);
+    MVM_PREEMPT_BACKWARD(ua);
+    MVM_INTERRUPTS();
+    MVM_NEXT();
+MVM_CASE(OP_CJMP):
+    MVM_COUNT(OP_CJMP);
+    MVM_UNDERFLOW(2);
+    ua = MVM_PC;
+    if(MVM_NOS)
+        MVM_PC = MVM_TOS;
+    MVM_DROP(2);
+    MVM_PREEMPT_BACKWARD(ua);
+    MVM_INTERRUPTS();
+    MVM_NEXT();
+MVM_CASE(OP_CALL):
+    MVM_COUNT(OP_CALL);
+    MVM_UNDERFLOW(1);
+    ua = MVM_TOS;
+    MVM_DROP(1);
+    ub = MVM_PC;
+    MVM_PC = ua;
+    MVM_RPUSH(ub);
+    MVM_LEAVE_ON_FAULT();
+    MVM_PREEMPT();
+    MVM_INTERRUPTS();
+    MVM_NEXT();
+MVM_CASE(OP_RET):
+    MVM_COUNT(OP_RET);
+    MVM_RPOP(ua);
+    MVM_LEAVE_ON_FAULT();
+    MVM_PC = ua;
+    MVM_UNTIL_RETURNED();
+    MVM_INTERRUPTS();
+    MVM_NEXT();
+MVM_CASE(OP_SYS):
+    MVM_COUNT(OP_SYS);
+    MVM_SAVE();
+    MVM_COUNT_SYSCALL();
+    vm->host->syscall(vm);
+    MVM_RESTORE();
+    MVM_LEAVE_ON_FAULT();
+    MVM_PREEMPT();
+    MVM_INTERRUPTS();
+    MVM_NEXT();
+MVM_CASE(OP_EI):
+    MVM_COUNT(OP_EI);
+    MVM_UNDERFLOW(1);
+    vm->enabled |= MVM_TOS;
+    MVM_DROP(1);
+    mvm_interrupt_update(vm);
+    MVM_INTERRUPTS();
+    MVM_NEXT();
+MVM_CASE(OP_DI):
+    MVM_COUNT(OP_DI);
+    MVM_UNDERFLOW(1);
+    vm->enabled &= ~MVM_TOS;
+    MVM_DROP(1);
+    mvm_interrupt_update(vm);
+    MVM_NEXT();
+MVM_CASE(OP_RETI):
+    MVM_COUNT(OP_RETI);
+    MVM_RPOP(ua);
+    MVM_LEAVE_ON_FAULT();
+    MVM_PC = ua;
+    vm->servicing = 0;
+    mvm_interrupt_update(vm);
+    MVM_UNTIL_RETURNED();
+    MVM_INTERRUPTS();
+    MVM_NEXT();
+MVM_CASE(OP_WFI):
+    MVM_COUNT(OP_WFI);
+    if(!vm->ready) {
+        vm->status = MVM_WAITING;
+        MVM_LEAVE();
+    }
+    MVM_INTERRUPTS();
+    MVM_NEXT();
+MVM_DEFAULT:
+    vm->status = MVM_INVALID_INSTRUCTION;
+    MVM_LEAVE();
@@ -0,0 +1,1400 @@
+#ifndef MVM_JIT_H
+#define MVM_JIT_H
+
+// Two tier JIT for x86-64 Linux. Basic blocks of bytecode are first compiled,
+// one template per opcode, into an executable buffer. Anything unusual (sys,
+// brk, MMIO accesses, stores into code, faults, stack limits) leaves the
+// compiled code just before the instruction, which the interpreter then
+// executes, so vm->status and vm->pc behave exactly as with mvm_run.
+//
+// Blocks entered often through a call or a backward branch are recompiled as
+// regions: traces following constant jumps, calls and returns, where stack
+// slots live in host registers or are folded as constants, and which loop
+// back to their entry without leaving the native code.
+//
+// The JIT relies on the instruction cache to track code bytes: attach an
+// mvm_icache to the vm before calling mvm_jit_init. MVM_JIT_IMPLEMENTATION
+// must be defined in the same file as MVM_IMPLEMENTATION.
+
+#include <stddef.h>
+#include <stdint.h>
+#include "mvm.h"
+
+#define MVM_JIT_BUFFER_SIZE (4 << 20)
+#define MVM_JIT_MAX_BLOCKS 16384
+#define MVM_JIT_MAX_BLOCK_INSNS 128
+#define MVM_JIT_MAX_REGION_INSNS 128
+#ifndef MVM_JIT_HOT
+// entries through a call or a backward branch before a block becomes a region
+#define MVM_JIT_HOT 256
+#endif
+
+typedef struct mvm_jit_block {
+    uint32_t start, end; // bytecode range, spanning the whole trace of regions
+    uint32_t entry;
+    uint32_t count; // instructions in the block, longest pass of a region
+    uint32_t hits;
+    uint8_t tier;
+    uint8_t last; // opcode ending a block
+    uint8_t *code;
+} mvm_jit_block;
+
+typedef struct mvm_jit {
+    uint8_t *buf;
+    size_t used;
+    int32_t block_at[MVM_RAM_SIZE]; // block index, or one of the values below
+    mvm_jit_block blocks[MVM_JIT_MAX_BLOCKS];
+    uint32_t block_count;
+    struct mvm_jit_region *region; // scratch state of the region compiler
+} mvm_jit;
+
+// returns 0 if the JIT is not supported (including with the options of
+// mvm_guard.h) or the code buffer can't be mapped
+int mvm_jit_init(mvm_jit *jit, mvm *vm);
+void mvm_jit_free(mvm_jit *jit);
+// returns the instructions executed, as mvm_run does
+uint32_t mvm_jit_run(mvm *vm, uint32_t limit);
+
+#ifdef MVM_JIT_IMPLEMENTATION
+
+// The compiled code addresses the stacks inside the mvm struct, and falls back
+// to mvm_run, whose guarded accesses must run under mvm_guard_run.
+#if defined(__x86_64__) && defined(__linux__) && !defined(MVM_GUARD_STACKS) && \
+    !defined(MVM_GUARD_RAM)
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define MVM_JIT_NONE -1
+#define MVM_JIT_INTERPRET -2 // the instruction at this address can't be compiled
+
+// largest code emitted for one instruction, its side exits included
+#define MVM_JIT_MAX_INSN_CODE 128
+
+enum { MVM_JIT_EAX, MVM_JIT_ECX, MVM_JIT_EDX };
+
+#define MVM_JIT_R14 14 // guest ram
+#define MVM_JIT_R15 15 // instruction cache code map
+
+// x86 condition codes, for jcc (0x0f 0x80+cc) and setcc (0x0f 0x90+cc)
+enum {
+    MVM_JIT_CC_B = 0x2,
+    MVM_JIT_CC_AE = 0x3,
+    MVM_JIT_CC_E = 0x4,
+    MVM_JIT_CC_NE = 0x5,
+    MVM_JIT_CC_A = 0x7,
+    MVM_JIT_CC_L = 0xc,
+    MVM_JIT_CC_GE = 0xd,
+};
+
+typedef struct mvm_jit_exit {
+    uint32_t fixup; // offset of the rel32 jumping to the exit
+    uint32_t pc, count;
+    int32_t delta;
+} mvm_jit_exit;
+
+// state of the block being compiled
+typedef struct mvm_jit_asm {
+    mvm_jit *jit;
+    uint32_t pc, count;
+    int32_t delta; // stack depth relative to vm->sp at block entry
+    mvm_jit_exit exits[MVM_JIT_MAX_BLOCK_INSNS * 2 + 1];
+    uint32_t exit_count;
+} mvm_jit_asm;
+
+static void mvm_jit_u8(mvm_jit_asm *a, uint8_t b) {
+    a->jit->buf[a->jit->used++] = b;
+}
+
+static void mvm_jit_u32(mvm_jit_asm *a, uint32_t w) {
+    memcpy(&a->jit->buf[a->jit->used], &w, sizeof(w));
+    a->jit->used += sizeof(w);
+}
+
+static void mvm_jit_bytes(mvm_jit_asm *a, const char *bytes, size_t n) {
+    memcpy(&a->jit->buf[a->jit->used], bytes, n);
+    a->jit->used += n;
+}
+
+#define MVM_JIT_EMIT(a, bytes) mvm_jit_bytes(a, bytes, sizeof(bytes) - 1)
+
+// op reg, [rbx + r13 * 4 + stk[slot]], slot being relative to the entry sp
+static void mvm_jit_stk(mvm_jit_asm *a, uint16_t opcode, int reg,
+                        int32_t slot) {
+    mvm_jit_u8(a, 0x42 | (reg >> 3) << 2);
+    if(opcode > 0xff)
+        mvm_jit_u8(a, opcode >> 8);
+    mvm_jit_u8(a, opcode & 0xff);
+    mvm_jit_u8(a, 0x84 | (reg & 7) << 3);
+    mvm_jit_u8(a, 0xab);
+    mvm_jit_u32(a, offsetof(mvm, stk) + sizeof(uint32_t) * slot);
+}
+
+// op reg, [rbx + offset], rbx holding the vm
+static void mvm_jit_vm(mvm_jit_asm *a, uint8_t opcode, int reg,
+                       uint32_t offset) {
+    mvm_jit_u8(a, opcode);
+    mvm_jit_u8(a, 0x83 | reg << 3);
+    mvm_jit_u32(a, offset);
+}
+
+// value of the stack slot relative to the current top (-1 is the top)
+#define MVM_JIT_TOP(a, k) ((a)->delta + (k))
+
+static void mvm_jit_load(mvm_jit_asm *a, int reg, int32_t k) {
+    mvm_jit_stk(a, 0x8b, reg, MVM_JIT_TOP(a, k));
+}
+
+static void mvm_jit_store(mvm_jit_asm *a, int reg, int32_t k) {
+    mvm_jit_stk(a, 0x89, reg, MVM_JIT_TOP(a, k));
+}
+
+// jcc to a side exit leaving the block before the current instruction
+static void mvm_jit_exit_if(mvm_jit_asm *a, uint8_t cc) {
+    mvm_jit_exit *e = &a->exits[a->exit_count++];
+    mvm_jit_u8(a, 0x0f);
+    mvm_jit_u8(a, 0x80 | cc);
+    e->fixup = a->jit->used;
+    e->pc = a->pc;
+    e->count = a->count;
+    e->delta = a->delta;
+    mvm_jit_u32(a, 0);
+}
+
+static void mvm_jit_binop(mvm_jit_asm *a, uint16_t opcode) {
+    mvm_jit_load(a, MVM_JIT_EAX, -2);
+    mvm_jit_stk(a, opcode, MVM_JIT_EAX, MVM_JIT_TOP(a, -1));
+    mvm_jit_store(a, MVM_JIT_EAX, -2);
+    a->delta--;
+}
+
+static void mvm_jit_compare(mvm_jit_asm *a, uint8_t cc) {
+    mvm_jit_load(a, MVM_JIT_EAX, -2);
+    mvm_jit_stk(a, 0x3b, MVM_JIT_EAX, MVM_JIT_TOP(a, -1)); // cmp
+    mvm_jit_u8(a, 0x0f);
+    mvm_jit_u8(a, 0x90 | cc);
+    mvm_jit_u8(a, 0xc0);              // setcc al
+    MVM_JIT_EMIT(a, "\x0f\xb6\xc0"); // movzx eax, al
+    mvm_jit_store(a, MVM_JIT_EAX, -2);
+    a->delta--;
+}
+
+static void mvm_jit_divide(mvm_jit_asm *a, int is_signed, int remainder) {
+    mvm_jit_load(a, MVM_JIT_ECX, -1);
+    MVM_JIT_EMIT(a, "\x85\xc9"); // test ecx, ecx
+    mvm_jit_exit_if(a, MVM_JIT_CC_E);
+    if(is_signed) {
+        // INT32_MIN / -1 is left to the interpreter
+        MVM_JIT_EMIT(a, "\x83\xf9\xff"); // cmp ecx, -1
+        mvm_jit_exit_if(a, MVM_JIT_CC_E);
+        mvm_jit_load(a, MVM_JIT_EAX, -2);
+        MVM_JIT_EMIT(a, "\x99\xf7\xf9"); // cdq; idiv ecx
+    } else {
+        mvm_jit_load(a, MVM_JIT_EAX, -2);
+        MVM_JIT_EMIT(a, "\x31\xd2\xf7\xf1"); // xor edx, edx; div ecx
+    }
+    mvm_jit_store(a, remainder ? MVM_JIT_EDX : MVM_JIT_EAX, -2);
+    a->delta--;
+}
+
+// eax = guest address on top of the stack, leaving if it is not in ram
+static void mvm_jit_address(mvm_jit_asm *a, uint32_t size) {
+    mvm_jit_load(a, MVM_JIT_EAX, -1);
+    mvm_jit_u8(a, 0x3d); // cmp eax, imm32
+    mvm_jit_u32(a, MVM_RAM_SIZE - size);
+    mvm_jit_exit_if(a, MVM_JIT_CC_A);
+}
+
+static void mvm_jit_load_op(mvm_jit_asm *a, uint32_t size, const char *load,
+                            size_t n) {
+    mvm_jit_address(a, size);
+    mvm_jit_bytes(a, load, n); // eax = [r14 + rax]
+    mvm_jit_store(a, MVM_JIT_EAX, -1);
+}
+
+#define MVM_JIT_LOAD(a, size, load) mvm_jit_load_op(a, size, load, sizeof(load) - 1)
+
+// stores into decoded or compiled code are left to the interpreter, which
+// invalidates them
+static void mvm_jit_store_op(mvm_jit_asm *a, uint32_t size, const char *check,
+                             size_t check_n, const char *store,
+                             size_t store_n) {
+    mvm_jit_address(a, size);
+    mvm_jit_bytes(a, check, check_n); // cmp [r15 + rax], 0
+    mvm_jit_exit_if(a, MVM_JIT_CC_NE);
+    mvm_jit_load(a, MVM_JIT_ECX, -2);
+    mvm_jit_bytes(a, store, store_n); // [r14 + rax] = ecx
+    a->delta -= 2;
+}
+
+#define MVM_JIT_STORE(a, size, check, store)                                   \
+    mvm_jit_store_op(a, size, check, sizeof(check) - 1, store,                 \
+                     sizeof(store) - 1)
+
+static void mvm_jit_set_pc(mvm_jit_asm *a, int reg) {
+    mvm_jit_vm(a, 0x89, reg, offsetof(mvm, pc));
+}
+
+static void mvm_jit_insn(mvm_jit_asm *a, uint8_t op, uint32_t imm,
+                         uint32_t next) {
+    switch(op) {
+    case OP_PUSH_U8:
+    case OP_PUSH_U16:
+    case OP_PUSH32:
+        mvm_jit_stk(a, 0xc7, 0, MVM_JIT_TOP(a, 0)); // mov dword [slot], imm32
+        mvm_jit_u32(a, imm);
+        a->delta++;
+        break;
+    case OP_DUP:
+        mvm_jit_load(a, MVM_JIT_EAX, -1);
+        mvm_jit_store(a, MVM_JIT_EAX, 0);
+        a->delta++;
+        break;
+    case OP_OVR:
+        mvm_jit_load(a, MVM_JIT_EAX, -2);
+        mvm_jit_store(a, MVM_JIT_EAX, 0);
+        a->delta++;
+        break;
+    case OP_POP:
+        a->delta--;
+        break;
+    case OP_ADD:
+        mvm_jit_binop(a, 0x03);
+        break;
+    case OP_SUB:
+        mvm_jit_binop(a, 0x2b);
+        break;
+    case OP_MUL:
+        mvm_jit_binop(a, 0x0faf);
+        break;
+    case OP_XOR:
+        mvm_jit_binop(a, 0x33);
+        break;
+    case OP_DIV:
+        mvm_jit_divide(a, 1, 0);
+        break;
+    case OP_DIVU:
+        mvm_jit_divide(a, 0, 0);
+        break;
+    case OP_REM:
+        mvm_jit_divide(a, 1, 1);
+        break;
+    case OP_REMU:
+        mvm_jit_divide(a, 0, 1);
+        break;
+    case OP_EQ:
+        mvm_jit_compare(a, MVM_JIT_CC_E);
+        break;
+    case OP_NEQ:
+        mvm_jit_compare(a, MVM_JIT_CC_NE);
+        break;
+    case OP_LT:
+        mvm_jit_compare(a, MVM_JIT_CC_L);
+        break;
+    case OP_GTE:
+        mvm_jit_compare(a, MVM_JIT_CC_GE);
+        break;
+    case OP_LTU:
+        mvm_jit_compare(a, MVM_JIT_CC_B);
+        break;
+    case OP_GTEU:
+        mvm_jit_compare(a, MVM_JIT_CC_AE);
+        break;
+    case OP_LB:
+        MVM_JIT_LOAD(a, 1, "\x41\x0f\xbe\x04\x06"); // movsx eax, byte
+        break;
+    case OP_LH:
+        MVM_JIT_LOAD(a, 2, "\x41\x0f\xbf\x04\x06"); // movsx eax, word
+        break;
+    case OP_LW:
+        MVM_JIT_LOAD(a, 4, "\x41\x8b\x04\x06"); // mov eax, dword
+        break;
+    case OP_LBU:
+        MVM_JIT_LOAD(a, 1, "\x41\x0f\xb6\x04\x06"); // movzx eax, byte
+        break;
+    case OP_LHU:
+        MVM_JIT_LOAD(a, 2, "\x41\x0f\xb7\x04\x06"); // movzx eax, word
+        break;
+    case OP_SB:
+        MVM_JIT_STORE(a, 1, "\x41\x80\x3c\x07\x00", "\x41\x88\x0c\x06");
+        break;
+    case OP_SH:
+        MVM_JIT_STORE(a, 2, "\x66\x41\x83\x3c\x07\x00",
+                      "\x66\x41\x89\x0c\x06");
+        break;
+    case OP_SW:
+        MVM_JIT_STORE(a, 4, "\x41\x83\x3c\x07\x00", "\x41\x89\x0c\x06");
+        break;
+    case OP_JMP:
+        mvm_jit_load(a, MVM_JIT_EAX, -1);
+        a->delta--;
+        mvm_jit_set_pc(a, MVM_JIT_EAX);
+        break;
+    case OP_CJMP:
+        mvm_jit_load(a, MVM_JIT_ECX, -1); // target
+        mvm_jit_load(a, MVM_JIT_EAX, -2); // condition
+        a->delta -= 2;
+        mvm_jit_u8(a, 0xba); // mov edx, next
+        mvm_jit_u32(a, next);
+        MVM_JIT_EMIT(a, "\x85\xc0\x0f\x45\xd1"); // test eax, eax; cmovne edx, ecx
+        mvm_jit_set_pc(a, MVM_JIT_EDX);
+        break;
+    case OP_CALL:
+        mvm_jit_vm(a, 0x8b, MVM_JIT_EAX, offsetof(mvm, rsp));
+        mvm_jit_u8(a, 0x3d); // cmp eax, imm32
+        mvm_jit_u32(a, MVM_ARRAYSIZE(((mvm *)0)->rstk));
+        mvm_jit_exit_if(a, MVM_JIT_CC_AE);
+        MVM_JIT_EMIT(a, "\xc7\x84\x83"); // mov dword [rbx + rax * 4 + rstk]
+        mvm_jit_u32(a, offsetof(mvm, rstk));
+        mvm_jit_u32(a, next);
+        MVM_JIT_EMIT(a, "\x83\xc0\x01"); // add eax, 1
+        mvm_jit_vm(a, 0x89, MVM_JIT_EAX, offsetof(mvm, rsp));
+        mvm_jit_load(a, MVM_JIT_ECX, -1);
+        a->delta--;
+        mvm_jit_set_pc(a, MVM_JIT_ECX);
+        break;
+    case OP_RET:
+        mvm_jit_vm(a, 0x8b, MVM_JIT_EAX, offsetof(mvm, rsp));
+        MVM_JIT_EMIT(a, "\x85\xc0"); // test eax, eax
+        mvm_jit_exit_if(a, MVM_JIT_CC_E);
+        MVM_JIT_EMIT(a, "\x83\xe8\x01"); // sub eax, 1
+        mvm_jit_vm(a, 0x89, MVM_JIT_EAX, offsetof(mvm, rsp));
+        MVM_JIT_EMIT(a, "\x8b\x8c\x83"); // mov ecx, [rbx + rax * 4 + rstk]
+        mvm_jit_u32(a, offsetof(mvm, rstk));
+        mvm_jit_set_pc(a, MVM_JIT_ECX);
+        break;
+    }
+}
+
+// the interrupt instructions are left to the interpreter
+static int mvm_jit_compilable(uint8_t op) {
+    return op < MVM_OPCODE_COUNT && op != OP_BRK && op != OP_SYS &&
+           op != OP_EI && op != OP_DI && op != OP_RETI && op != OP_WFI;
+}
+
+static int mvm_jit_ends_block(uint8_t op) {
+    return op == OP_JMP || op == OP_CJMP || op == OP_CALL || op == OP_RET;
+}
+
+// exit code: adjust the stack pointer, set pc and return count << 1 | side
+static void mvm_jit_leave(mvm_jit_asm *a, int32_t delta, int set_pc,
+                          uint32_t pc, uint32_t ret) {
+    if(delta) {
+        MVM_JIT_EMIT(a, "\x41\x81\xc5"); // add r13d, delta
+        mvm_jit_u32(a, (uint32_t)delta);
+    }
+    if(set_pc) {
+        MVM_JIT_EMIT(a, "\xc7\x83"); // mov dword [rbx + pc], imm32
+        mvm_jit_u32(a, offsetof(mvm, pc));
+        mvm_jit_u32(a, pc);
+    }
+    mvm_jit_u8(a, 0xb8); // mov eax, ret
+    mvm_jit_u32(a, ret);
+}
+
+static void mvm_jit_flush(mvm_jit *jit) {
+    for(uint32_t pc = 0; pc < MVM_RAM_SIZE; pc++)
+        jit->block_at[pc] = MVM_JIT_NONE;
+    jit->block_count = 0;
+    jit->used = 0;
+}
+
+static void mvm_jit_invalidate(mvm *vm, uint32_t start, uint32_t end) {
+    mvm_jit *jit = (mvm_jit *)vm->icache->hook_data;
+    for(uint32_t i = 0; i < jit->block_count; i++) {
+        mvm_jit_block *b = &jit->blocks[i];
+        if(b->start < end && b->end > start &&
+           jit->block_at[b->entry] == (int32_t)i)
+            jit->block_at[b->entry] = MVM_JIT_NONE;
+    }
+    uint32_t pc = start < MVM_INSN_MAX_SIZE ? 0 : start - MVM_INSN_MAX_SIZE;
+    for(; pc < end; pc++) {
+        if(jit->block_at[pc] == MVM_JIT_INTERPRET)
+            jit->block_at[pc] = MVM_JIT_NONE;
+    }
+}
+
+static mvm_jit_block *mvm_jit_compile(mvm_jit *jit, mvm *vm, uint32_t start) {
+    const uint8_t *ram = vm->ram;
+    uint32_t pc = start, count = 0;
+    int32_t depth = 0, need = 0, growth = 0;
+    while(count < MVM_JIT_MAX_BLOCK_INSNS && pc < MVM_RAM_SIZE) {
+        const uint8_t op = ram[pc];
+        if(!mvm_jit_compilable(op) ||
+           pc + 1 + mvm_op_imm_size[op] > MVM_RAM_SIZE)
+            break;
+        depth -= mvm_op_pops[op];
+        if(-depth > need)
+            need = -depth;
+        depth += mvm_op_pushes[op];
+        if(depth > growth)
+            growth = depth;
+        pc += 1 + mvm_op_imm_size[op];
+        count++;
+        if(mvm_jit_ends_block(op))
+            break;
+    }
+    mvm_icache *icache = vm->icache;
+    if(count == 0) {
+        jit->block_at[start] = MVM_JIT_INTERPRET;
+        icache->code[start] = 1;
+        return NULL;
+    }
+    const size_t max_code = 256 + count * MVM_JIT_MAX_INSN_CODE;
+    if(jit->block_count == MVM_JIT_MAX_BLOCKS ||
+       jit->used + max_code > MVM_JIT_BUFFER_SIZE)
+        mvm_jit_flush(jit);
+    const uint32_t end = pc;
+
+    mprotect(jit->buf, MVM_JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE);
+    mvm_jit_asm a;
+    a.jit = jit;
+    a.pc = start;
+    a.count = 0;
+    a.delta = 0;
+    a.exit_count = 0;
+    mvm_jit_block *b = &jit->blocks[jit->block_count];
+    b->start = start;
+    b->end = end;
+    b->entry = start;
+    b->count = count;
+    b->hits = 0;
+    b->tier = 1;
+    b->code = &jit->buf[jit->used];
+
+    // push rbx; push r13; push r14; push r15; mov rbx, rdi
+    MVM_JIT_EMIT(&a, "\x53\x41\x55\x41\x56\x41\x57\x48\x89\xfb");
+    MVM_JIT_EMIT(&a, "\x44\x8b\xab"); // mov r13d, [rbx + sp]
+    mvm_jit_u32(&a, offsetof(mvm, sp));
+    MVM_JIT_EMIT(&a, "\x4c\x8b\xb3"); // mov r14, [rbx + ram]
+    mvm_jit_u32(&a, offsetof(mvm, ram));
+    MVM_JIT_EMIT(&a, "\x49\xbf"); // mov r15, code map
+    const uint64_t code_map = (uintptr_t)icache->code;
+    memcpy(&jit->buf[jit->used], &code_map, sizeof(code_map));
+    jit->used += sizeof(code_map);
+
+    // the whole block is checked against the stack bounds once
+    if(need) {
+        MVM_JIT_EMIT(&a, "\x41\x81\xfd"); // cmp r13d, need
+        mvm_jit_u32(&a, need);
+        mvm_jit_exit_if(&a, MVM_JIT_CC_B);
+    }
+    MVM_JIT_EMIT(&a, "\x41\x81\xfd"); // cmp r13d, stack size - growth
+    mvm_jit_u32(&a, MVM_ARRAYSIZE(vm->stk) - growth);
+    mvm_jit_exit_if(&a, MVM_JIT_CC_A);
+
+    uint8_t last = 0;
+    for(pc = start; pc < end;) {
+        const uint8_t op = ram[pc];
+        const uint32_t next = pc + 1 + mvm_op_imm_size[op];
+        uint32_t imm = 0;
+        memcpy(&imm, &ram[pc + 1], mvm_op_imm_size[op]);
+        a.pc = pc;
+        mvm_jit_insn(&a, op, imm, next);
+        a.count++;
+        last = op;
+        pc = next;
+    }
+    b->last = last;
+
+    // normal exit, falling through to the epilogue shared by the side exits
+    mvm_jit_leave(&a, a.delta, !mvm_jit_ends_block(last), end, count << 1);
+    const uint32_t epilogue = jit->used;
+    MVM_JIT_EMIT(&a, "\x44\x89\xab"); // mov [rbx + sp], r13d
+    mvm_jit_u32(&a, offsetof(mvm, sp));
+    // pop r15; pop r14; pop r13; pop rbx; ret
+    MVM_JIT_EMIT(&a, "\x41\x5f\x41\x5e\x41\x5d\x5b\xc3");
+    for(uint32_t i = 0; i < a.exit_count; i++) {
+        const mvm_jit_exit *e = &a.exits[i];
+        const uint32_t rel = jit->used - (e->fixup + sizeof(uint32_t));
+        memcpy(&jit->buf[e->fixup], &rel, sizeof(rel));
+        mvm_jit_leave(&a, e->delta, 1, e->pc, e->count << 1 | 1);
+        mvm_jit_u8(&a, 0xe9); // jmp epilogue
+        mvm_jit_u32(&a, epilogue - (jit->used + sizeof(uint32_t)));
+    }
+    mprotect(jit->buf, MVM_JIT_BUFFER_SIZE, PROT_READ | PROT_EXEC);
+
+    memset(&icache->code[start], 1, end - start);
+    jit->block_at[start] = jit->block_count++;
+    return b;
+}
+
+// Region compiler. The operand stack is tracked while compiling: a slot holds
+// its value in vm->stk, a constant or a host register, and is only written
+// back when the region leaves, runs out of registers, or loops to its entry.
+// Pushes popped before that never reach memory.
+
+#define MVM_JIT_WINDOW 16 // slots that may differ from vm->stk
+#define MVM_JIT_RSTACK 16 // return addresses of the calls followed by a trace
+#define MVM_JIT_BIAS 256  // index of the entry sp in mvm_jit_region.stack
+// largest code emitted for one region instruction, its exits included
+#define MVM_JIT_MAX_REGION_CODE 640
+
+enum { MVM_JIT_MEM, MVM_JIT_CONST, MVM_JIT_REG };
+
+typedef struct mvm_jit_value {
+    uint8_t kind, reg;
+    uint32_t imm;
+} mvm_jit_value;
+
+typedef struct mvm_jit_region_exit {
+    uint32_t fixup;
+    uint32_t pc, ret;
+    int32_t delta, lo;
+    mvm_jit_value values[MVM_JIT_WINDOW]; // slots [lo, delta) at the exit
+} mvm_jit_region_exit;
+
+typedef struct mvm_jit_region {
+    mvm_jit_asm a;
+    uint32_t entry, top, epilogue;
+    uint32_t length; // longest pass from the top to an exit
+    int open;
+    int32_t lo; // slots below lo match vm->stk
+    mvm_jit_value stack[2 * MVM_JIT_BIAS + 1];
+    uint8_t refs[16];
+    uint32_t rstack[MVM_JIT_RSTACK];
+    uint32_t rdepth;
+    uint32_t insns[MVM_JIT_MAX_REGION_INSNS];
+    mvm_jit_region_exit exits[MVM_JIT_MAX_REGION_INSNS * 2 + 2];
+    uint32_t exit_count;
+    uint32_t length_fixups[MVM_JIT_MAX_REGION_INSNS];
+    uint32_t length_fixup_count;
+} mvm_jit_region;
+
+// esi, edi, r8d-r11d; eax, ecx and edx are scratch
+static const uint8_t mvm_jit_regs[] = {6, 7, 8, 9, 10, 11};
+
+static void mvm_jit_rex(mvm_jit_asm *a, int reg, int rm) {
+    if((reg | rm) & 8)
+        mvm_jit_u8(a, 0x40 | (reg >> 3) << 2 | rm >> 3);
+}
+
+static void mvm_jit_opcode(mvm_jit_asm *a, uint16_t opcode) {
+    if(opcode > 0xff)
+        mvm_jit_u8(a, opcode >> 8);
+    mvm_jit_u8(a, opcode & 0xff);
+}
+
+// op reg, rm with both operands in registers
+static void mvm_jit_rr(mvm_jit_asm *a, uint16_t opcode, int reg, int rm) {
+    mvm_jit_rex(a, reg, rm);
+    mvm_jit_opcode(a, opcode);
+    mvm_jit_u8(a, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// op reg, [base + rax], or [base + addr] for a constant address, base being
+// r14 or r15 so that a rex prefix is always there for byte registers
+static void mvm_jit_mem(mvm_jit_asm *a, uint16_t opcode, int reg, int base,
+                        int is_const, uint32_t addr, int word) {
+    if(word)
+        mvm_jit_u8(a, 0x66);
+    mvm_jit_u8(a, 0x40 | (reg >> 3) << 2 | base >> 3);
+    mvm_jit_opcode(a, opcode);
+    if(is_const) {
+        mvm_jit_u8(a, 0x80 | (reg & 7) << 3 | (base & 7));
+        mvm_jit_u32(a, addr);
+    } else {
+        mvm_jit_u8(a, 0x04 | (reg & 7) << 3);
+        mvm_jit_u8(a, base & 7);
+    }
+}
+
+static mvm_jit_value *mvm_jit_opt_slot(mvm_jit_region *r, int32_t k) {
+    return &r->stack[MVM_JIT_BIAS + r->a.delta + k];
+}
+
+static void mvm_jit_opt_load(mvm_jit_region *r, int reg, int32_t k) {
+    const mvm_jit_value *v = mvm_jit_opt_slot(r, k);
+    switch(v->kind) {
+    case MVM_JIT_MEM:
+        mvm_jit_load(&r->a, reg, k);
+        break;
+    case MVM_JIT_CONST:
+        mvm_jit_rex(&r->a, 0, reg);
+        mvm_jit_u8(&r->a, 0xb8 | (reg & 7)); // mov reg, imm32
+        mvm_jit_u32(&r->a, v->imm);
+        break;
+    case MVM_JIT_REG:
+        if(v->reg != reg)
+            mvm_jit_rr(&r->a, 0x8b, reg, v->reg);
+        break;
+    }
+}
+
+// register holding slot k, which is loaded into scratch if it isn't in one
+static int mvm_jit_opt_reg(mvm_jit_region *r, int32_t k, int scratch) {
+    const mvm_jit_value *v = mvm_jit_opt_slot(r, k);
+    if(v->kind == MVM_JIT_REG)
+        return v->reg;
+    mvm_jit_opt_load(r, scratch, k);
+    return scratch;
+}
+
+// op reg, slot k, ext being the 0x81 extension for constants (-1 for imul)
+static void mvm_jit_opt_alu(mvm_jit_region *r, uint16_t opcode, int ext,
+                            int reg, int32_t k) {
+    const mvm_jit_value *v = mvm_jit_opt_slot(r, k);
+    switch(v->kind) {
+    case MVM_JIT_MEM:
+        mvm_jit_stk(&r->a, opcode, reg, MVM_JIT_TOP(&r->a, k));
+        break;
+    case MVM_JIT_CONST:
+        if(ext < 0) {
+            mvm_jit_rex(&r->a, reg, reg);
+            mvm_jit_u8(&r->a, 0x69);
+            mvm_jit_u8(&r->a, 0xc0 | (reg & 7) << 3 | (reg & 7));
+        } else {
+            mvm_jit_rex(&r->a, 0, reg);
+            mvm_jit_u8(&r->a, 0x81);
+            mvm_jit_u8(&r->a, 0xc0 | ext << 3 | (reg & 7));
+        }
+        mvm_jit_u32(&r->a, v->imm);
+        break;
+    case MVM_JIT_REG:
+        mvm_jit_rr(&r->a, opcode, reg, v->reg);
+        break;
+    }
+}
+
+static int mvm_jit_opt_alloc(mvm_jit_region *r) {
+    for(size_t i = 0; i < MVM_ARRAYSIZE(mvm_jit_regs); i++) {
+        if(!r->refs[mvm_jit_regs[i]])
+            return mvm_jit_regs[i];
+    }
+    return -1;
+}
+
+// writes the slots that differ from vm->stk back, constants staying known
+static void mvm_jit_opt_flush(mvm_jit_region *r) {
+    for(int32_t slot = r->lo; slot < r->a.delta; slot++) {
+        mvm_jit_value *v = &r->stack[MVM_JIT_BIAS + slot];
+        if(v->kind == MVM_JIT_CONST) {
+            mvm_jit_stk(&r->a, 0xc7, 0, slot);
+            mvm_jit_u32(&r->a, v->imm);
+        } else if(v->kind == MVM_JIT_REG) {
+            mvm_jit_stk(&r->a, 0x89, v->reg, slot);
+            r->refs[v->reg]--;
+            v->kind = MVM_JIT_MEM;
+        }
+    }
+    r->lo = r->a.delta;
+}
+
+// makes room for one instruction: a free register and a slot in the window
+static void mvm_jit_opt_reserve(mvm_jit_region *r) {
+    const int32_t lo = r->lo < r->a.delta ? r->lo : r->a.delta;
+    if(mvm_jit_opt_alloc(r) < 0 || r->a.delta + 1 - lo > MVM_JIT_WINDOW)
+        mvm_jit_opt_flush(r);
+}
+
+static void mvm_jit_opt_pop(mvm_jit_region *r) {
+    const mvm_jit_value *v = mvm_jit_opt_slot(r, -1);
+    if(v->kind == MVM_JIT_REG)
+        r->refs[v->reg]--;
+    r->a.delta--;
+}
+
+static mvm_jit_value *mvm_jit_opt_push(mvm_jit_region *r) {
+    mvm_jit_value *v = mvm_jit_opt_slot(r, 0);
+    if(r->a.delta < r->lo)
+        r->lo = r->a.delta;
+    r->a.delta++;
+    return v;
+}
+
+static void mvm_jit_opt_push_const(mvm_jit_region *r, uint32_t imm) {
+    mvm_jit_value *v = mvm_jit_opt_push(r);
+    v->kind = MVM_JIT_CONST;
+    v->imm = imm;
+}
+
+static void mvm_jit_opt_push_reg(mvm_jit_region *r, int reg) {
+    mvm_jit_value *v = mvm_jit_opt_push(r);
+    v->kind = MVM_JIT_REG;
+    v->reg = reg;
+    r->refs[reg]++;
+}
+
+// pushes slot k again, sharing its register or constant
+static void mvm_jit_opt_push_copy(mvm_jit_region *r, int32_t k) {
+    const mvm_jit_value v = *mvm_jit_opt_slot(r, k);
+    if(v.kind == MVM_JIT_CONST) {
+        mvm_jit_opt_push_const(r, v.imm);
+    } else if(v.kind == MVM_JIT_REG) {
+        mvm_jit_opt_push_reg(r, v.reg);
+    } else {
+        const int reg = mvm_jit_opt_alloc(r);
+        mvm_jit_opt_load(r, reg, k);
+        mvm_jit_opt_push_reg(r, reg);
+    }
+}
+
+// replaces the operands of an instruction by its result, held in reg
+static void mvm_jit_opt_result(mvm_jit_region *r, int pops, int reg) {
+    r->refs[reg]++;
+    while(pops--)
+        mvm_jit_opt_pop(r);
+    mvm_jit_opt_push_reg(r, reg);
+    r->refs[reg]--;
+}
+
+// jcc, or jmp when cc is negative, to a stub writing the current stack back
+// and leaving with pc and ret
+static void mvm_jit_opt_exit(mvm_jit_region *r, int cc, uint32_t pc,
+                             uint32_t ret) {
+    mvm_jit_asm *a = &r->a;
+    mvm_jit_region_exit *e = &r->exits[r->exit_count++];
+    if(cc < 0) {
+        mvm_jit_u8(a, 0xe9);
+    } else {
+        mvm_jit_u8(a, 0x0f);
+        mvm_jit_u8(a, 0x80 | cc);
+    }
+    e->fixup = a->jit->used;
+    mvm_jit_u32(a, 0);
+    e->pc = pc;
+    e->ret = ret;
+    e->delta = a->delta;
+    e->lo = r->lo < a->delta ? r->lo : a->delta;
+    memcpy(e->values, &r->stack[MVM_JIT_BIAS + e->lo],
+           (e->delta - e->lo) * sizeof(mvm_jit_value));
+    if(ret >> 1 > r->length)
+        r->length = ret >> 1;
+}
+
+// leaves before the current instruction for the interpreter to execute it
+static void mvm_jit_opt_side_exit(mvm_jit_region *r, int cc) {
+    mvm_jit_opt_exit(r, cc, r->a.pc, r->a.count << 1 | 1);
+}
+
+static void mvm_jit_opt_leave(mvm_jit_region *r, int set_pc, uint32_t pc,
+                              uint32_t count) {
+    mvm_jit_asm *a = &r->a;
+    mvm_jit_leave(a, a->delta, set_pc, pc, count << 1);
+    mvm_jit_u8(a, 0xe9); // jmp epilogue
+    mvm_jit_u32(a, r->epilogue - (a->jit->used + sizeof(uint32_t)));
+    if(count > r->length)
+        r->length = count;
+}
+
+// ends the trace, writing everything back
+static void mvm_jit_opt_end(mvm_jit_region *r, int set_pc, uint32_t pc,
+                            uint32_t count) {
+    mvm_jit_opt_flush(r);
+    mvm_jit_opt_leave(r, set_pc, pc, count);
+    r->open = 0;
+}
+
+// continues the trace at a constant target, looping when it is the entry and
+// the stacks are back to their entry depth
+static uint32_t mvm_jit_opt_follow(mvm_jit_region *r, uint32_t target,
+                                   uint32_t count) {
+    mvm_jit_asm *a = &r->a;
+    if(target != r->entry || a->delta || r->rdepth)
+        return target;
+    mvm_jit_opt_flush(r);
+    if(count > r->length)
+        r->length = count;
+    MVM_JIT_EMIT(a, "\x41\x81\xc4"); // add r12d, count
+    mvm_jit_u32(a, count);
+    // a stop request leaves the region before another pass, as mvm_jit_run
+    // only sees it between blocks
+    MVM_JIT_EMIT(a, "\x83\xbb"); // cmp dword [rbx + stop], 0
+    mvm_jit_u32(a, offsetof(mvm, stop));
+    mvm_jit_u8(a, 0);
+    MVM_JIT_EMIT(a, "\x75\x10"); // jne leave
+    // another pass only if the longest one fits in the budget held by ebp
+    MVM_JIT_EMIT(a, "\x41\x8d\x84\x24"); // lea eax, [r12 + length]
+    r->length_fixups[r->length_fixup_count++] = a->jit->used;
+    mvm_jit_u32(a, 0);
+    MVM_JIT_EMIT(a, "\x39\xe8\x0f\x86"); // cmp eax, ebp; jbe top
+    mvm_jit_u32(a, r->top - (a->jit->used + sizeof(uint32_t)));
+    mvm_jit_opt_leave(r, 1, r->entry, 0);
+    r->open = 0;
+    return target;
+}
+
+static int mvm_jit_opt_fold(uint8_t op, uint32_t ua, uint32_t ub,
+                            uint32_t *result) {
+    const int32_t ia = (int32_t)ua, ib = (int32_t)ub;
+    switch(op) {
+    case OP_ADD:
+        *result = ua + ub;
+        return 1;
+    case OP_SUB:
+        *result = ua - ub;
+        return 1;
+    case OP_MUL:
+        *result = ua * ub;
+        return 1;
+    case OP_XOR:
+        *result = ua ^ ub;
+        return 1;
+    case OP_DIV:
+        *result = ib != 0 && ib != -1 ? ia / ib : 0;
+        return ib != 0 && ib != -1;
+    case OP_DIVU:
+        *result = ub ? ua / ub : 0;
+        return ub != 0;
+    case OP_REM:
+        *result = ib != 0 && ib != -1 ? ia % ib : 0;
+        return ib != 0 && ib != -1;
+    case OP_REMU:
+        *result = ub ? ua % ub : 0;
+        return ub != 0;
+    case OP_EQ:
+        *result = ua == ub;
+        return 1;
+    case OP_NEQ:
+        *result = ua != ub;
+        return 1;
+    case OP_LT:
+        *result = ia < ib;
+        return 1;
+    case OP_GTE:
+        *result = ia >= ib;
+        return 1;
+    case OP_LTU:
+        *result = ua < ub;
+        return 1;
+    case OP_GTEU:
+        *result = ua >= ub;
+        return 1;
+    }
+    return 0;
+}
+
+static void mvm_jit_opt_arith(mvm_jit_region *r, uint16_t opcode, int ext) {
+    const mvm_jit_value *x = mvm_jit_opt_slot(r, -2);
+    int reg;
+    if(x->kind == MVM_JIT_REG && r->refs[x->reg] == 1) {
+        reg = x->reg;
+    } else {
+        reg = mvm_jit_opt_alloc(r);
+        mvm_jit_opt_load(r, reg, -2);
+    }
+    mvm_jit_opt_alu(r, opcode, ext, reg, -1);
+    mvm_jit_opt_result(r, 2, reg);
+}
+
+static void mvm_jit_opt_compare(mvm_jit_region *r, uint8_t cc) {
+    const int x = mvm_jit_opt_reg(r, -2, MVM_JIT_EAX);
+    mvm_jit_opt_alu(r, 0x3b, 7, x, -1); // cmp
+    const int reg = mvm_jit_opt_alloc(r);
+    mvm_jit_u8(&r->a, 0x0f);
+    mvm_jit_u8(&r->a, 0x90 | cc);
+    mvm_jit_u8(&r->a, 0xc0); // setcc al
+    mvm_jit_rr(&r->a, 0x0fb6, reg, MVM_JIT_EAX);
+    mvm_jit_opt_result(r, 2, reg);
+}
+
+static void mvm_jit_opt_divide(mvm_jit_region *r, int is_signed,
+                               int remainder) {
+    mvm_jit_asm *a = &r->a;
+    const mvm_jit_value *y = mvm_jit_opt_slot(r, -1);
+    const int checked = y->kind != MVM_JIT_CONST || y->imm == 0 ||
+                        (is_signed && y->imm == UINT32_MAX);
+    mvm_jit_opt_load(r, MVM_JIT_ECX, -1);
+    if(checked) {
+        MVM_JIT_EMIT(a, "\x85\xc9"); // test ecx, ecx
+        mvm_jit_opt_side_exit(r, MVM_JIT_CC_E);
+        if(is_signed) {
+            MVM_JIT_EMIT(a, "\x83\xf9\xff"); // cmp ecx, -1
+            mvm_jit_opt_side_exit(r, MVM_JIT_CC_E);
+        }
+    }
+    mvm_jit_opt_load(r, MVM_JIT_EAX, -2);
+    if(is_signed)
+        MVM_JIT_EMIT(a, "\x99\xf7\xf9"); // cdq; idiv ecx
+    else
+        MVM_JIT_EMIT(a, "\x31\xd2\xf7\xf1"); // xor edx, edx; div ecx
+    const int reg = mvm_jit_opt_alloc(r);
+    mvm_jit_rr(a, 0x8b, reg, remainder ? MVM_JIT_EDX : MVM_JIT_EAX);
+    mvm_jit_opt_result(r, 2, reg);
+}
+
+static void mvm_jit_opt_binop(mvm_jit_region *r, uint8_t op) {
+    const mvm_jit_value *x = mvm_jit_opt_slot(r, -2);
+    const mvm_jit_value *y = mvm_jit_opt_slot(r, -1);
+    uint32_t result;
+    if(x->kind == MVM_JIT_CONST && y->kind == MVM_JIT_CONST &&
+       mvm_jit_opt_fold(op, x->imm, y->imm, &result)) {
+        mvm_jit_opt_pop(r);
+        mvm_jit_opt_pop(r);
+        mvm_jit_opt_push_const(r, result);
+        return;
+    }
+    switch(op) {
+    case OP_ADD:
+        mvm_jit_opt_arith(r, 0x03, 0);
+        break;
+    case OP_SUB:
+        mvm_jit_opt_arith(r, 0x2b, 5);
+        break;
+    case OP_MUL:
+        mvm_jit_opt_arith(r, 0x0faf, -1);
+        break;
+    case OP_XOR:
+        mvm_jit_opt_arith(r, 0x33, 6);
+        break;
+    case OP_DIV:
+        mvm_jit_opt_divide(r, 1, 0);
+        break;
+    case OP_DIVU:
+        mvm_jit_opt_divide(r, 0, 0);
+        break;
+    case OP_REM:
+        mvm_jit_opt_divide(r, 1, 1);
+        break;
+    case OP_REMU:
+        mvm_jit_opt_divide(r, 0, 1);
+        break;
+    case OP_EQ:
+        mvm_jit_opt_compare(r, MVM_JIT_CC_E);
+        break;
+    case OP_NEQ:
+        mvm_jit_opt_compare(r, MVM_JIT_CC_NE);
+        break;
+    case OP_LT:
+        mvm_jit_opt_compare(r, MVM_JIT_CC_L);
+        break;
+    case OP_GTE:
+        mvm_jit_opt_compare(r, MVM_JIT_CC_GE);
+        break;
+    case OP_LTU:
+        mvm_jit_opt_compare(r, MVM_JIT_CC_B);
+        break;
+    case OP_GTEU:
+        mvm_jit_opt_compare(r, MVM_JIT_CC_AE);
+        break;
+    }
+}
+
+// eax = address on top of the stack, unless it is a constant; constants out
+// of ram end the trace
+static int mvm_jit_opt_address(mvm_jit_region *r, uint32_t size) {
+    const mvm_jit_value *x = mvm_jit_opt_slot(r, -1);
+    if(x->kind == MVM_JIT_CONST) {
+        if(x->imm > MVM_RAM_SIZE - size) {
+            mvm_jit_opt_side_exit(r, -1);
+            r->open = 0;
+            return 0;
+        }
+        return 1;
+    }
+    mvm_jit_opt_load(r, MVM_JIT_EAX, -1);
+    mvm_jit_u8(&r->a, 0x3d); // cmp eax, imm32
+    mvm_jit_u32(&r->a, MVM_RAM_SIZE - size);
+    mvm_jit_opt_side_exit(r, MVM_JIT_CC_A);
+    return 1;
+}
+
+static void mvm_jit_opt_load_op(mvm_jit_region *r, uint16_t opcode,
+                                uint32_t size) {
+    const mvm_jit_value *x = mvm_jit_opt_slot(r, -1);
+    if(!mvm_jit_opt_address(r, size))
+        return;
+    const int reg = mvm_jit_opt_alloc(r);
+    mvm_jit_mem(&r->a, opcode, reg, MVM_JIT_R14, x->kind == MVM_JIT_CONST,
+                x->imm, 0);
+    mvm_jit_opt_result(r, 1, reg);
+}
+
+static void mvm_jit_opt_store_op(mvm_jit_region *r, uint32_t size) {
+    const mvm_jit_value *x = mvm_jit_opt_slot(r, -1);
+    const mvm_jit_value *y = mvm_jit_opt_slot(r, -2);
+    if(!mvm_jit_opt_address(r, size))
+        return;
+    const int is_const = x->kind == MVM_JIT_CONST;
+    const int word = size == 2;
+    // stores into code are left to the interpreter, which invalidates it
+    mvm_jit_mem(&r->a, size == 1 ? 0x80 : 0x83, 7, MVM_JIT_R15, is_const,
+                x->imm, word); // cmp [r15 + address], 0
+    mvm_jit_u8(&r->a, 0);
+    mvm_jit_opt_side_exit(r, MVM_JIT_CC_NE);
+    if(y->kind == MVM_JIT_CONST) {
+        mvm_jit_mem(&r->a, size == 1 ? 0xc6 : 0xc7, 0, MVM_JIT_R14, is_const,
+                    x->imm, word);
+        mvm_jit_bytes(&r->a, (const char *)&y->imm, size);
+    } else {
+        const int reg = mvm_jit_opt_reg(r, -2, MVM_JIT_ECX);
+        mvm_jit_mem(&r->a, size == 1 ? 0x88 : 0x89, reg, MVM_JIT_R14,
+                    is_const, x->imm, word);
+    }
+    mvm_jit_opt_pop(r);
+    mvm_jit_opt_pop(r);
+}
+
+// compiles one instruction, returning the address the trace continues at
+static uint32_t mvm_jit_opt_insn(mvm_jit_region *r, uint8_t op, uint32_t imm,
+                                 uint32_t next) {
+    mvm_jit_asm *a = &r->a;
+    const uint32_t count = a->count + 1; // once this instruction is done
+    const mvm_jit_value *x = mvm_jit_opt_slot(r, -2);
+    const mvm_jit_value *y = mvm_jit_opt_slot(r, -1);
+    mvm_jit_opt_reserve(r);
+    switch(op) {
+    case OP_PUSH_U8:
+    case OP_PUSH_U16:
+    case OP_PUSH32:
+        mvm_jit_opt_push_const(r, imm);
+        break;
+    case OP_DUP:
+        mvm_jit_opt_push_copy(r, -1);
+        break;
+    case OP_OVR:
+        mvm_jit_opt_push_copy(r, -2);
+        break;
+    case OP_POP:
+        mvm_jit_opt_pop(r);
+        break;
+    case OP_LB:
+        mvm_jit_opt_load_op(r, 0x0fbe, 1); // movsx
+        break;
+    case OP_LH:
+        mvm_jit_opt_load_op(r, 0x0fbf, 2); // movsx
+        break;
+    case OP_LW:
+        mvm_jit_opt_load_op(r, 0x8b, 4);
+        break;
+    case OP_LBU:
+        mvm_jit_opt_load_op(r, 0x0fb6, 1); // movzx
+        break;
+    case OP_LHU:
+        mvm_jit_opt_load_op(r, 0x0fb7, 2); // movzx
+        break;
+    case OP_SB:
+        mvm_jit_opt_store_op(r, 1);
+        break;
+    case OP_SH:
+        mvm_jit_opt_store_op(r, 2);
+        break;
+    case OP_SW:
+        mvm_jit_opt_store_op(r, 4);
+        break;
+    case OP_JMP:
+        if(y->kind == MVM_JIT_CONST) {
+            const uint32_t target = y->imm;
+            mvm_jit_opt_pop(r);
+            return mvm_jit_opt_follow(r, target, count);
+        }
+        mvm_jit_opt_load(r, MVM_JIT_EAX, -1);
+        mvm_jit_opt_pop(r);
+        mvm_jit_opt_flush(r);
+        mvm_jit_set_pc(a, MVM_JIT_EAX);
+        mvm_jit_opt_end(r, 0, 0, count);
+        break;
+    case OP_CJMP:
+        if(y->kind != MVM_JIT_CONST) {
+            mvm_jit_opt_load(r, MVM_JIT_ECX, -1);
+            mvm_jit_opt_load(r, MVM_JIT_EAX, -2);
+            mvm_jit_opt_pop(r);
+            mvm_jit_opt_pop(r);
+            mvm_jit_opt_flush(r);
+            mvm_jit_u8(a, 0xba); // mov edx, next
+            mvm_jit_u32(a, next);
+            MVM_JIT_EMIT(a, "\x85\xc0\x0f\x45\xd1"); // test eax, eax; cmovne edx, ecx
+            mvm_jit_set_pc(a, MVM_JIT_EDX);
+            mvm_jit_opt_end(r, 0, 0, count);
+        } else if(x->kind == MVM_JIT_CONST) {
+            const uint32_t target = y->imm;
+            const int taken = x->imm != 0;
+            mvm_jit_opt_pop(r);
+            mvm_jit_opt_pop(r);
+            if(taken)
+                return mvm_jit_opt_follow(r, target, count);
+        } else {
+            // the trace goes on when the branch is not taken
+            const uint32_t target = y->imm;
+            mvm_jit_opt_load(r, MVM_JIT_EAX, -2);
+            mvm_jit_opt_pop(r);
+            mvm_jit_opt_pop(r);
+            if(target == r->entry && !a->delta && !r->rdepth) {
+                mvm_jit_opt_flush(r);
+                MVM_JIT_EMIT(a, "\x85\xc0\x0f\x84"); // test eax, eax; jz skip
+                const uint32_t skip = a->jit->used;
+                mvm_jit_u32(a, 0);
+                mvm_jit_opt_follow(r, target, count);
+                r->open = 1;
+                const uint32_t rel = a->jit->used - (skip + sizeof(uint32_t));
+                memcpy(&a->jit->buf[skip], &rel, sizeof(rel));
+            } else {
+                MVM_JIT_EMIT(a, "\x85\xc0"); // test eax, eax
+                mvm_jit_opt_exit(r, MVM_JIT_CC_NE, target, count << 1);
+            }
+        }
+        break;
+    case OP_CALL:
+        mvm_jit_vm(a, 0x8b, MVM_JIT_EAX, offsetof(mvm, rsp));
+        mvm_jit_u8(a, 0x3d); // cmp eax, imm32
+        mvm_jit_u32(a, MVM_ARRAYSIZE(((mvm *)0)->rstk));
+        mvm_jit_opt_side_exit(r, MVM_JIT_CC_AE);
+        MVM_JIT_EMIT(a, "\xc7\x84\x83"); // mov dword [rbx + rax * 4 + rstk]
+        mvm_jit_u32(a, offsetof(mvm, rstk));
+        mvm_jit_u32(a, next);
+        MVM_JIT_EMIT(a, "\x83\xc0\x01"); // add eax, 1
+        mvm_jit_vm(a, 0x89, MVM_JIT_EAX, offsetof(mvm, rsp));
+        if(y->kind == MVM_JIT_CONST && r->rdepth < MVM_JIT_RSTACK) {
+            const uint32_t target = y->imm;
+            mvm_jit_opt_pop(r);
+            r->rstack[r->rdepth++] = next;
+            return mvm_jit_opt_follow(r, target, count);
+        }
+        mvm_jit_opt_load(r, MVM_JIT_ECX, -1);
+        mvm_jit_opt_pop(r);
+        mvm_jit_opt_flush(r);
+        mvm_jit_set_pc(a, MVM_JIT_ECX);
+        mvm_jit_opt_end(r, 0, 0, count);
+        break;
+    case OP_RET:
+        if(r->rdepth) {
+            // returning from a call of this trace
+            MVM_JIT_EMIT(a, "\x83\xab"); // sub dword [rbx + rsp], 1
+            mvm_jit_u32(a, offsetof(mvm, rsp));
+            mvm_jit_u8(a, 1);
+            return mvm_jit_opt_follow(r, r->rstack[--r->rdepth], count);
+        }
+        mvm_jit_vm(a, 0x8b, MVM_JIT_EAX, offsetof(mvm, rsp));
+        MVM_JIT_EMIT(a, "\x85\xc0"); // test eax, eax
+        mvm_jit_opt_side_exit(r, MVM_JIT_CC_E);
+        MVM_JIT_EMIT(a, "\x83\xe8\x01"); // sub eax, 1
+        mvm_jit_vm(a, 0x89, MVM_JIT_EAX, offsetof(mvm, rsp));
+        MVM_JIT_EMIT(a, "\x8b\x8c\x83"); // mov ecx, [rbx + rax * 4 + rstk]
+        mvm_jit_u32(a, offsetof(mvm, rstk));
+        mvm_jit_opt_flush(r);
+        mvm_jit_set_pc(a, MVM_JIT_ECX);
+        mvm_jit_opt_end(r, 0, 0, count);
+        break;
+    default:
+        mvm_jit_opt_binop(r, op);
+        break;
+    }
+    return next;
+}
+
+static mvm_jit_block *mvm_jit_compile_region(mvm_jit *jit, mvm *vm,
+                                             uint32_t entry) {
+    const uint8_t *ram = vm->ram;
+    mvm_jit_region *r = jit->region;
+    mvm_jit_asm *a = &r->a;
+    const size_t max_code =
+        256 + MVM_JIT_MAX_REGION_INSNS * MVM_JIT_MAX_REGION_CODE;
+    if(jit->block_count == MVM_JIT_MAX_BLOCKS ||
+       jit->used + max_code > MVM_JIT_BUFFER_SIZE)
+        mvm_jit_flush(jit);
+
+    mprotect(jit->buf, MVM_JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE);
+    a->jit = jit;
+    a->pc = entry;
+    a->count = 0;
+    a->delta = 0;
+    r->entry = entry;
+    r->length = 0;
+    r->open = 1;
+    r->lo = 0;
+    for(size_t i = 0; i < MVM_ARRAYSIZE(r->stack); i++)
+        r->stack[i].kind = MVM_JIT_MEM;
+    memset(r->refs, 0, sizeof(r->refs));
+    r->rdepth = 0;
+    r->exit_count = 0;
+    r->length_fixup_count = 0;
+
+    // the epilogue comes first so that every exit can jump back to it
+    r->epilogue = jit->used;
+    MVM_JIT_EMIT(a, "\x42\x8d\x04\x60"); // lea eax, [rax + r12 * 2]
+    MVM_JIT_EMIT(a, "\x44\x89\xab");     // mov [rbx + sp], r13d
+    mvm_jit_u32(a, offsetof(mvm, sp));
+    // pop r15; pop r14; pop r13; pop r12; pop rbp; pop rbx; ret
+    MVM_JIT_EMIT(a, "\x41\x5f\x41\x5e\x41\x5d\x41\x5c\x5d\x5b\xc3");
+
+    uint8_t *code = &jit->buf[jit->used];
+    // push rbx; push rbp; push r12; push r13; push r14; push r15
+    MVM_JIT_EMIT(a, "\x53\x55\x41\x54\x41\x55\x41\x56\x41\x57");
+    // mov rbx, rdi; mov ebp, esi; xor r12d, r12d
+    MVM_JIT_EMIT(a, "\x48\x89\xfb\x89\xf5\x45\x31\xe4");
+    MVM_JIT_EMIT(a, "\x44\x8b\xab"); // mov r13d, [rbx + sp]
+    mvm_jit_u32(a, offsetof(mvm, sp));
+    MVM_JIT_EMIT(a, "\x4c\x8b\xb3"); // mov r14, [rbx + ram]
+    mvm_jit_u32(a, offsetof(mvm, ram));
+    MVM_JIT_EMIT(a, "\x49\xbf"); // mov r15, code map
+    const uint64_t code_map = (uintptr_t)vm->icache->code;
+    memcpy(&jit->buf[jit->used], &code_map, sizeof(code_map));
+    jit->used += sizeof(code_map);
+    MVM_JIT_EMIT(a, "\x41\x81\xfd"); // cmp r13d, need
+    const uint32_t need_fixup = jit->used;
+    mvm_jit_u32(a, 0);
+    mvm_jit_opt_side_exit(r, MVM_JIT_CC_B);
+    MVM_JIT_EMIT(a, "\x41\x81\xfd"); // cmp r13d, stack size - growth
+    const uint32_t growth_fixup = jit->used;
+    mvm_jit_u32(a, 0);
+    mvm_jit_opt_side_exit(r, MVM_JIT_CC_A);
+    r->top = jit->used;
+
+    uint32_t pc = entry;
+    int32_t depth = 0, need = 0, growth = 0;
+    while(r->open) {
+        if(a->count == MVM_JIT_MAX_REGION_INSNS || pc >= MVM_RAM_SIZE ||
+           !mvm_jit_compilable(ram[pc]) ||
+           pc + 1 + mvm_op_imm_size[ram[pc]] > MVM_RAM_SIZE) {
+            mvm_jit_opt_end(r, 1, pc, a->count);
+            break;
+        }
+        const uint8_t op = ram[pc];
+        depth -= mvm_op_pops[op];
+        if(-depth > need)
+            need = -depth;
+        depth += mvm_op_pushes[op];
+        if(depth > growth)
+            growth = depth;
+        const uint32_t next = pc + 1 + mvm_op_imm_size[op];
+        uint32_t imm = 0;
+        memcpy(&imm, &ram[pc + 1], mvm_op_imm_size[op]);
+        r->insns[a->count] = pc;
+        a->pc = pc;
+        pc = mvm_jit_opt_insn(r, op, imm, next);
+        a->count++;
+    }
+    const uint32_t insn_count = a->count;
+
+    const uint32_t stack_limit = MVM_ARRAYSIZE(vm->stk) - growth;
+    memcpy(&jit->buf[need_fixup], &need, sizeof(need));
+    memcpy(&jit->buf[growth_fixup], &stack_limit, sizeof(stack_limit));
+    for(uint32_t i = 0; i < r->length_fixup_count; i++)
+        memcpy(&jit->buf[r->length_fixups[i]], &r->length, sizeof(r->length));
+    for(uint32_t i = 0; i < r->exit_count; i++) {
+        const mvm_jit_region_exit *e = &r->exits[i];
+        const uint32_t rel = jit->used - (e->fixup + sizeof(uint32_t));
+        memcpy(&jit->buf[e->fixup], &rel, sizeof(rel));
+        for(int32_t slot = e->lo; slot < e->delta; slot++) {
+            const mvm_jit_value *v = &e->values[slot - e->lo];
+            if(v->kind == MVM_JIT_CONST) {
+                mvm_jit_stk(a, 0xc7, 0, slot);
+                mvm_jit_u32(a, v->imm);
+            } else if(v->kind == MVM_JIT_REG) {
+                mvm_jit_stk(a, 0x89, v->reg, slot);
+            }
+        }
+        mvm_jit_leave(a, e->delta, 1, e->pc, e->ret);
+        mvm_jit_u8(a, 0xe9); // jmp epilogue
+        mvm_jit_u32(a, r->epilogue - (jit->used + sizeof(uint32_t)));
+    }
+    mprotect(jit->buf, MVM_JIT_BUFFER_SIZE, PROT_READ | PROT_EXEC);
+
+    mvm_jit_block *b = &jit->blocks[jit->block_count];
+    b->start = MVM_RAM_SIZE;
+    b->end = 0;
+    for(uint32_t i = 0; i < insn_count; i++) {
+        const uint32_t start = r->insns[i];
+        const uint32_t end = start + 1 + mvm_op_imm_size[ram[start]];
+        memset(&vm->icache->code[start], 1, end - start);
+        if(start < b->start)
+            b->start = start;
+        if(end > b->end)
+            b->end = end;
+    }
+    b->entry = entry;
+    b->count = r->length;
+    b->hits = 0;
+    b->tier = 2;
+    b->last = OP_BRK;
+    b->code = code;
+    jit->block_at[entry] = jit->block_count++;
+    return b;
+}
+
+int mvm_jit_init(mvm_jit *jit, mvm *vm) {
+    if(!vm->icache)
+        return 0;
+    void *buf = mmap(NULL, MVM_JIT_BUFFER_SIZE, PROT_READ | PROT_EXEC,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(buf == MAP_FAILED)
+        return 0;
+    jit->buf = (uint8_t *)buf;
+    jit->region = (mvm_jit_region *)malloc(sizeof(mvm_jit_region));
+    if(!jit->region) {
+        munmap(buf, MVM_JIT_BUFFER_SIZE);
+        return 0;
+    }
+    mvm_jit_flush(jit);
+    vm->icache->invalidate_hook = mvm_jit_invalidate;
+    vm->icache->hook_data = jit;
+    return 1;
+}
+
+void mvm_jit_free(mvm_jit *jit) {
+    free(jit->region);
+    munmap(jit->buf, MVM_JIT_BUFFER_SIZE);
+}
+
+uint32_t mvm_jit_run(mvm *vm, uint32_t limit) {
+    const uint32_t start = limit;
+    mvm_jit *jit = (mvm_jit *)vm->icache->hook_data;
+    // how the previous block was left, to spot calls and backward branches
+    uint8_t last = OP_BRK;
+    uint32_t from = MVM_RAM_SIZE;
+    while(limit && vm->status == MVM_RUNNING) {
+        if(MVM_ATOMIC_LOAD(vm->stop))
+            break;
+        // Compiled code doesn't check for interrupts, so they wait for the
+        // block to end, or a region to leave.
+        if(vm->ready) {
+            mvm_interrupt_take(vm);
+            last = OP_BRK;
+            from = MVM_RAM_SIZE;
+            continue;
+        }
+        mvm_jit_block *b = NULL;
+        if(vm->pc < MVM_RAM_SIZE) {
+            const int32_t i = jit->block_at[vm->pc];
+            if(i >= 0)
+                b = &jit->blocks[i];
+            else if(i == MVM_JIT_NONE)
+                b = mvm_jit_compile(jit, vm, vm->pc);
+        }
+        if(b && b->tier == 1 && (last == OP_CALL || vm->pc <= from) &&
+           ++b->hits == MVM_JIT_HOT) {
+            mvm_jit_compile_region(jit, vm, vm->pc);
+            continue;
+        }
+        if(!b || b->count > limit) {
+            limit -= mvm_run_interpreter(vm, b ? limit : 1);
+            last = OP_BRK;
+            from = MVM_RAM_SIZE;
+            continue;
+        }
+        uint32_t (*fn)(mvm *, uint32_t);
+        memcpy(&fn, &b->code, sizeof(fn));
+        const uint32_t ret = fn(vm, limit < INT32_MAX ? limit : INT32_MAX);
+        limit -= ret >> 1;
+        last = b->last;
+        from = b->entry;
+        if((ret & 1) && limit) {
+            // side exit: the interpreter handles this instruction
+            limit -= mvm_run_interpreter(vm, 1);
+            last = OP_BRK;
+            from = MVM_RAM_SIZE;
+        }
+    }
+    if(MVM_ATOMIC_LOAD(vm->stop))
+        MVM_ATOMIC_STORE(vm->stop, 0);
+    return start - limit;
+}
+
+#else
+
+int mvm_jit_init(mvm_jit *jit, mvm *vm) {
+    return 0;
+}
+
+void mvm_jit_free(mvm_jit *jit) {}
+
+uint32_t mvm_jit_run(mvm *vm, uint32_t limit) {
+    return mvm_run(vm, limit);
+}
+
+#endif
+
+#endif
+
+#endif
@@ -0,0 +1,264 @@
+#ifndef MVM_PROFILE_H
+#define MVM_PROFILE_H
+
+// Sampling profiler of the guest. The host runs the vm in slices of as many
+// instructions as the sampling period and calls mvm_profile_sample between
+// them, so the interpreter itself is not instrumented. A sample is the call
+// chain of the vm: the return addresses of rstk, outermost first, then pc.
+//
+// mvm_profile_write prints the samples as collapsed stacks, one line per
+// distinct chain followed by its count, as read by flamegraph tools. With the
+// symbols written by the assembler, each address is replaced by the label at
+// or before it, which names the function holding it; chains that differ only
+// within functions then print as the same line, which the tools add up.
+//
+// MVM_PROFILE_IMPLEMENTATION must be defined in the same file as
+// MVM_IMPLEMENTATION.
+
+#include <stdint.h>
+#include <stdio.h>
+#include "mvm.h"
+
+typedef struct mvm_profile_stack {
+    uint64_t hash, count;
+    uint32_t depth, frames; // frames is the index of the first one in pool
+} mvm_profile_stack;
+
+typedef struct mvm_profile {
+    mvm_profile_stack *stacks; // open addressing, capacity a power of 2
+    uint32_t capacity, count;
+    uint32_t *pool; // frames of the stacks, one after the other
+    uint32_t pool_size, pool_capacity;
+    uint64_t samples;
+} mvm_profile;
+
+typedef struct mvm_symbol {
+    uint32_t addr;
+    char *name;
+} mvm_symbol;
+
+typedef struct mvm_symbols {
+    mvm_symbol *symbols; // sorted by address
+    uint32_t count;
+} mvm_symbols;
+
+void mvm_profile_init(mvm_profile *profile);
+// returns 0 if the sample can't be stored
+int mvm_profile_sample(mvm_profile *profile, const mvm *vm);
+// symbols may be NULL to print the addresses; returns 0 on write errors
+int mvm_profile_write(const mvm_profile *profile, const mvm_symbols *symbols,
+                      FILE *f);
+void mvm_profile_free(mvm_profile *profile);
+
+// Reads a symbol file: one label per line, its address in hexadecimal then
+// its name. Returns 0 if it can't be read.
+int mvm_symbols_load(mvm_symbols *symbols, const char *path);
+// the label at or before addr, NULL if there is none
+const char *mvm_symbols_lookup(const mvm_symbols *symbols, uint32_t addr);
+void mvm_symbols_free(mvm_symbols *symbols);
+
+#ifdef MVM_PROFILE_IMPLEMENTATION
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MVM_PROFILE_INITIAL_CAPACITY 256
+#define MVM_PROFILE_NAME_SIZE 256
+
+void mvm_profile_init(mvm_profile *profile) {
+    memset(profile, 0, sizeof(mvm_profile));
+}
+
+// FNV-1a over the frames of vm, outermost first
+static uint64_t mvm_profile_hash(const mvm *vm) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for(uint32_t i = 0; i <= vm->rsp; i++) {
+        hash ^= i < vm->rsp ? vm->rstk[i] : vm->pc;
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+static int mvm_profile_same(const mvm_profile *profile,
+                            const mvm_profile_stack *stack, const mvm *vm) {
+    const uint32_t *frames = &profile->pool[stack->frames];
+    return stack->depth == vm->rsp + 1 &&
+           !memcmp(frames, vm->rstk, vm->rsp * sizeof(uint32_t)) &&
+           frames[vm->rsp] == vm->pc;
+}
+
+static int mvm_profile_grow(mvm_profile *profile) {
+    const uint32_t capacity = profile->capacity
+                                  ? profile->capacity * 2
+                                  : MVM_PROFILE_INITIAL_CAPACITY;
+    mvm_profile_stack *stacks =
+        (mvm_profile_stack *)calloc(capacity, sizeof(mvm_profile_stack));
+    if(!stacks)
+        return 0;
+    for(uint32_t i = 0; i < profile->capacity; i++) {
+        const mvm_profile_stack *stack = &profile->stacks[i];
+        if(!stack->count)
+            continue;
+        uint32_t slot = (uint32_t)stack->hash & (capacity - 1);
+        while(stacks[slot].count)
+            slot = (slot + 1) & (capacity - 1);
+        stacks[slot] = *stack;
+    }
+    free(profile->stacks);
+    profile->stacks = stacks;
+    profile->capacity = capacity;
+    return 1;
+}
+
+static int mvm_profile_reserve(mvm_profile *profile, uint32_t depth) {
+    if(profile->pool_capacity - profile->pool_size >= depth)
+        return 1;
+    uint32_t capacity = profile->pool_capacity ? profile->pool_capacity
+                                               : MVM_PROFILE_INITIAL_CAPACITY;
+    while(capacity - profile->pool_size < depth)
+        capacity *= 2;
+    uint32_t *pool =
+        (uint32_t *)realloc(profile->pool, capacity * sizeof(uint32_t));
+    if(!pool)
+        return 0;
+    profile->pool = pool;
+    profile->pool_capacity = capacity;
+    return 1;
+}
+
+int mvm_profile_sample(mvm_profile *profile, const mvm *vm) {
+    // kept at most three quarters full
+    if(4 * (profile->count + 1) > 3 * profile->capacity &&
+       !mvm_profile_grow(profile))
+        return 0;
+    const uint64_t hash = mvm_profile_hash(vm);
+    uint32_t slot = (uint32_t)hash & (profile->capacity - 1);
+    for(; profile->stacks[slot].count;
+        slot = (slot + 1) & (profile->capacity - 1)) {
+        mvm_profile_stack *stack = &profile->stacks[slot];
+        if(stack->hash == hash && mvm_profile_same(profile, stack, vm)) {
+            stack->count++;
+            profile->samples++;
+            return 1;
+        }
+    }
+
+    const uint32_t depth = vm->rsp + 1;
+    if(!mvm_profile_reserve(profile, depth))
+        return 0;
+    mvm_profile_stack *stack = &profile->stacks[slot];
+    stack->hash = hash;
+    stack->count = 1;
+    stack->depth = depth;
+    stack->frames = profile->pool_size;
+    memcpy(&profile->pool[stack->frames], vm->rstk,
+           vm->rsp * sizeof(uint32_t));
+    profile->pool[stack->frames + vm->rsp] = vm->pc;
+    profile->pool_size += depth;
+    profile->count++;
+    profile->samples++;
+    return 1;
+}
+
+int mvm_profile_write(const mvm_profile *profile, const mvm_symbols *symbols,
+                      FILE *f) {
+    for(uint32_t i = 0; i < profile->capacity; i++) {
+        const mvm_profile_stack *stack = &profile->stacks[i];
+        if(!stack->count)
+            continue;
+        for(uint32_t j = 0; j < stack->depth; j++) {
+            const uint32_t addr = profile->pool[stack->frames + j];
+            // a return address may be the first past the function calling
+            const uint32_t at =
+                j + 1 < stack->depth && addr ? addr - 1 : addr;
+            const char *name =
+                symbols ? mvm_symbols_lookup(symbols, at) : NULL;
+            if(j)
+                fputc(';', f);
+            if(name)
+                fputs(name, f);
+            else
+                fprintf(f, "0x%08" PRIx32, addr);
+        }
+        fprintf(f, " %" PRIu64 "\n", stack->count);
+    }
+    return !ferror(f);
+}
+
+void mvm_profile_free(mvm_profile *profile) {
+    free(profile->stacks);
+    free(profile->pool);
+    mvm_profile_init(profile);
+}
+
+static int mvm_symbols_compare(const void *a, const void *b) {
+    const uint32_t x = ((const mvm_symbol *)a)->addr;
+    const uint32_t y = ((const mvm_symbol *)b)->addr;
+    return (x > y) - (x < y);
+}
+
+int mvm_symbols_load(mvm_symbols *symbols, const char *path) {
+    memset(symbols, 0, sizeof(mvm_symbols));
+    FILE *f = fopen(path, "r");
+    if(!f)
+        return 0;
+    uint32_t capacity = 0;
+    uint32_t addr;
+    char name[MVM_PROFILE_NAME_SIZE];
+    int ok = 1;
+    while(ok && fscanf(f, "%" SCNx32 " %255s", &addr, name) == 2) {
+        if(symbols->count == capacity) {
+            capacity = capacity ? capacity * 2 : MVM_PROFILE_INITIAL_CAPACITY;
+            mvm_symbol *grown = (mvm_symbol *)realloc(
+                symbols->symbols, capacity * sizeof(mvm_symbol));
+            if(!grown) {
+                ok = 0;
+                break;
+            }
+            symbols->symbols = grown;
+        }
+        const size_t size = strlen(name) + 1;
+        char *copy = (char *)malloc(size);
+        ok = copy != NULL;
+        if(ok) {
+            memcpy(copy, name, size);
+            symbols->symbols[symbols->count].addr = addr;
+            symbols->symbols[symbols->count].name = copy;
+            symbols->count++;
+        }
+    }
+    ok = ok && !ferror(f) && feof(f);
+    fclose(f);
+    if(!ok) {
+        mvm_symbols_free(symbols);
+        return 0;
+    }
+    qsort(symbols->symbols, symbols->count, sizeof(mvm_symbol),
+          mvm_symbols_compare);
+    return 1;
+}
+
+const char *mvm_symbols_lookup(const mvm_symbols *symbols, uint32_t addr) {
+    // the first symbol past addr, then the one before it
+    uint32_t low = 0, high = symbols->count;
+    while(low < high) {
+        const uint32_t mid = low + (high - low) / 2;
+        if(symbols->symbols[mid].addr <= addr)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low ? symbols->symbols[low - 1].name : NULL;
+}
+
+void mvm_symbols_free(mvm_symbols *symbols) {
+    for(uint32_t i = 0; i < symbols->count; i++)
+        free(symbols->symbols[i].name);
+    free(symbols->symbols);
+    memset(symbols, 0, sizeof(mvm_symbols));
+}
+
+#endif
+
+#endif
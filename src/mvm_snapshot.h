@@ -0,0 +1,216 @@
+#ifndef MVM_SNAPSHOT_H
+#define MVM_SNAPSHOT_H
+
+// Snapshot files of a vm, for Linux. A snapshot holds the registers, stacks,
+// status and ram of a vm, along with sections of host memory such as the
+// memory of devices, each told apart by an id of the host's choosing.
+//
+// The file starts with a header, in the byte order of the host, and every
+// section, ram first, starts at a multiple of MVM_SNAPSHOT_ALIGN. Loading
+// reads the header and maps ram and the sections privately from the file, as
+// mvm_fork does from an image: nothing is copied, and the pages are only read
+// in when touched.
+//
+// MVM_SNAPSHOT_IMPLEMENTATION must be defined in the same file as
+// MVM_IMPLEMENTATION, MVM_GUARD_IMPLEMENTATION and MVM_FORK_IMPLEMENTATION.
+
+#include <stdint.h>
+#include "mvm.h"
+
+#define MVM_SNAPSHOT_MAGIC "mvmsnap"
+#define MVM_SNAPSHOT_VERSION 2
+// largest page size of the supported systems
+#define MVM_SNAPSHOT_ALIGN 0x10000
+#define MVM_SNAPSHOT_MAX_SECTIONS 16
+
+typedef struct mvm_section {
+    uint32_t id, size;
+    void *mem;
+} mvm_section;
+
+typedef struct mvm_snapshot_entry {
+    uint32_t id, size;
+    uint64_t offset;
+} mvm_snapshot_entry;
+
+typedef struct mvm_snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t ram_size, stack_size; // of the vm that saved it
+    uint32_t pc, sp, rsp, status;
+    uint32_t pending, enabled, servicing; // interrupts
+    uint32_t stk[MVM_STACK_SIZE], rstk[MVM_STACK_SIZE];
+    uint64_t ram_offset;
+    uint32_t section_count;
+    mvm_snapshot_entry sections[MVM_SNAPSHOT_MAX_SECTIONS];
+} mvm_snapshot_header;
+
+// Saves the vm and count sections. Returns 0 if the file can't be written.
+int mvm_snapshot_save(const char *path, const mvm *vm,
+                      const mvm_section *sections, uint32_t count);
+// Sets up vm from the snapshot as mvm_init would, with its ram. Each of the
+// count sections, given by id and size, is mapped into its mem. Returns 0 if
+// the file is not a snapshot of this build, or lacks one of the sections.
+int mvm_snapshot_load(const char *path, mvm *vm, mvm_section *sections,
+                      uint32_t count);
+// only after a successful mvm_snapshot_load, with the same sections
+void mvm_snapshot_free(mvm *vm, mvm_section *sections, uint32_t count);
+
+#ifdef MVM_SNAPSHOT_IMPLEMENTATION
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "mvm_fork.h"
+
+#define MVM_SNAPSHOT_ALIGN_UP(x)                                               \
+    (((x) + MVM_SNAPSHOT_ALIGN - 1) & ~(uint64_t)(MVM_SNAPSHOT_ALIGN - 1))
+
+int mvm_snapshot_save(const char *path, const mvm *vm,
+                      const mvm_section *sections, uint32_t count) {
+    if(count > MVM_SNAPSHOT_MAX_SECTIONS)
+        return 0;
+    mvm_snapshot_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MVM_SNAPSHOT_MAGIC, sizeof(MVM_SNAPSHOT_MAGIC));
+    header.version = MVM_SNAPSHOT_VERSION;
+    header.ram_size = MVM_RAM_SIZE;
+    header.stack_size = MVM_STACK_SIZE;
+    header.pc = vm->pc;
+    header.sp = vm->sp;
+    header.rsp = vm->rsp;
+    header.status = vm->status;
+    header.pending = vm->pending;
+    header.enabled = vm->enabled;
+    header.servicing = vm->servicing;
+    memcpy(header.stk, vm->stk, sizeof(header.stk));
+    memcpy(header.rstk, vm->rstk, sizeof(header.rstk));
+    header.ram_offset = MVM_SNAPSHOT_ALIGN_UP(sizeof(header));
+    header.section_count = count;
+    uint64_t end = header.ram_offset + MVM_RAM_SIZE;
+    for(uint32_t i = 0; i < count; i++) {
+        header.sections[i].id = sections[i].id;
+        header.sections[i].size = sections[i].size;
+        header.sections[i].offset = MVM_SNAPSHOT_ALIGN_UP(end);
+        end = header.sections[i].offset + sections[i].size;
+    }
+
+    const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+        return 0;
+    int ok =
+        pwrite(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+        pwrite(fd, vm->ram, MVM_RAM_SIZE, (off_t)header.ram_offset) ==
+            MVM_RAM_SIZE;
+    for(uint32_t i = 0; ok && i < count; i++) {
+        ok = pwrite(fd, sections[i].mem, sections[i].size,
+                    (off_t)header.sections[i].offset) ==
+             (ssize_t)sections[i].size;
+    }
+    // the last section is mapped in whole pages
+    ok = ok && !ftruncate(fd, (off_t)MVM_SNAPSHOT_ALIGN_UP(end));
+    return !close(fd) && ok;
+}
+
+// the header describes a vm of this build, and fits in a file of size bytes
+static int mvm_snapshot_check(const mvm_snapshot_header *header,
+                              uint64_t size) {
+    if(memcmp(header->magic, MVM_SNAPSHOT_MAGIC, sizeof(MVM_SNAPSHOT_MAGIC)) ||
+       header->version != MVM_SNAPSHOT_VERSION ||
+       header->ram_size != MVM_RAM_SIZE ||
+       header->stack_size != MVM_STACK_SIZE ||
+       header->sp > MVM_STACK_SIZE || header->rsp > MVM_STACK_SIZE ||
+       header->status >= MVM_STATUS_COUNT ||
+       header->section_count > MVM_SNAPSHOT_MAX_SECTIONS)
+        return 0;
+    if(header->ram_offset % MVM_SNAPSHOT_ALIGN ||
+       header->ram_offset > size || size - header->ram_offset < MVM_RAM_SIZE)
+        return 0;
+    for(uint32_t i = 0; i < header->section_count; i++) {
+        const mvm_snapshot_entry *entry = &header->sections[i];
+        if(entry->offset % MVM_SNAPSHOT_ALIGN || entry->offset > size ||
+           size - entry->offset < entry->size)
+            return 0;
+    }
+    return 1;
+}
+
+static void mvm_snapshot_unmap(mvm_section *sections, uint32_t count) {
+    for(uint32_t i = 0; i < count; i++) {
+        if(sections[i].mem)
+            munmap(sections[i].mem, sections[i].size);
+        sections[i].mem = NULL;
+    }
+}
+
+int mvm_snapshot_load(const char *path, mvm *vm, mvm_section *sections,
+                      uint32_t count) {
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return 0;
+    mvm_snapshot_header header;
+    struct stat st;
+    if(pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+       fstat(fd, &st) || !mvm_snapshot_check(&header, (uint64_t)st.st_size)) {
+        close(fd);
+        return 0;
+    }
+
+    for(uint32_t i = 0; i < count; i++)
+        sections[i].mem = NULL;
+    int ok = 1;
+    for(uint32_t i = 0; ok && i < count; i++) {
+        const mvm_snapshot_entry *entry = NULL;
+        for(uint32_t j = 0; j < header.section_count; j++) {
+            if(header.sections[j].id == sections[i].id)
+                entry = &header.sections[j];
+        }
+        ok = entry && entry->size == sections[i].size;
+        if(ok && entry->size) {
+            void *mem = mmap(NULL, entry->size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE, fd, (off_t)entry->offset);
+            ok = mem != MAP_FAILED;
+            if(ok)
+                sections[i].mem = mem;
+        }
+    }
+
+    mvm_image image;
+    memset(&image, 0, sizeof(image));
+    mvm_init(&image.vm, NULL);
+    image.vm.pc = header.pc;
+    image.vm.sp = header.sp;
+    image.vm.rsp = header.rsp;
+    image.vm.status = (enum mvm_status)header.status;
+    image.vm.pending = header.pending;
+    image.vm.enabled = header.enabled;
+    image.vm.servicing = header.servicing;
+    mvm_interrupt_update(&image.vm);
+#ifdef MVM_GUARD_STACKS
+    memcpy(image.stk, header.stk, sizeof(image.stk));
+    memcpy(image.rstk, header.rstk, sizeof(image.rstk));
+#else
+    memcpy(image.vm.stk, header.stk, sizeof(image.vm.stk));
+    memcpy(image.vm.rstk, header.rstk, sizeof(image.vm.rstk));
+#endif
+    image.fd = fd;
+    image.offset = header.ram_offset;
+    image.size = MVM_RAM_SIZE;
+    ok = ok && mvm_fork(&image, vm);
+    // the mappings outlive the file descriptor
+    close(fd);
+    if(!ok)
+        mvm_snapshot_unmap(sections, count);
+    return ok;
+}
+
+void mvm_snapshot_free(mvm *vm, mvm_section *sections, uint32_t count) {
+    mvm_fork_free(vm);
+    mvm_snapshot_unmap(sections, count);
+}
+
+#endif
+
+#endif
@@ -0,0 +1,6 @@
+.org $40
+:loop
+    push $1000 lw push 1 add dup push $1000 sw
+    push 100000 ltu ,loop cjmp
+    push $1000 lw
+    brk
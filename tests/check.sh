@@ -0,0 +1,134 @@
+#!/bin/bash
+# Runs the roms assembled from tests/ by make check, each with the runner and
+# options given, and fails unless the output has a line matching the pattern
+# given.
+
+failed=0
+
+# check runner name pattern [options...]
+check() {
+    local runner=$1 name=$2 pattern=$3
+    shift 3
+    local out
+    out=$(./bin/$runner "$@" build/tests/$name.rom 2>&1)
+    if grep -q -- "$pattern" <<< "$out"; then
+        echo "ok   $runner $name $*"
+    else
+        echo "FAIL $runner $name $*: no line matching '$pattern' in"
+        echo "$out"
+        failed=1
+    fi
+}
+
+# check_snapshot runner name pattern [options...]: as check, resuming the
+# snapshot that options of an earlier check saved from the rom instead
+check_snapshot() {
+    local runner=$1 name=$2 pattern=$3
+    shift 3
+    local out
+    out=$(./bin/$runner "$@" --load-snapshot build/tests/$name.snapshot 2>&1)
+    if grep -q -- "$pattern" <<< "$out"; then
+        echo "ok   $runner $name.snapshot $*"
+    else
+        echo "FAIL $runner $name.snapshot $*: no line matching '$pattern' in"
+        echo "$out"
+        failed=1
+    fi
+}
+
+# check_batch runner name copies pattern: runs copies of the rom together with
+# the batch mode of the runner, on two threads, and fails unless the output has
+# a line matching the pattern for each of them
+check_batch() {
+    local runner=$1 name=$2 copies=$3 pattern=$4
+    local out
+    out=$(./bin/$runner --batch -j 2 $(for i in $(seq $copies); do
+        echo build/tests/$name.rom; done) 2>&1)
+    if [ "$(grep -c -- "$pattern" <<< "$out")" = "$copies" ]; then
+        echo "ok   $runner --batch $name x$copies"
+    else
+        echo "FAIL $runner --batch $name x$copies: not $copies lines" \
+            "matching '$pattern' in"
+        echo "$out"
+        failed=1
+    fi
+}
+
+# a constant division by zero in a hot loop, folded by the jit
+check mvm jit_div_zero '^status: division by zero$'
+check mvm jit_div_zero '^status: division by zero$' --jit
+# INT32_MIN / -1, left by the jit to the interpreters, wraps around
+check mvm jit_div_overflow '000003e8 80000000 00000000'
+check mvm jit_div_overflow '000003e8 80000000 00000000' --jit
+# a store rewriting the rest of its block, which pops an empty stack then
+check mvm smc_block '^status: stack underflow$'
+check mvm smc_block '^status: stack underflow$' --jit
+# The runner verifies roms once loaded: proved blocks chained into each other
+# still fault on the stacks they outgrow, and stop chaining once a store
+# rewrites the code they jump to.
+check mvm verify_overflow '^status: stack overflow$'
+check mvm verify_recursion '^status: return stack overflow$'
+check mvm verify_smc_chain '^status: stack underflow$'
+# push32 of a label followed by call, fused by the instruction cache
+check mvm-stats super_push_call '"push call": [1-9]' --stats -
+# The guard pages fault on the stacks where the checks would, with the same
+# status.
+check mvm guard_underflow '^status: stack underflow$'
+check mvm-guard guard_underflow '^status: stack underflow$'
+check mvm-guard verify_overflow '^status: stack overflow$'
+check mvm guard_return '^status: return stack underflow$'
+check mvm-guard guard_return '^status: return stack underflow$'
+check mvm-guard verify_recursion '^status: return stack overflow$'
+# Past ram, loads and stores fault and are replayed on the frame buffer, or end
+# the run where nothing is mapped.
+check mvm mmio_replay '0000beef 12345678 00000056'
+check mvm-guard mmio_replay '0000beef 12345678 00000056'
+check mvm ram_fault '^status: segmentation fault$'
+check mvm-guard ram_fault '^status: segmentation fault$'
+# More roms than threads, run a slice at a time, each to the exact count of
+# instructions it takes.
+check_batch mvm batch_counter 5 '^build/tests/batch_counter.rom: halted, 1100003 instructions$'
+check_batch mvm-guard batch_counter 5 '^build/tests/batch_counter.rom: halted, 1100003 instructions$'
+# Copies of a rom fork its image, and count in ram pages of their own.
+check_batch mvm batch_counter 5 '^ *000186a0 *$'
+check_batch mvm-guard batch_counter 5 '^ *000186a0 *$'
+# A vm saved as it halts resumes past the brk, with its stack and the frame
+# buffer it wrote.
+rm -f build/tests/snapshot_resume.snapshot
+check mvm snapshot_resume '^ *00000001 *$' \
+    --save-snapshot build/tests/snapshot_resume.snapshot
+check_snapshot mvm snapshot_resume '^ *00000001 0000beef *$'
+check_snapshot mvm snapshot_resume '^ *00000001 0000beef *$' --jit
+rm -f build/tests/snapshot_resume.snapshot
+check mvm-guard snapshot_resume '^ *00000001 *$' \
+    --save-snapshot build/tests/snapshot_resume.snapshot
+check_snapshot mvm-guard snapshot_resume '^ *00000001 0000beef *$'
+# The timer interrupts a busy loop three times through vector 0, whose handler
+# counts in ram.
+check mvm interrupt_timer '^ *00000003 *$' --timer 1000
+check mvm interrupt_timer '^ *00000003 *$' --timer 1000 --jit
+check mvm-guard interrupt_timer '^ *00000003 *$' --timer 1000
+# wfi sleeps until the next tick, or stops the vm waiting without a timer.
+check mvm interrupt_wfi '^ *00000003 *$' --timer 1000
+check mvm interrupt_wfi '^ *00000003 *$' --timer 1000 --jit
+check mvm-guard interrupt_wfi '^ *00000003 *$' --timer 1000
+check mvm interrupt_wfi '^status: waiting$'
+# A run ends on its limit exactly, here 6 instructions into the block of the
+# loop, which takes 11.
+check mvmtest batch_counter '^ran 17 instructions, pc 0000004b$' run 17
+check mvmtest batch_counter '^ran 1000005 instructions, pc 0000004b$' run 1000005
+check mvmtest batch_counter '^ran 1000005 instructions, pc 0000004b$' \
+    run 1000005 --jit
+# mvm_run_until stops before a breakpoint, going past it on the next run, after
+# the return from a call, and after a store to the word watched.
+check mvmtest until_call \
+    '^hit breakpoint at pc 00000080 after 11 instructions$' until break 0x80
+check mvmtest until_call '^hit return at pc 00000048 after 4 instructions$' \
+    until return 0x80
+check mvmtest until_call '^hit store at pc 00000086 after 6 instructions$' \
+    until store 0x1000
+# a request from another thread ends a run looping forever, natively too
+check mvmtest stop_loop '^stopped$' stop
+check mvmtest stop_loop '^stopped$' stop --jit
+
+exit $failed
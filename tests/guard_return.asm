@@ -0,0 +1,2 @@
+.org $40
+    ret
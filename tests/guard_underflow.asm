@@ -0,0 +1,3 @@
+.org $40
+    push 1 pop pop
+    brk
@@ -0,0 +1,13 @@
+.org 0
+.word $80
+
+.org $40
+    push 1 ei
+:loop
+    push $1000 lw push 3 ltu ,loop cjmp
+    push $1000 lw
+    brk
+
+.org $80
+    push $1000 lw push 1 add push $1000 sw
+    reti
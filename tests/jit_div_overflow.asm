@@ -0,0 +1,8 @@
+.org $40
+    push 0
+:loop
+    push $80000000 push $ffffffff div pop
+    push 1 add dup push 1000 ltu ,loop cjmp
+    push $80000000 push $ffffffff div
+    push $80000000 push $ffffffff rem
+    brk
@@ -0,0 +1,6 @@
+.org $40
+    push 0
+:loop
+    push 1 add dup push 1000 ltu ,loop cjmp
+    push 7 push 0 div
+    brk
@@ -0,0 +1,6 @@
+.org $40
+    push $beef push $80000010 sh
+    push $12345678 push $80000020 sw
+    push $80000010 lhu push $80000020 lw
+    push $80000021 lbu
+    brk
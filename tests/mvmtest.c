@@ -0,0 +1,183 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#define MVM_IMPLEMENTATION
+#include "mvm.h"
+#define MVM_JIT_IMPLEMENTATION
+#include "mvm_jit.h"
+#define MVM_GUARD_IMPLEMENTATION
+#include "mvm_guard.h"
+#include "util.h"
+
+// Runs a rom of tests/ through the parts of the api that the runner doesn't
+// reach, for tests/check.sh, and prints what the command given found. The vm
+// runs as in the runner: verified, with the instruction cache, under the guard.
+
+// a stop request lands this long after the run starts
+#define STOP_DELAY_NS 10000000
+// More instructions than a stopped run goes through once the request is made,
+// and fewer than the budget compiled code spends before it leaves without
+// seeing it.
+#define STOP_BOUND (1u << 30)
+
+typedef struct tester {
+    mvm vm;
+    uint8_t ram[MVM_RAM_SIZE];
+    mvm_icache icache;
+    mvm_jit jit;
+    int use_jit;
+} tester;
+
+// fails on an empty rom, as bench does
+static int load(const char *path, uint8_t *ram) {
+    FILE *f = fopen(path, "rb");
+    if(!f)
+        return 0;
+    memset(ram, 0, MVM_RAM_SIZE);
+    const size_t size = fread(ram, 1, MVM_RAM_SIZE, f);
+    const int ok = size && !ferror(f);
+    fclose(f);
+    return ok;
+}
+
+static int tester_init(tester *t, const char *rom_path) {
+    if(!load(rom_path, t->ram)) {
+        FATAL("failed to load %s: %s", rom_path, strerror(errno));
+        return 0;
+    }
+    mvm_init(&t->vm, t->ram);
+    if(!mvm_guard_init(&t->vm)) {
+        FATAL("failed to set up the guard pages");
+        return 0;
+    }
+    mvm_icache_attach(&t->vm, &t->icache);
+    mvm_verify(&t->vm);
+    if(t->use_jit && !mvm_jit_init(&t->jit, &t->vm)) {
+        fprintf(stderr, "jit unavailable, using the interpreter\n");
+        t->use_jit = 0;
+    }
+    return 1;
+}
+
+static void tester_free(tester *t) {
+    if(t->use_jit)
+        mvm_jit_free(&t->jit);
+    mvm_guard_free(&t->vm);
+}
+
+static uint32_t tester_run(tester *t, uint32_t limit) {
+    if(t->use_jit)
+        return mvm_jit_run(&t->vm, limit);
+    return mvm_guard_run(&t->vm, limit);
+}
+
+static void *stop_later(void *vm) {
+    const struct timespec ts = {0, STOP_DELAY_NS};
+    while(nanosleep(&ts, NULL) != 0 && errno == EINTR)
+        ;
+    mvm_stop((mvm *)vm);
+    return NULL;
+}
+
+// Runs a rom looping forever with no limit to speak of, which another thread
+// asks to stop.
+static int test_stop(tester *t) {
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, stop_later, &t->vm) != 0) {
+        FATAL("failed to start a thread");
+        return 1;
+    }
+    const uint32_t ran = tester_run(t, UINT32_MAX);
+    pthread_join(thread, NULL);
+    printf("status: %s\n", mvm_status_name[t->vm.status]);
+    if(ran < STOP_BOUND)
+        printf("stopped\n");
+    else
+        printf("ran %u instructions past the request\n", ran);
+    return 0;
+}
+
+// Runs the rom for limit instructions, which must stop it exactly there, even
+// in the middle of a block.
+static int test_run(tester *t, uint32_t limit) {
+    const uint32_t ran = tester_run(t, limit);
+    printf("status: %s\n", mvm_status_name[t->vm.status]);
+    printf("ran %u instructions, pc %08x\n", ran, t->vm.pc);
+    return 0;
+}
+
+static const char *const hit_name[] = {"none", "breakpoint", "return", "store"};
+
+static void print_until(const tester *t, const mvm_until *until,
+                        uint32_t ran) {
+    printf("hit %s at pc %08x after %u instructions\n", hit_name[until->hit],
+           t->vm.pc, ran);
+}
+
+// Runs the rom with mvm_run_until: twice to the breakpoint at pc, or to the
+// return from the call reaching it, or until a store to the word at the
+// address given.
+static int test_until(tester *t, const char *condition, uint32_t value) {
+    static mvm_until until;
+    mvm_until_init(&until);
+    if(strcmp(condition, "store") == 0) {
+        until.watch_addr = value;
+        until.watch_size = sizeof(uint32_t);
+        print_until(t, &until, mvm_guard_run_until(&t->vm, UINT32_MAX, &until));
+        return 0;
+    }
+    mvm_until_break(&until, value, 1);
+    print_until(t, &until, mvm_guard_run_until(&t->vm, UINT32_MAX, &until));
+    if(strcmp(condition, "return") == 0) {
+        mvm_until_break(&until, value, 0);
+        until.depth = t->vm.rsp;
+    }
+    print_until(t, &until, mvm_guard_run_until(&t->vm, UINT32_MAX, &until));
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    static tester t;
+    int arg = 1;
+    const char *command = arg < argc ? argv[arg++] : "";
+    const int has_limit = strcmp(command, "run") == 0;
+    const int has_until = strcmp(command, "until") == 0;
+    const char *condition = "";
+    uint32_t value = 0;
+    if(has_until && arg < argc)
+        condition = argv[arg++];
+    if((has_limit || has_until) && arg < argc)
+        value = (uint32_t)strtoul(argv[arg++], NULL, 0);
+    if(!has_until && arg < argc && strcmp(argv[arg], "--jit") == 0) {
+        t.use_jit = 1;
+        arg++;
+    }
+    const int valid =
+        (strcmp(command, "stop") == 0 || has_limit ||
+         (has_until && (strcmp(condition, "break") == 0 ||
+                        strcmp(condition, "return") == 0 ||
+                        strcmp(condition, "store") == 0))) &&
+        arg == argc - 1 && argv[arg][0] != '-';
+    if(!valid) {
+        FATAL("usage: %s stop [--jit] file.rom\n"
+              "       %s run limit [--jit] file.rom\n"
+              "       %s until (break pc | return pc | store addr) file.rom",
+              argv[0], argv[0], argv[0]);
+        return 1;
+    }
+    if(!tester_init(&t, argv[arg]))
+        return 1;
+    int ret;
+    if(has_limit)
+        ret = test_run(&t, value);
+    else if(has_until)
+        ret = test_until(&t, condition, value);
+    else
+        ret = test_stop(&t);
+    tester_free(&t);
+    return ret;
+}
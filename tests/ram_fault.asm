@@ -0,0 +1,3 @@
+.org $40
+    push 7 push $40000000 sw
+    brk
@@ -0,0 +1,4 @@
+.org $40
+    push 6 push $45 sb
+    push 7
+    brk
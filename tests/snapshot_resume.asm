@@ -0,0 +1,6 @@
+.org $40
+    push $beef push $80000000 sh
+    push 1
+    brk
+    push $80000000 lhu
+    brk
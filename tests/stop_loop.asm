@@ -0,0 +1,4 @@
+.org $40
+    push 0
+:loop
+    push 1 add ,loop jmp
@@ -0,0 +1,9 @@
+.org $40
+
+:main
+    ,function call
+    ,function call
+    brk
+
+:function
+    ret
@@ -0,0 +1,11 @@
+.org $40
+    push 5
+:loop
+    ,function call
+    push 1 sub dup ,loop cjmp
+    brk
+
+.org $80
+:function
+    push $2a push $1000 sw
+    ret
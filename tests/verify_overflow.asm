@@ -0,0 +1,3 @@
+.org $40
+:loop
+    push 1 ,loop jmp
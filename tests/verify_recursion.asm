@@ -0,0 +1,3 @@
+.org $40
+:function
+    push 1 pop ,function call
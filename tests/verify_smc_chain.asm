@@ -0,0 +1,8 @@
+.org $40
+    push 6 ,target sb
+    ,target jmp
+
+.org $50
+:target
+    push 7
+    brk